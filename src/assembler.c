@@ -0,0 +1,1424 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<ctype.h>
+#include<limits.h>
+#include<dirent.h>
+#include<unistd.h>
+#include<sys/stat.h>
+#include "cpu.h"
+#include "assembler.h"
+
+#define MAX_MACRO_DEPTH 64
+#define MAX_MACRO_REPLACE 8 // compiler.py passes re.M as the count of re.sub
+#define CHUNK_SIZE (1 << 16)
+#define CACHE_MAGIC "TRVU"
+#define CACHE_VERSION 1
+
+//---------------------------------------------
+
+// The same steps as compiler.py, without its files in between: the sources
+// are concatenated behind a "j _start", macros are expanded, comments and
+// labels are removed and every line becomes one command. Each step keeps
+// the quirks of the python version, so both produce the same program.
+//
+// Macro definitions are collected from all files first. Then every file is
+// expanded and parsed on its own into a unit, with its labels and the uses
+// of labels (relocations) kept by name. Units are cached by the hash of
+// their lines and of every macro they looked up, so after an edit only the
+// changed files and the files using a changed macro are assembled again.
+// Linking places the units behind each other and resolves the labels.
+
+static const char *names[] = {
+	[EMPTY] = "EMPTY", [ADD] = "ADD", [SUB] = "SUB", [AND] = "AND", [OR] = "OR", [XOR] = "XOR",
+	[SLT] = "SLT", [SLTU] = "SLTU", [SRA] = "SRA", [SRL] = "SRL", [SLL] = "SLL", [MUL] = "MUL",
+	[SLLI] = "SLLI", [ADDI] = "ADDI", [ANDI] = "ANDI", [ORI] = "ORI", [XORI] = "XORI", [SLTI] = "SLTI",
+	[SLTIU] = "SLTIU", [SRAI] = "SRAI", [SRLI] = "SRLI", [LUI] = "LUI", [AUIPC] = "AUIPC",
+	[LW] = "LW", [SW] = "SW", [BEQ] = "BEQ", [BNE] = "BNE", [BLT] = "BLT", [BGE] = "BGE",
+	[BLTU] = "BLTU", [BGEU] = "BGEU", [JAL] = "JAL", [JALR] = "JALR", [FLAG] = "FLAG",
+	[NOP] = "NOP", [LI] = "LI", [LA] = "LA", [MV] = "MV", [NOT] = "NOT", [NEG] = "NEG",
+	[SEQZ] = "SEQZ", [SNEZ] = "SNEZ", [SLTZ] = "SLTZ", [SGTZ] = "SGTZ", [BEQZ] = "BEQZ",
+	[BNEZ] = "BNEZ", [BLEZ] = "BLEZ", [BGEZ] = "BGEZ", [BLTZ] = "BLTZ", [BGTZ] = "BGTZ",
+	[BGT] = "BGT", [BLE] = "BLE", [BGTU] = "BGTU", [BLEU] = "BLEU", [J] = "J", [JR] = "JR",
+	[RET] = "RET", [CALL] = "CALL", [LEAVE] = "LEAVE",
+	[LB] = "LB", [LH] = "LH", [LBU] = "LBU", [LHU] = "LHU", [SB] = "SB", [SH] = "SH",
+	[MULH] = "MULH", [MULHSU] = "MULHSU", [MULHU] = "MULHU", [DIV] = "DIV", [DIVU] = "DIVU",
+	[REM] = "REM", [REMU] = "REMU", [ECALL] = "ECALL", [EBREAK] = "EBREAK", [ILLEGAL] = "ILLEGAL",
+	[LR] = "LR", [SC] = "SC", [AMOSWAP] = "AMOSWAP", [AMOADD] = "AMOADD", [AMOXOR] = "AMOXOR",
+	[AMOAND] = "AMOAND", [AMOOR] = "AMOOR", [AMOMIN] = "AMOMIN", [AMOMAX] = "AMOMAX",
+	[AMOMINU] = "AMOMINU", [AMOMAXU] = "AMOMAXU", [FENCE] = "FENCE", [CSRR] = "CSRR"
+};
+
+#define TYPE_COUNT (sizeof(names)/sizeof(names[0]))
+
+static const char *aliases[] = {
+	"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2", "a3", "a4",
+	"a5", "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6"
+};
+
+// strings are (pointer, length) views into the sources, copies live in
+// chunks that are freed together
+typedef struct Chunk {
+	struct Chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+} Chunk;
+
+typedef struct Lines {
+	char **line;
+	int32_t count;
+	int32_t size;
+} Lines;
+
+// open addressing, string keys to int32 values
+typedef struct Table {
+	const char **keys;
+	size_t *lengths;
+	int32_t *values;
+	int32_t size;
+	int32_t count;
+} Table;
+
+typedef struct Macro {
+	uint64_t hash; // of the arguments and the body
+	char **args;
+	size_t *argLengths;
+	int32_t argCount;
+	char *body;
+	size_t length;
+	size_t size;
+} Macro;
+
+typedef struct Source {
+	char *path;
+	Lines lines; // without the macro definitions
+} Source;
+
+typedef struct Label {
+	char *name;
+	int32_t line;
+} Label;
+
+// a label used as an argument, resolved when linking
+typedef struct Reloc {
+	char *name;
+	int32_t line;
+	int32_t arg;
+} Reloc;
+
+// a name looked up as macro, with the hash of the macro or 0 for none
+typedef struct Dep {
+	char *name;
+	uint64_t hash;
+} Dep;
+
+typedef struct Unit {
+	Lines expanded; // the listing of this file
+	Command *commands;
+	int32_t count;
+	int32_t size;
+	Label *labels;
+	int32_t labelCount;
+	int32_t labelSize;
+	Reloc *relocs;
+	int32_t relocCount;
+	int32_t relocSize;
+	Dep *deps;
+	int32_t depCount;
+	int32_t depSize;
+	Table depNames;
+} Unit;
+
+typedef struct Assembler {
+	Chunk *chunks;
+	Source *sources;
+	int32_t sourceCount;
+	int32_t sourceSize;
+	Table macroNames;
+	Macro *macros;
+	int32_t macroCount;
+	Unit *unit; // being expanded
+	char *cacheDir; // NULL without cache
+	char cacheReal[PATH_MAX]; // not walked as a source directory
+	int32_t reused;
+	int warnings; // printed while building the unit, it is not cached then
+	int errors;
+} Assembler;
+
+//------------ HELPERS -------------
+
+static int isWord (char c) {
+
+	return isalnum((unsigned char)c) || c == '_';
+
+}
+
+static int isSpace (char c) {
+
+	return isspace((unsigned char)c);
+
+}
+
+static char *copyString (Assembler *as, const char *s, size_t length) {
+
+	if (as->chunks == NULL || as->chunks->used + length + 1 > as->chunks->size) {
+		size_t size = length + 1 > CHUNK_SIZE ? length + 1 : CHUNK_SIZE;
+		Chunk *chunk = malloc(sizeof(Chunk) + size);
+		if (chunk == NULL) {
+			printf("ERROR: Cannot allocate assembler memory\n");
+			exit(EXIT_FAILURE);
+		}
+		chunk->next = as->chunks;
+		chunk->used = 0;
+		chunk->size = size;
+		as->chunks = chunk;
+	}
+	char *copy = as->chunks->data + as->chunks->used;
+	memcpy(copy, s, length);
+	copy[length] = '\0';
+	as->chunks->used += length + 1;
+	return copy;
+
+}
+
+static void pushLine (Lines *lines, char *line) {
+
+	if (lines->count == lines->size) {
+		lines->size = lines->size == 0 ? 1024 : lines->size*2;
+		lines->line = realloc(lines->line, sizeof(char *)*lines->size);
+		if (lines->line == NULL) {
+			printf("ERROR: Cannot allocate assembler memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	lines->line[lines->count++] = line;
+
+}
+
+static void *reserve (void *array, int32_t *size, int32_t count, size_t element) {
+
+	if (count < *size) {
+		return array;
+	}
+	*size = *size == 0 ? 16 : *size*2;
+	array = realloc(array, element*(*size));
+	if (array == NULL) {
+		printf("ERROR: Cannot allocate assembler memory\n");
+		exit(EXIT_FAILURE);
+	}
+	return array;
+
+}
+
+static uint64_t hash64 (uint64_t hash, const void *data, size_t length) {
+
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ ((const uint8_t *)data)[i])*1099511628211ULL;
+	}
+	return hash;
+
+}
+
+static uint32_t hashString (const char *s, size_t length) {
+
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (uint8_t)s[i])*16777619u;
+	}
+	return hash;
+
+}
+
+// returns the slot of key, NULL if it is missing and insert is not set
+static int32_t *tableFind (Table *table, const char *key, size_t length, int insert) {
+
+	if (insert && (table->count + 1)*2 > table->size) {
+		Table grown = {0};
+		grown.size = table->size == 0 ? 256 : table->size*2;
+		grown.keys = calloc(grown.size, sizeof(char *));
+		grown.lengths = calloc(grown.size, sizeof(size_t));
+		grown.values = calloc(grown.size, sizeof(int32_t));
+		if (grown.keys == NULL || grown.lengths == NULL || grown.values == NULL) {
+			printf("ERROR: Cannot allocate assembler memory\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int32_t i = 0; i < table->size; i++) {
+			if (table->keys[i] != NULL) {
+				*tableFind(&grown, table->keys[i], table->lengths[i], 1) = table->values[i];
+			}
+		}
+		free(table->keys);
+		free(table->lengths);
+		free(table->values);
+		*table = grown;
+	}
+	if (table->size == 0) {
+		return NULL;
+	}
+	uint32_t i = hashString(key, length) & (table->size - 1);
+	while (table->keys[i] != NULL) {
+		if (table->lengths[i] == length && memcmp(table->keys[i], key, length) == 0) {
+			return &table->values[i];
+		}
+		i = (i + 1) & (table->size - 1);
+	}
+	if (!insert) {
+		return NULL;
+	}
+	table->keys[i] = key;
+	table->lengths[i] = length;
+	table->count++;
+	return &table->values[i];
+
+}
+
+static void freeTable (Table *table) {
+
+	free(table->keys);
+	free(table->lengths);
+	free(table->values);
+
+}
+
+// re.split(r"\s*,\s*|\s+", s) as used for macro arguments, returns the
+// number of parts
+static int32_t splitMacroArgs (Assembler *as, const char *s, size_t length, char ***parts, size_t **lengths) {
+
+	int32_t count = 0;
+	int32_t size = 4;
+	*parts = malloc(sizeof(char *)*size);
+	*lengths = malloc(sizeof(size_t)*size);
+	size_t start = 0;
+	size_t i = 0;
+	while (i <= length) {
+		size_t end = i;
+		size_t next = i;
+		if (i < length) {
+			size_t j = i;
+			while (j < length && isSpace(s[j])) {
+				j++;
+			}
+			if (j < length && s[j] == ',') {
+				j++;
+				while (j < length && isSpace(s[j])) {
+					j++;
+				}
+				next = j;
+			} else if (j > i) {
+				next = j;
+			}
+		}
+		if (next == i && i < length) {
+			i++;
+			continue;
+		}
+		if (count == size) {
+			size *= 2;
+			*parts = realloc(*parts, sizeof(char *)*size);
+			*lengths = realloc(*lengths, sizeof(size_t)*size);
+		}
+		(*parts)[count] = copyString(as, s + start, end - start);
+		(*lengths)[count] = end - start;
+		count++;
+		if (i == length) {
+			break;
+		}
+		start = i = next;
+	}
+	return count;
+
+}
+
+//------------ SOURCES -------------
+
+static Source *newSource (Assembler *as, char *path) {
+
+	as->sources = reserve(as->sources, &as->sourceSize, as->sourceCount, sizeof(Source));
+	Source *source = &as->sources[as->sourceCount++];
+	memset(source, 0, sizeof(Source));
+	source->path = path == NULL ? NULL : copyString(as, path, strlen(path));
+	return source;
+
+}
+
+static void addSource (Assembler *as, char *text, size_t length) {
+
+	// python reads with universal newlines, so \r\n and \r end lines too
+	size_t start = 0;
+	for (size_t i = 0; i < length; i++) {
+		if (text[i] == '\n' || text[i] == '\r') {
+			pushLine(&as->sources[as->sourceCount-1].lines, copyString(as, text + start, i - start));
+			if (text[i] == '\r' && i + 1 < length && text[i+1] == '\n') {
+				i++;
+			}
+			start = i + 1;
+		}
+	}
+	// every file is followed by a newline, it ends a last unterminated line
+	pushLine(&as->sources[as->sourceCount-1].lines, copyString(as, text + start, length - start));
+
+}
+
+static int readSource (Assembler *as, char *path) {
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		printf("ERROR: cannot open %s\n", path);
+		return 0;
+	}
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	rewind(file);
+	char *text = malloc(length + 1);
+	if (text == NULL || fread(text, 1, length, file) != (size_t)length) {
+		printf("ERROR: cannot read %s\n", path);
+		free(text);
+		fclose(file);
+		return 0;
+	}
+	fclose(file);
+	newSource(as, path);
+	// a file ending in a newline gets an empty line behind it
+	addSource(as, text, length);
+	free(text);
+	return 1;
+
+}
+
+// os.walk order: the files of a directory in readdir order, then its
+// subdirectories the same way. Paths containing Makefile are skipped.
+static int walkSources (Assembler *as, char *dir) {
+
+	DIR *handle = opendir(dir);
+	if (handle == NULL) {
+		printf("ERROR: cannot open %s\n", dir);
+		return 0;
+	}
+	Lines subdirs = {0};
+	int ok = 1;
+	struct dirent *entry;
+	while ((entry = readdir(handle)) != NULL && ok) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		size_t length = strlen(dir);
+		int slash = length > 0 && dir[length-1] == '/';
+		char *path = malloc(length + strlen(entry->d_name) + 2);
+		sprintf(path, slash ? "%s%s" : "%s/%s", dir, entry->d_name);
+		struct stat st;
+		if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+			// like os.walk, symlinked directories are listed but not entered
+			char real[PATH_MAX];
+			int isCache = as->cacheDir != NULL && realpath(path, real) != NULL && strcmp(real, as->cacheReal) == 0;
+			if (isCache) {
+				free(path);
+				continue;
+			}
+			if (lstat(path, &st) == 0 && !S_ISLNK(st.st_mode)) {
+				pushLine(&subdirs, path);
+				continue;
+			}
+		} else if (strstr(path, "Makefile") == NULL) {
+			ok = readSource(as, path);
+		}
+		free(path);
+	}
+	closedir(handle);
+	for (int32_t i = 0; i < subdirs.count; i++) {
+		if (ok) {
+			ok = walkSources(as, subdirs.line[i]);
+		}
+		free(subdirs.line[i]);
+	}
+	free(subdirs.line);
+	return ok;
+
+}
+
+//------------ MACROS -------------
+
+static int matchesEndm (const char *line) {
+
+	while (isSpace(*line)) {
+		line++;
+	}
+	return strncmp(line, ".endm", 5) == 0;
+
+}
+
+// ^\s*\.macro(\s+|\s*,\s*)(\w+), returns the end of the match or 0
+static size_t matchMacro (const char *line, size_t *nameStart, size_t *nameEnd) {
+
+	size_t i = 0;
+	while (isSpace(line[i])) {
+		i++;
+	}
+	if (strncmp(line + i, ".macro", 6) != 0) {
+		return 0;
+	}
+	i += 6;
+	size_t j = i;
+	while (isSpace(line[j])) {
+		j++;
+	}
+	if (j == i || !isWord(line[j])) {
+		j = i;
+		while (isSpace(line[j])) {
+			j++;
+		}
+		if (line[j] != ',') {
+			return 0;
+		}
+		j++;
+		while (isSpace(line[j])) {
+			j++;
+		}
+	}
+	if (!isWord(line[j])) {
+		return 0;
+	}
+	*nameStart = j;
+	while (isWord(line[j])) {
+		j++;
+	}
+	*nameEnd = j;
+	return j;
+
+}
+
+static void appendBody (Macro *macro, const char *s, size_t length) {
+
+	if (macro->length + length + 1 > macro->size) {
+		macro->size = (macro->length + length + 1)*2;
+		macro->body = realloc(macro->body, macro->size);
+	}
+	memcpy(macro->body + macro->length, s, length);
+	macro->length += length;
+	macro->body[macro->length] = '\0';
+
+}
+
+// handles one line for collectMacros and returns the macro that is being
+// defined after it. Lines of a definition are set to NULL.
+static Macro *collectLine (Assembler *as, Macro *current, char **line) {
+
+	if (current != NULL) {
+		if (matchesEndm(*line)) {
+			current = NULL;
+		} else {
+			appendBody(current, *line, strlen(*line));
+			appendBody(current, "\n", 1);
+		}
+		*line = NULL;
+		return current;
+	}
+	size_t nameStart, nameEnd;
+	size_t end = matchMacro(*line, &nameStart, &nameEnd);
+	if (end == 0) {
+		return NULL;
+	}
+	char *name = *line + nameStart;
+	int32_t *slot = tableFind(&as->macroNames, name, nameEnd - nameStart, 0);
+	if (slot != NULL) {
+		// the later definition replaces the first one
+		printf("ERROR: two identical macros for %.*s\n", (int)(nameEnd - nameStart), name);
+		free(as->macros[*slot].body);
+		free(as->macros[*slot].args);
+		free(as->macros[*slot].argLengths);
+	} else {
+		slot = tableFind(&as->macroNames, name, nameEnd - nameStart, 1);
+		as->macros = realloc(as->macros, sizeof(Macro)*(as->macroCount + 1));
+		*slot = as->macroCount++;
+	}
+	current = &as->macros[*slot];
+	memset(current, 0, sizeof(Macro));
+	appendBody(current, "", 0);
+	// the arguments are the rest of the line, stripped
+	const char *args = *line + end;
+	size_t length = strlen(args);
+	while (length > 0 && isSpace(*args)) {
+		args++;
+		length--;
+	}
+	while (length > 0 && isSpace(args[length-1])) {
+		length--;
+	}
+	if (length > 0) {
+		current->argCount = splitMacroArgs(as, args, length, &current->args, &current->argLengths);
+	}
+	*line = NULL;
+	return current;
+
+}
+
+// takes the macro definitions out of the sources, like the first loop of
+// expand_macros. Their lines are dropped, they do not become commands.
+// A definition without .endm goes on into the next file.
+static void collectMacros (Assembler *as) {
+
+	Macro *current = NULL;
+	for (int32_t f = 0; f < as->sourceCount; f++) {
+		Lines *lines = &as->sources[f].lines;
+		int32_t kept = 0;
+		for (int32_t i = 0; i < lines->count; i++) {
+			char *line = lines->line[i];
+			current = collectLine(as, current, &line);
+			if (line != NULL) {
+				lines->line[kept++] = line;
+			}
+		}
+		lines->count = kept;
+	}
+	// a unit depends on the hash of every macro it expanded
+	for (int32_t i = 0; i < as->macroCount; i++) {
+		Macro *macro = &as->macros[i];
+		macro->hash = hash64(14695981039346656037ULL, macro->body, macro->length + 1);
+		for (int32_t j = 0; j < macro->argCount; j++) {
+			macro->hash = hash64(macro->hash, macro->args[j], macro->argLengths[j] + 1);
+		}
+		macro->hash |= 1; // 0 stands for no macro
+	}
+
+}
+
+static uint64_t macroHash (Assembler *as, const char *name, size_t length) {
+
+	int32_t *slot = tableFind(&as->macroNames, name, length, 0);
+	return slot == NULL ? 0 : as->macros[*slot].hash;
+
+}
+
+// replaces up to MAX_MACRO_REPLACE times \name followed by whitespace, a
+// comma or the end of the text
+static char *replaceArgument (char *text, const char *name, size_t nameLength, const char *value, size_t valueLength) {
+
+	size_t length = strlen(text);
+	size_t size = length + 1;
+	char *out = malloc(size);
+	size_t used = 0;
+	int replaced = 0;
+	size_t i = 0;
+	while (i < length) {
+		if (replaced < MAX_MACRO_REPLACE && text[i] == '\\' && i + 1 + nameLength <= length
+			&& memcmp(text + i + 1, name, nameLength) == 0) {
+			size_t after = i + 1 + nameLength;
+			if (after == length || isSpace(text[after]) || text[after] == ',') {
+				if (used + valueLength + length - i + 1 > size) {
+					size = (used + valueLength + length - i + 1)*2;
+					out = realloc(out, size);
+				}
+				memcpy(out + used, value, valueLength);
+				used += valueLength;
+				i = after;
+				replaced++;
+				continue;
+			}
+		}
+		if (used + 2 > size) {
+			size *= 2;
+			out = realloc(out, size);
+		}
+		out[used++] = text[i++];
+	}
+	out[used] = '\0';
+	free(text);
+	return out;
+
+}
+
+static void expandLine (Assembler *as, const char *line, size_t length, int depth);
+
+static void expandMacro (Assembler *as, Macro *macro, const char *line, size_t length, size_t prefix, int depth) {
+
+	// every occurrence of the indentation and name is cut out of the line,
+	// the rest is split into arguments behind an empty first part
+	char *rest = malloc(length + 1);
+	size_t used = 0;
+	for (size_t i = 0; i < length;) {
+		if (i + prefix <= length && memcmp(line + i, line, prefix) == 0) {
+			i += prefix;
+		} else {
+			rest[used++] = line[i++];
+		}
+	}
+	char **args;
+	size_t *argLengths;
+	int32_t count = splitMacroArgs(as, rest, used, &args, &argLengths) - 1;
+	free(rest);
+	if (count != macro->argCount) {
+		printf("ERROR: arguments given for %.*s do not match its %d arguments\n", (int)prefix, line, macro->argCount);
+		as->warnings++;
+	}
+
+	char *text = malloc(macro->length + 1);
+	memcpy(text, macro->body, macro->length + 1);
+	for (int32_t i = 0; i < macro->argCount; i++) {
+		const char *value = i < count ? args[i + 1] : "";
+		size_t valueLength = i < count ? argLengths[i + 1] : 0;
+		text = replaceArgument(text, macro->args[i], macro->argLengths[i], value, valueLength);
+	}
+	free(args);
+	free(argLengths);
+
+	// the body ends in a newline, its last part becomes an empty line
+	size_t start = 0;
+	size_t end = strlen(text);
+	for (size_t i = 0; i <= end; i++) {
+		if (i == end || text[i] == '\n') {
+			expandLine(as, text + start, i - start, depth + 1);
+			start = i + 1;
+		}
+	}
+	free(text);
+
+}
+
+static void expandLine (Assembler *as, const char *line, size_t length, int depth) {
+
+	size_t i = 0;
+	while (i < length && isSpace(line[i])) {
+		i++;
+	}
+	size_t nameStart = i;
+	while (i < length && isWord(line[i])) {
+		i++;
+	}
+	if (i > nameStart) {
+		Unit *unit = as->unit;
+		int32_t *slot = tableFind(&as->macroNames, line + nameStart, i - nameStart, 0);
+		if (tableFind(&unit->depNames, line + nameStart, i - nameStart, 0) == NULL) {
+			unit->deps = reserve(unit->deps, &unit->depSize, unit->depCount, sizeof(Dep));
+			Dep *dep = &unit->deps[unit->depCount++];
+			dep->name = copyString(as, line + nameStart, i - nameStart);
+			dep->hash = slot == NULL ? 0 : as->macros[*slot].hash;
+			*tableFind(&unit->depNames, dep->name, i - nameStart, 1) = unit->depCount - 1;
+		}
+		if (slot != NULL) {
+			if (depth == MAX_MACRO_DEPTH) {
+				printf("ERROR: macro %.*s expands itself\n", (int)(i - nameStart), line + nameStart);
+				as->errors++;
+				return;
+			}
+			expandMacro(as, &as->macros[*slot], line, length, i, depth);
+			return;
+		}
+	}
+	pushLine(&as->unit->expanded, copyString(as, line, length));
+
+}
+
+//------------ COMMANDS -------------
+
+// cuts the line at the first ; # . or // and the whitespace in front of it
+static size_t stripComment (const char *line) {
+
+	size_t i = 0;
+	while (line[i] != '\0' && line[i] != ';' && line[i] != '#' && line[i] != '.'
+		&& !(line[i] == '/' && line[i+1] == '/')) {
+		i++;
+	}
+	if (line[i] != '\0') {
+		while (i > 0 && isSpace(line[i-1])) {
+			i--;
+		}
+	}
+	return i;
+
+}
+
+// \s*(\w+):\s$, a label alone on its line
+static int matchLabel (const char *line, size_t length, size_t *nameStart, size_t *nameEnd) {
+
+	size_t i = 0;
+	while (i < length && isSpace(line[i])) {
+		i++;
+	}
+	*nameStart = i;
+	while (i < length && isWord(line[i])) {
+		i++;
+	}
+	*nameEnd = i;
+	if (i == *nameStart || i == length || line[i] != ':') {
+		return 0;
+	}
+	i++;
+	return i == length || (i + 1 == length && isSpace(line[i]));
+
+}
+
+// \d\(.+\), the offset(register) form of loads, stores and jalr
+static int hasBrackets (const char *line, size_t length) {
+
+	for (size_t i = 0; i + 1 < length; i++) {
+		if (isdigit((unsigned char)line[i]) && line[i+1] == '(') {
+			for (size_t j = length; j > i + 3; j--) {
+				if (line[j-1] == ')') {
+					return 1;
+				}
+			}
+			return 0;
+		}
+	}
+	return 0;
+
+}
+
+// re.split(r",? +|,|\(", line) for the first four parts
+static int32_t splitParts (const char *line, size_t length, const char **parts, size_t *lengths) {
+
+	int32_t count = 0;
+	size_t start = 0;
+	size_t i = 0;
+	while (i < length && count < 4) {
+		size_t next = i;
+		if (line[i] == ',' && i + 1 < length && line[i+1] == ' ') {
+			next = i + 1;
+			while (next < length && line[next] == ' ') {
+				next++;
+			}
+		} else if (line[i] == ' ') {
+			while (next < length && line[next] == ' ') {
+				next++;
+			}
+		} else if (line[i] == ',' || line[i] == '(') {
+			next = i + 1;
+		} else {
+			i++;
+			continue;
+		}
+		parts[count] = line + start;
+		lengths[count] = i - start;
+		count++;
+		start = i = next;
+	}
+	if (count < 4) {
+		parts[count] = line + start;
+		lengths[count] = length - start;
+		count++;
+	}
+	return count;
+
+}
+
+static int parseType (const char *name, size_t length, CommandType *type) {
+
+	if (length == 0) {
+		*type = EMPTY;
+		return 1;
+	}
+	for (size_t t = 0; t < TYPE_COUNT; t++) {
+		if (names[t] != NULL && strlen(names[t]) == length && strncasecmp(names[t], name, length) == 0) {
+			*type = (CommandType)t;
+			return 1;
+		}
+	}
+	return 0;
+
+}
+
+int parseRegister (const char *arg, size_t length, int32_t *value) {
+
+	size_t aliasLength = 0;
+	while (aliasLength < length && arg[aliasLength] != ')') {
+		aliasLength++;
+	}
+	if (aliasLength == 2 && strncasecmp(arg, "fp", 2) == 0) {
+		*value = 8;
+		return 1;
+	}
+	for (int32_t i = 0; i < 32; i++) {
+		if (strlen(aliases[i]) == aliasLength && memcmp(aliases[i], arg, aliasLength) == 0) {
+			*value = i;
+			return 1;
+		}
+	}
+	if (length >= 2 && arg[0] == 'x' && isdigit((unsigned char)arg[1])) {
+		if (length >= 3 && isdigit((unsigned char)arg[2])) {
+			*value = (arg[1] - '0')*10 + arg[2] - '0';
+			return 1;
+		}
+		*value = arg[1] - '0';
+		return 1;
+	}
+	return 0;
+
+}
+
+// get_arg_id: register alias, xN, decimal, hex or binary, in that order.
+// Returns 0 if arg is none of them, it is a label then.
+static int parseArg (const char *arg, size_t length, int32_t *value) {
+
+	if (parseRegister(arg, length, value)) {
+		return 1;
+	}
+
+	char number[64];
+	size_t digits = (arg[0] == '+' || arg[0] == '-') ? 1 : 0;
+	while (digits < length && isdigit((unsigned char)arg[digits])) {
+		digits++;
+	}
+	int decimal = digits == length && length > ((arg[0] == '+' || arg[0] == '-') ? 1 : 0);
+	int hex = length >= 3 && arg[0] == '0' && arg[1] == 'x' && isxdigit((unsigned char)arg[2]);
+	int binary = length >= 3 && arg[0] == '0' && arg[1] == 'b' && (arg[2] == '0' || arg[2] == '1');
+	if ((decimal || hex || binary) && length < sizeof(number)) {
+		// same as printing the python int and reading it back with atoi
+		memcpy(number, arg, length);
+		number[length] = '\0';
+		if (decimal) {
+			*value = (int32_t)strtol(number, NULL, 10);
+		} else {
+			*value = (int32_t)strtol(number + (binary ? 2 : 0), NULL, binary ? 2 : 16);
+		}
+		return 1;
+	}
+
+	return 0;
+
+}
+
+// parses the expanded lines of a unit. Labels and the arguments naming
+// them are kept by name, base is the first line of the unit in the program.
+static int compileUnit (Assembler *as, Unit *unit, int32_t base) {
+
+	Lines *lines = &unit->expanded;
+	size_t *lengths = malloc(sizeof(size_t)*(lines->count + 1));
+	for (int32_t i = 0; i < lines->count; i++) {
+		lengths[i] = stripComment(lines->line[i]);
+		size_t nameStart, nameEnd;
+		if (matchLabel(lines->line[i], lengths[i], &nameStart, &nameEnd)) {
+			unit->labels = reserve(unit->labels, &unit->labelSize, unit->labelCount, sizeof(Label));
+			char *name = copyString(as, lines->line[i] + nameStart, nameEnd - nameStart);
+			unit->labels[unit->labelCount++] = (Label){name, i};
+			lengths[i] = 0;
+		}
+	}
+
+	int ok = 1;
+	unit->commands = malloc(sizeof(Command)*(lines->count + 1));
+	unit->count = lines->count;
+	for (int32_t i = 0; i < lines->count && ok; i++) {
+		const char *line = lines->line[i];
+		size_t length = lengths[i];
+		int swap = hasBrackets(line, length);
+		while (length > 0 && isSpace(*line)) {
+			line++;
+			length--;
+		}
+		while (length > 0 && isSpace(line[length-1])) {
+			length--;
+		}
+		const char *parts[4];
+		size_t partLengths[4];
+		int32_t count = splitParts(line, length, parts, partLengths);
+		if (swap && count == 4) {
+			const char *part = parts[2];
+			size_t partLength = partLengths[2];
+			parts[2] = parts[3];
+			partLengths[2] = partLengths[3];
+			parts[3] = part;
+			partLengths[3] = partLength;
+		}
+		CommandType type;
+		if (!parseType(parts[0], partLengths[0], &type)) {
+			printf("ERROR: unknown instruction %.*s in line %d\n", (int)partLengths[0], parts[0], base + i + 1);
+			ok = 0;
+			break;
+		}
+		int32_t args[3] = {0, 0, 0};
+		for (int32_t j = 1; j < count; j++) {
+			if (!parseArg(parts[j], partLengths[j], &args[j-1])) {
+				unit->relocs = reserve(unit->relocs, &unit->relocSize, unit->relocCount, sizeof(Reloc));
+				char *name = copyString(as, parts[j], partLengths[j]);
+				unit->relocs[unit->relocCount++] = (Reloc){name, i, j - 1};
+			}
+		}
+		unit->commands[i] = (Command){type, args[0], args[1], args[2]};
+	}
+	free(lengths);
+	return ok;
+
+}
+
+//------------ CACHE -------------
+
+// a unit file: magic, version, number of command types, hash of the lines
+// and the path, then the dependencies, lines, commands, labels and
+// relocations. Integers are in host order, strings have their length first.
+
+typedef struct Reader {
+	uint8_t *data;
+	size_t size;
+	size_t pos;
+	int ok;
+} Reader;
+
+static void writeU32 (FILE *file, uint32_t value) {
+
+	fwrite(&value, sizeof(value), 1, file);
+
+}
+
+static void writeU64 (FILE *file, uint64_t value) {
+
+	fwrite(&value, sizeof(value), 1, file);
+
+}
+
+static void writeString (FILE *file, const char *s) {
+
+	uint32_t length = strlen(s);
+	writeU32(file, length);
+	fwrite(s, 1, length, file);
+
+}
+
+static void readBytes (Reader *in, void *out, size_t length) {
+
+	if (!in->ok || in->size - in->pos < length) {
+		in->ok = 0;
+		memset(out, 0, length);
+		return;
+	}
+	memcpy(out, in->data + in->pos, length);
+	in->pos += length;
+
+}
+
+static uint32_t readU32 (Reader *in) {
+
+	uint32_t value;
+	readBytes(in, &value, sizeof(value));
+	return value;
+
+}
+
+static uint64_t readU64 (Reader *in) {
+
+	uint64_t value;
+	readBytes(in, &value, sizeof(value));
+	return value;
+
+}
+
+static char *readString (Assembler *as, Reader *in) {
+
+	uint32_t length = readU32(in);
+	if (!in->ok || in->size - in->pos < length) {
+		in->ok = 0;
+		return "";
+	}
+	char *s = copyString(as, (char *)in->data + in->pos, length);
+	in->pos += length;
+	return s;
+
+}
+
+// a count that the rest of the file can hold at least once
+static int32_t readCount (Reader *in, size_t element) {
+
+	uint32_t count = readU32(in);
+	if (!in->ok || count > (in->size - in->pos)/element) {
+		in->ok = 0;
+		return 0;
+	}
+	return count;
+
+}
+
+static uint64_t hashSource (Source *source) {
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (int32_t i = 0; i < source->lines.count; i++) {
+		hash = hash64(hash, source->lines.line[i], strlen(source->lines.line[i]) + 1);
+	}
+	return hash;
+
+}
+
+static void cachePath (Assembler *as, const char *real, char *path, size_t size) {
+
+	uint64_t hash = hash64(14695981039346656037ULL, real, strlen(real));
+	snprintf(path, size, "%s/%016llx.unit", as->cacheDir, (unsigned long long)hash);
+
+}
+
+static void writeHeader (FILE *file, uint64_t sourceHash, const char *real) {
+
+	fwrite(CACHE_MAGIC, 1, 4, file);
+	writeU32(file, CACHE_VERSION);
+	writeU32(file, TYPE_COUNT);
+	writeU64(file, sourceHash);
+	writeString(file, real);
+
+}
+
+static void saveUnit (Assembler *as, Unit *unit, uint64_t sourceHash, const char *real) {
+
+	char path[PATH_MAX + 64];
+	char temp[PATH_MAX + 96];
+	cachePath(as, real, path, sizeof(path));
+	// written next to its place and renamed, a cut off file is never read
+	snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+	FILE *file = fopen(temp, "wb");
+	if (file == NULL) {
+		return;
+	}
+	writeHeader(file, sourceHash, real);
+	writeU32(file, unit->depCount);
+	for (int32_t i = 0; i < unit->depCount; i++) {
+		writeString(file, unit->deps[i].name);
+		writeU64(file, unit->deps[i].hash);
+	}
+	writeU32(file, unit->expanded.count);
+	for (int32_t i = 0; i < unit->expanded.count; i++) {
+		writeString(file, unit->expanded.line[i]);
+	}
+	writeU32(file, unit->count);
+	for (int32_t i = 0; i < unit->count; i++) {
+		Command *cmd = &unit->commands[i];
+		writeU32(file, cmd->type);
+		writeU32(file, cmd->a);
+		writeU32(file, cmd->b);
+		writeU32(file, cmd->c);
+	}
+	writeU32(file, unit->labelCount);
+	for (int32_t i = 0; i < unit->labelCount; i++) {
+		writeString(file, unit->labels[i].name);
+		writeU32(file, unit->labels[i].line);
+	}
+	writeU32(file, unit->relocCount);
+	for (int32_t i = 0; i < unit->relocCount; i++) {
+		writeString(file, unit->relocs[i].name);
+		writeU32(file, unit->relocs[i].line);
+		writeU32(file, unit->relocs[i].arg);
+	}
+	int ok = !ferror(file);
+	ok = fclose(file) == 0 && ok;
+	if (!ok || rename(temp, path) != 0) {
+		remove(temp);
+	}
+
+}
+
+// fills unit from the cache if the file has not changed and every macro it
+// looked up is still the same, returns 0 if it has to be assembled
+static int loadUnit (Assembler *as, Unit *unit, uint64_t sourceHash, const char *real) {
+
+	char path[PATH_MAX + 64];
+	cachePath(as, real, path, sizeof(path));
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		return 0;
+	}
+	Reader in = {0};
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+	in.data = size > 0 ? malloc(size) : NULL;
+	in.size = size;
+	in.ok = in.data != NULL && fread(in.data, 1, size, file) == (size_t)size;
+	fclose(file);
+
+	char magic[4];
+	readBytes(&in, magic, 4);
+	in.ok = in.ok && memcmp(magic, CACHE_MAGIC, 4) == 0;
+	in.ok = in.ok && readU32(&in) == CACHE_VERSION;
+	in.ok = in.ok && readU32(&in) == TYPE_COUNT;
+	in.ok = in.ok && readU64(&in) == sourceHash;
+	in.ok = in.ok && strcmp(readString(as, &in), real) == 0;
+	int32_t depCount = readCount(&in, sizeof(uint32_t) + sizeof(uint64_t));
+	for (int32_t i = 0; i < depCount && in.ok; i++) {
+		char *name = readString(as, &in);
+		in.ok = in.ok && readU64(&in) == macroHash(as, name, strlen(name));
+	}
+	int32_t lineCount = readCount(&in, sizeof(uint32_t));
+	for (int32_t i = 0; i < lineCount && in.ok; i++) {
+		pushLine(&unit->expanded, readString(as, &in));
+	}
+	unit->count = readCount(&in, 4*sizeof(uint32_t));
+	unit->commands = malloc(sizeof(Command)*(unit->count + 1));
+	for (int32_t i = 0; i < unit->count && in.ok; i++) {
+		Command *cmd = &unit->commands[i];
+		cmd->type = readU32(&in);
+		cmd->a = readU32(&in);
+		cmd->b = readU32(&in);
+		cmd->c = readU32(&in);
+		in.ok = in.ok && cmd->type < TYPE_COUNT;
+	}
+	unit->labelSize = unit->labelCount = readCount(&in, 2*sizeof(uint32_t));
+	unit->labels = malloc(sizeof(Label)*(unit->labelCount + 1));
+	for (int32_t i = 0; i < unit->labelCount && in.ok; i++) {
+		unit->labels[i].name = readString(as, &in);
+		unit->labels[i].line = readU32(&in);
+	}
+	unit->relocSize = unit->relocCount = readCount(&in, 3*sizeof(uint32_t));
+	unit->relocs = malloc(sizeof(Reloc)*(unit->relocCount + 1));
+	for (int32_t i = 0; i < unit->relocCount && in.ok; i++) {
+		unit->relocs[i].name = readString(as, &in);
+		unit->relocs[i].line = readU32(&in);
+		unit->relocs[i].arg = readU32(&in);
+		in.ok = in.ok && unit->relocs[i].line >= 0 && unit->relocs[i].line < unit->count && unit->relocs[i].arg < 3;
+	}
+	in.ok = in.ok && unit->count == unit->expanded.count && in.pos == in.size;
+	free(in.data);
+	return in.ok;
+
+}
+
+//------------ UNITS -------------
+
+static void freeUnit (Unit *unit) {
+
+	free(unit->expanded.line);
+	free(unit->commands);
+	free(unit->labels);
+	free(unit->relocs);
+	free(unit->deps);
+	freeTable(&unit->depNames);
+	memset(unit, 0, sizeof(Unit));
+
+}
+
+static int buildUnit (Assembler *as, Unit *unit, Source *source, int32_t base) {
+
+	as->unit = unit;
+	as->warnings = 0;
+	for (int32_t i = 0; i < source->lines.count; i++) {
+		expandLine(as, source->lines.line[i], strlen(source->lines.line[i]), 0);
+	}
+	as->unit = NULL;
+	return as->errors == 0 && compileUnit(as, unit, base);
+
+}
+
+// assembles every source into its unit, from the cache where it is valid
+static int buildUnits (Assembler *as, Unit *units) {
+
+	int32_t base = 0;
+	int32_t files = 0;
+	for (int32_t f = 0; f < as->sourceCount; f++) {
+		Source *source = &as->sources[f];
+		Unit *unit = &units[f];
+		// the "j _start" in front has no file and is not cached
+		int cached = as->cacheDir != NULL && source->path != NULL;
+		char real[PATH_MAX];
+		uint64_t sourceHash = 0;
+		if (cached) {
+			files++;
+			if (realpath(source->path, real) == NULL) {
+				snprintf(real, sizeof(real), "%s", source->path);
+			}
+			sourceHash = hashSource(source);
+			if (loadUnit(as, unit, sourceHash, real)) {
+				as->reused++;
+				base += unit->count;
+				continue;
+			}
+			freeUnit(unit);
+		}
+		if (!buildUnit(as, unit, source, base)) {
+			return 0;
+		}
+		if (cached && as->warnings == 0) {
+			saveUnit(as, unit, sourceHash, real);
+		}
+		base += unit->count;
+	}
+	if (as->cacheDir != NULL) {
+		printf("Assembler cache: %d of %d files reused\n", as->reused, files);
+	}
+	return 1;
+
+}
+
+// places the units behind each other, resolves the labels and fills pgrm
+static void linkUnits (Assembler *as, Unit *units, Program *pgrm) {
+
+	// a label defined twice resolves to its last definition
+	Table labels = {0};
+	int32_t base = 0;
+	for (int32_t f = 0; f < as->sourceCount; f++) {
+		for (int32_t i = 0; i < units[f].labelCount; i++) {
+			Label *label = &units[f].labels[i];
+			*tableFind(&labels, label->name, strlen(label->name), 1) = base + label->line;
+		}
+		base += units[f].count;
+	}
+
+	base = 0;
+	for (int32_t f = 0; f < as->sourceCount; f++) {
+		Unit *unit = &units[f];
+		for (int32_t i = 0; i < unit->relocCount; i++) {
+			Reloc *reloc = &unit->relocs[i];
+			Command *cmd = &unit->commands[reloc->line];
+			int32_t line = base + reloc->line;
+			int32_t *label = tableFind(&labels, reloc->name, strlen(reloc->name), 0);
+			if (label == NULL) {
+				printf("ERROR: '%s' can't be resolved in line %d\n", reloc->name, line + 1);
+			}
+			int32_t value = label == NULL ? 0 : (*label - line)*4;
+			if (reloc->arg == 0) {
+				cmd->a = value;
+			} else if (reloc->arg == 1) {
+				cmd->b = value;
+			} else {
+				cmd->c = value;
+			}
+		}
+		for (int32_t i = 0; i < unit->count && base + i < pgrm->maxSize; i++) {
+			Command *cmd = &unit->commands[i];
+			addCommand(pgrm, base + i, cmd->type, cmd->a, cmd->b, cmd->c);
+		}
+		base += unit->count;
+	}
+	freeTable(&labels);
+	if (base > pgrm->maxSize) {
+		printf("ERROR: the program has %d commands, only %d fit\n", base, pgrm->maxSize);
+	}
+	pgrm->length = base < pgrm->maxSize ? base : pgrm->maxSize;
+
+}
+
+static Listing *createListing (Assembler *as, Unit *units) {
+
+	Listing *listing = malloc(sizeof(Listing));
+	size_t size = 0;
+	int32_t count = 0;
+	int32_t breakpoints = 0;
+	for (int32_t f = 0; f < as->sourceCount; f++) {
+		Lines *lines = &units[f].expanded;
+		for (int32_t i = 0; i < lines->count; i++) {
+			size += strlen(lines->line[i]) + 2;
+			breakpoints += strstr(lines->line[i], "#breakpoint") != NULL;
+		}
+		count += lines->count;
+	}
+	listing->lines = malloc(sizeof(char *)*(count + 1));
+	listing->text = malloc(size + 1);
+	listing->breakpoints = malloc(sizeof(int32_t)*(breakpoints + 1));
+	listing->count = count;
+	listing->breakpointCount = 0;
+	char *cur = listing->text;
+	int32_t n = 0;
+	for (int32_t f = 0; f < as->sourceCount; f++) {
+		Lines *lines = &units[f].expanded;
+		for (int32_t i = 0; i < lines->count; i++, n++) {
+			size_t length = strlen(lines->line[i]);
+			listing->lines[n] = cur;
+			memcpy(cur, lines->line[i], length);
+			cur[length] = '\n';
+			cur[length+1] = '\0';
+			cur += length + 2;
+			if (strstr(lines->line[i], "#breakpoint") != NULL) {
+				listing->breakpoints[listing->breakpointCount++] = n + 1;
+			}
+		}
+	}
+	return listing;
+
+}
+
+// the cache directory is created if it is missing, without it every file
+// is assembled
+static void openCache (Assembler *as, char *cacheDir) {
+
+	if (cacheDir == NULL) {
+		return;
+	}
+	struct stat st;
+	if (stat(cacheDir, &st) != 0 && mkdir(cacheDir, 0777) != 0) {
+		printf("ERROR: cannot create assembler cache %s\n", cacheDir);
+		return;
+	}
+	if (realpath(cacheDir, as->cacheReal) == NULL) {
+		printf("ERROR: cannot use assembler cache %s\n", cacheDir);
+		return;
+	}
+	as->cacheDir = cacheDir;
+
+}
+
+//----------------------------------
+
+int isAssembly (char *path) {
+
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return 0;
+	}
+	size_t length = strlen(path);
+	return S_ISDIR(st.st_mode) || (length > 2 && strcmp(path + length - 2, ".s") == 0);
+
+}
+
+int assembleProgram (Program *pgrm, char *path, char *cacheDir) {
+
+	Assembler as;
+	memset(&as, 0, sizeof(Assembler));
+	openCache(&as, cacheDir);
+	pushLine(&newSource(&as, NULL)->lines, "j _start");
+	struct stat st;
+	int ok = stat(path, &st) == 0 && S_ISDIR(st.st_mode) ? walkSources(&as, path) : readSource(&as, path);
+
+	Unit *units = NULL;
+	if (ok) {
+		collectMacros(&as);
+		units = calloc(as.sourceCount, sizeof(Unit));
+		ok = units != NULL && buildUnits(&as, units);
+	}
+	if (ok) {
+		linkUnits(&as, units, pgrm);
+		if (pgrm->listing != NULL) {
+			freeListing(pgrm);
+		}
+		pgrm->listing = createListing(&as, units);
+		pgrm->entry = 0;
+	}
+
+	for (int32_t i = 0; units != NULL && i < as.sourceCount; i++) {
+		freeUnit(&units[i]);
+	}
+	free(units);
+	for (int32_t i = 0; i < as.sourceCount; i++) {
+		free(as.sources[i].lines.line);
+	}
+	free(as.sources);
+	for (int32_t i = 0; i < as.macroCount; i++) {
+		free(as.macros[i].body);
+		free(as.macros[i].args);
+		free(as.macros[i].argLengths);
+	}
+	free(as.macros);
+	freeTable(&as.macroNames);
+	while (as.chunks != NULL) {
+		Chunk *next = as.chunks->next;
+		free(as.chunks);
+		as.chunks = next;
+	}
+	return ok;
+
+}
+
+void freeListing (Program *pgrm) {
+
+	Listing *listing = pgrm->listing;
+	free(listing->lines);
+	free(listing->text);
+	free(listing->breakpoints);
+	free(listing);
+	pgrm->listing = NULL;
+
+}
@@ -0,0 +1,40 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef ASSEMBLER_H_
+#define ASSEMBLER_H_
+
+#include<stdint.h>
+#include "cpu.h"
+
+// ASSEMBLER INTERFACE
+
+// what compiler.py writes to debugger_info.txt and breakpoint_info.txt
+typedef struct Listing {
+	char **lines; // expanded source of every command, newline terminated
+	int32_t count;
+	char *text; // holds the lines
+	int32_t *breakpoints; // 1-indexed lines holding #breakpoint
+	int32_t breakpointCount;
+} Listing;
+
+// a directory of sources or a single .s file
+int isAssembly (char *path);
+
+// assembles path like compiler.py and fills pgrm and its listing,
+// returns 0 and prints why on errors. Files whose unit in cacheDir is
+// still valid are not assembled again, NULL assembles everything.
+int assembleProgram (Program *pgrm, char *path, char *cacheDir);
+
+void freeListing (Program *pgrm);
+
+// register alias, fp or xN like the assembler reads them, returns 0 if
+// name is none of them
+int parseRegister (const char *name, size_t length, int32_t *reg);
+
+#endif
@@ -0,0 +1,296 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<time.h>
+#include "cpu.h"
+#include "memory.h"
+#include "engine.h"
+#include "elfloader.h"
+#include "harts.h"
+#include "snapshot.h"
+#include "batch.h"
+
+//---------------------------------------------
+
+// A batch runs the same program once for every line of a job file, each
+// line being the value GPIO_IN holds during the run. The program is loaded
+// once, every worker is a hart of its own (see createHart) with its own
+// memory, so the commands and the decoded program are shared and only read.
+//
+// The jobs are split into one range per worker. A worker takes jobs from
+// the front of its range, and once it is empty it steals the back half of
+// another worker's range. A range is one 64-bit word, begin in the low and
+// end in the high half, changed with compare and swap only, so taking and
+// stealing need no lock.
+
+typedef struct Job {
+	int32_t gpioIn;
+	uint64_t retired;
+	int halted;
+	int32_t exitCode;
+	int32_t pc;
+	int32_t gpioOut;
+	uint64_t digest;
+} Job;
+
+typedef struct Batch Batch;
+
+typedef struct Worker {
+	CPU *cpu;
+	int32_t id;
+	uint64_t range;
+	int32_t steals;
+	Batch *batch;
+} Worker;
+
+struct Batch {
+	CPU *boot;
+	Job *jobs;
+	int32_t jobCount;
+	Worker *workers;
+	int32_t workerCount;
+	int lifetime;
+	Snapshot *snapshot; // NULL starts every job like readProgram left the boot hart
+};
+
+static uint64_t packRange (uint32_t begin, uint32_t end) {
+
+	return ((uint64_t)end << 32) | begin;
+
+}
+
+static int takeJob (Worker *worker, int32_t *job) {
+
+	uint64_t range = __atomic_load_n(&worker->range, __ATOMIC_ACQUIRE);
+	while ((uint32_t)range < (uint32_t)(range >> 32)) {
+		uint64_t next = packRange((uint32_t)range + 1, range >> 32);
+		if (__atomic_compare_exchange_n(&worker->range, &range, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			*job = (uint32_t)range;
+			return 1;
+		}
+	}
+	return 0;
+
+}
+
+// moves the back half of another range into the empty range of worker
+static int stealJobs (Worker *worker) {
+
+	Batch *batch = worker->batch;
+	for (int32_t i = 1; i < batch->workerCount; i++) {
+		Worker *victim = &batch->workers[(worker->id + i) % batch->workerCount];
+		uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+		while ((uint32_t)range < (uint32_t)(range >> 32)) {
+			uint32_t begin = range;
+			uint32_t end = range >> 32;
+			uint32_t split = end - (end - begin + 1)/2;
+			if (__atomic_compare_exchange_n(&victim->range, &range, packRange(begin, split), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_store_n(&worker->range, packRange(split, end), __ATOMIC_RELEASE);
+				worker->steals++;
+				return 1;
+			}
+		}
+	}
+	return 0;
+
+}
+
+static void runJob (Worker *worker, Job *job) {
+
+	CPU *cpu = worker->cpu;
+	CPU *boot = worker->batch->boot;
+	Memory *mem = cpu->shared->mem;
+
+	if (worker->batch->snapshot != NULL) {
+		// checked against the program and memory size by runSimulation already
+		restoreSnapshot(cpu, worker->batch->snapshot);
+	} else {
+		// the state readProgram left the boot hart in
+		resetMemory(mem);
+		memcpy(cpu->reg->data, boot->reg->data, sizeof(int32_t)*(boot->reg->size+1));
+		cpu->reg->reserved = 0;
+		cpu->pgrm->pc = cpu->pgrm->entry;
+		if (cpu->pgrm->segments != NULL) {
+			restoreElf(cpu);
+		}
+	}
+	__atomic_store_n(&mem->GPIO_IN, job->gpioIn, __ATOMIC_RELEASE);
+
+	job->retired = runEngine(cpu, worker->batch->lifetime);
+	job->halted = mem->halted;
+	job->exitCode = mem->exitCode;
+	job->pc = cpu->pgrm->pc;
+	job->gpioOut = __atomic_load_n(&mem->GPIO_OUT, __ATOMIC_ACQUIRE);
+	job->digest = digestMemory(mem);
+
+}
+
+static void *runWorker (void *args) {
+
+	Worker *worker = args;
+	int32_t job;
+	do {
+		while (takeJob(worker, &job)) {
+			runJob(worker, &worker->batch->jobs[job]);
+		}
+	} while (stealJobs(worker));
+	return NULL;
+
+}
+
+// one GPIO input per line, decimal or 0x hex, # starts a comment line
+static Job *readJobs (char *name, int32_t *count) {
+
+	FILE *file = fopen(name, "r");
+	if (file == NULL) {
+		printf("ERROR: cannot open job file %s\n", name);
+		return NULL;
+	}
+	Job *jobs = NULL;
+	int32_t size = 0;
+	*count = 0;
+	char *line = NULL;
+	size_t len = 0;
+	int lnum = 0;
+	int ok = 1;
+	while (ok && getline(&line, &len, file) != -1) {
+		lnum++;
+		char *start = line;
+		while (*start == ' ' || *start == '\t') {
+			start++;
+		}
+		if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0') {
+			continue;
+		}
+		char *end;
+		long value = strtol(start, &end, 0);
+		if (end == start || value < 0 || value > 0xFF) {
+			printf("ERROR: job %d in line %d is not a GPIO input 0 / 255\n", *count, lnum);
+			ok = 0;
+			continue;
+		}
+		if (*count == size) {
+			size = size == 0 ? 256 : size*2;
+			jobs = realloc(jobs, sizeof(Job)*size);
+		}
+		memset(&jobs[*count], 0, sizeof(Job));
+		jobs[(*count)++].gpioIn = value;
+	}
+	free(line);
+	fclose(file);
+	if (ok && *count == 0) {
+		printf("ERROR: job file %s has no jobs\n", name);
+		ok = 0;
+	}
+	if (!ok) {
+		free(jobs);
+		return NULL;
+	}
+	return jobs;
+
+}
+
+static int writeResults (char *name, Job *jobs, int32_t count) {
+
+	FILE *file = fopen(name, "w");
+	if (file == NULL) {
+		printf("ERROR: cannot write %s\n", name);
+		return 0;
+	}
+	for (int32_t i = 0; i < count; i++) {
+		Job *job = &jobs[i];
+		fprintf(file, "{\"job\": %d, \"gpio_in\": %d, \"instructions\": %llu, \"halted\": %s, \"exit_code\": %d, "
+			"\"pc\": %d, \"gpio_out\": %d, \"memory_digest\": \"%016llx\"}\n",
+			i, job->gpioIn, (unsigned long long)job->retired, job->halted ? "true" : "false", job->exitCode,
+			job->pc, job->gpioOut, (unsigned long long)job->digest);
+	}
+	return fclose(file) == 0;
+
+}
+
+int runBatch (CPU *cpu, char *jobs, char *out, int workers, int lifetime, Snapshot *snapshot) {
+
+	Batch batch;
+	batch.boot = cpu;
+	batch.lifetime = lifetime;
+	batch.snapshot = snapshot;
+	batch.jobs = readJobs(jobs, &batch.jobCount);
+	if (batch.jobs == NULL) {
+		return 0;
+	}
+	if (workers <= 0) {
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	batch.workerCount = workers < batch.jobCount ? workers : batch.jobCount;
+	batch.workers = malloc(sizeof(Worker)*batch.workerCount);
+	pthread_t *threads = malloc(sizeof(pthread_t)*batch.workerCount);
+	if (batch.workers == NULL || threads == NULL) {
+		printf("ERROR: Cannot allocate workers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// the threaded program is decoded once here, the workers only read it
+	if (cpu->engine != ENGINE_SWITCH) {
+		runThreaded(cpu, 0);
+	}
+	Memory *mem = cpu->shared->mem;
+	for (int32_t i = 0; i < batch.workerCount; i++) {
+		Worker *worker = &batch.workers[i];
+		worker->cpu = createHart(cpu, 0);
+		worker->cpu->shared = createSharedMemory(mem->size/4);
+		// display commands of all workers go through one lock
+		worker->cpu->shared->mem->deviceLock = mem->deviceLock;
+		worker->cpu->shared->mem->lockStats = mem->lockStats;
+		worker->id = i;
+		worker->range = packRange((int64_t)batch.jobCount*i/batch.workerCount, (int64_t)batch.jobCount*(i+1)/batch.workerCount);
+		worker->steals = 0;
+		worker->batch = &batch;
+	}
+
+	struct timespec start, stop;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int32_t i = 0; i < batch.workerCount; i++) {
+		if (pthread_create(&threads[i], NULL, runWorker, &batch.workers[i])) {
+			printf("ERROR: Failed to create Worker Thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	int32_t steals = 0;
+	for (int32_t i = 0; i < batch.workerCount; i++) {
+		if (pthread_join(threads[i], NULL)) {
+			printf("ERROR: joining thread Worker\n");
+			exit(EXIT_FAILURE);
+		}
+		steals += batch.workers[i].steals;
+		freeSharedMemory(batch.workers[i].cpu->shared);
+		freeHart(batch.workers[i].cpu);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	uint64_t retired = 0;
+	for (int32_t i = 0; i < batch.jobCount; i++) {
+		retired += batch.jobs[i].retired;
+	}
+	double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Batch: %d jobs on %d workers in %.3f s, %llu instructions, %d steals\n",
+		batch.jobCount, batch.workerCount, seconds, (unsigned long long)retired, steals);
+	int ok = writeResults(out, batch.jobs, batch.jobCount);
+	free(batch.jobs);
+	free(batch.workers);
+	free(threads);
+	return ok;
+
+}
@@ -0,0 +1,24 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "cpu.h"
+#include "snapshot.h"
+
+// BATCH INTERFACE
+
+// runs the program of cpu once for every GPIO input in the file jobs, on
+// workers threads (0 for one per core). Every job gets up to lifetime
+// instructions. The results go to out as one JSON line per job, in the
+// order of the jobs. Jobs start from snapshot if it is not NULL. Returns 0
+// and prints why on errors.
+int runBatch (CPU *cpu, char *jobs, char *out, int workers, int lifetime, Snapshot *snapshot);
+
+#endif
@@ -0,0 +1,18 @@
+# ALU throughput: register-only arithmetic, no loads, stores or MMIO
+_start:
+li a0, 1
+li a1, 7
+li a2, 12345
+alu_loop:
+add a0, a0, a1
+xor a1, a1, a0
+slli a3, a0, 3
+sub a2, a2, a3
+mul a4, a2, a1
+srai a5, a4, 2
+or a6, a5, a0
+and a7, a6, a2
+sltu t0, a7, a0
+addi a1, a1, 1
+add a0, a0, t0
+j alu_loop
@@ -0,0 +1,125 @@
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+# Runs every kernel in this directory headless for a fixed number of
+# instructions and reports MIPS, ns per instruction and peak RSS.
+# Each subdirectory is one kernel, the simulator assembles it on its own.
+# Then it assembles a generated source of --asm-lines lines with compiler.py
+# and with the simulator, once without and once with its cache, and reports
+# the lines per second of each.
+#
+# usage: python3 bench/bench.py [--engines switch,jit] [--instructions N]
+#                               [--repeat N] [--asm-lines N] [--json FILE]  (from src)
+
+bench_dir = os.path.dirname(os.path.abspath(__file__))
+src_dir = os.path.dirname(bench_dir)
+engines_list = ["switch", "threaded", "block", "jit"]
+
+
+def find_kernels():
+    kernels = []
+    for name in sorted(os.listdir(bench_dir)):
+        if os.path.isdir(os.path.join(bench_dir, name)) and not name.startswith("_"):
+            kernels.append(name)
+    return kernels
+
+
+def generate_source(asm_dir, lines):
+    """
+    Writes a source of about the given number of lines, with macros,
+    comments, labels and forward branches, like our generated tests.
+    """
+    os.makedirs(asm_dir)
+    with open(os.path.join(asm_dir, "generated.s"), 'w') as outfile:
+        outfile.write(".macro push reg\n\taddi sp, sp, -4\n\tsw \\reg, 0(sp)\n.endm\n")
+        outfile.write(".macro pop reg\n\tlw \\reg, 0(sp)\n\taddi sp, sp, 4\n.endm\n")
+        outfile.write("_start:\n")
+        for i in range(lines // 10):
+            outfile.write(f"block{i}:\n\tpush a0\n\taddi a0, a0, {i % 100} # step\n"
+                          f"\tbne a0, a1, block{i + 1}\n\tlw t0, 4(sp)\n\tpop a0\n")
+        outfile.write(f"block{lines // 10}:\n\tj _start\n")
+
+
+def bench_assembler(work_dir, lines, repeat):
+    asm_dir = os.path.join(work_dir, "generated")
+    generate_source(asm_dir, lines)
+    # compiler.py writes its debug files to the working directory
+    start = time.perf_counter()
+    subprocess.run([sys.executable, os.path.join(src_dir, "compiler.py"), asm_dir,
+                    os.path.join(work_dir, "generated.txt")],
+                   cwd=work_dir, check=True, stdout=subprocess.DEVNULL)
+    python_seconds = time.perf_counter() - start
+    native = min((run(asm_dir, "switch", 0, ["--no-asm-cache"]) for _ in range(repeat)),
+                 key=lambda s: s["load_seconds"])
+    # the first run fills the cache, the others reuse every unit
+    cache = ["--asm-cache=" + os.path.join(work_dir, "asmcache")]
+    cached = min((run(asm_dir, "switch", 0, cache) for _ in range(repeat + 1)), key=lambda s: s["load_seconds"])
+    count = native["program_length"]
+    print(f"\n{'assembler':<12} {'lines':>8} {'seconds':>9} {'lines/s':>12}")
+    print(f"{'compiler.py':<12} {count:>8} {python_seconds:>9.3f} {count / python_seconds:>12.0f}")
+    print(f"{'native':<12} {count:>8} {native['load_seconds']:>9.3f} {count / native['load_seconds']:>12.0f}")
+    print(f"{'cached':<12} {count:>8} {cached['load_seconds']:>9.3f} {count / cached['load_seconds']:>12.0f}")
+    return {"assembler": "native", "lines": count, "seconds": native["load_seconds"],
+            "lines_per_second": count / native["load_seconds"], "compiler_py_seconds": python_seconds,
+            "cached_seconds": cached["load_seconds"]}
+
+
+def run(program, engine, instructions, options=()):
+    """
+    Runs the simulator once and returns its JSON summary with the peak RSS
+    of the child added as "rss_kb".
+    """
+    proc = subprocess.Popen([os.path.join(src_dir, "simulator"), program, "0", "--headless",
+                             "--engine=" + engine, "--lifetime=" + str(instructions), *options],
+                            stdout=subprocess.PIPE, text=True)
+    out = proc.stdout.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    lines = [l for l in out.splitlines() if l.startswith("{")]
+    if len(lines) == 0:
+        raise RuntimeError(f"no summary from {program} on {engine} (exit {proc.returncode})")
+    summary = json.loads(lines[-1])
+    summary["rss_kb"] = usage.ru_maxrss
+    return summary
+
+
+if __name__ == "__main__":
+
+    parser = argparse.ArgumentParser(description="simulator throughput benchmarks")
+    parser.add_argument("--engines", default=",".join(engines_list))
+    parser.add_argument("--instructions", type=int, default=50000000)
+    parser.add_argument("--repeat", type=int, default=3, help="best of N runs")
+    parser.add_argument("--asm-lines", type=int, default=20000, help="size of the assembler benchmark")
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+
+    if not os.path.exists(os.path.join(src_dir, "simulator")):
+        print("Error: build the simulator first (make compile)")
+        sys.exit(1)
+
+    results = []
+    with tempfile.TemporaryDirectory() as work_dir:
+        print(f"{'kernel':<10} {'engine':<9} {'MIPS':>9} {'ns/inst':>8} {'RSS KiB':>8}")
+        for kernel in find_kernels():
+            program = os.path.join(bench_dir, kernel)
+            for engine in args.engines.split(","):
+                best = None
+                for _ in range(args.repeat):
+                    summary = run(program, engine, args.instructions)
+                    if best is None or summary["seconds"] < best["seconds"]:
+                        best = summary
+                ns = best["seconds"] * 1e9 / max(best["instructions"], 1)
+                print(f"{kernel:<10} {engine:<9} {best['mips']:>9.1f} {ns:>8.2f} {best['rss_kb']:>8}")
+                results.append({"kernel": kernel, "engine": engine, "instructions": best["instructions"],
+                                "seconds": best["seconds"], "mips": best["mips"], "ns_per_instruction": ns,
+                                "rss_kb": best["rss_kb"]})
+        results.append(bench_assembler(work_dir, args.asm_lines, args.repeat))
+
+    if args.json:
+        with open(args.json, 'w') as outfile:
+            json.dump(results, outfile, indent=2)
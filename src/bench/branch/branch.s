@@ -0,0 +1,26 @@
+# branch heavy: data dependent branches on the bits of an LCG
+_start:
+li a0, 12345
+li a1, 1103515245
+li a2, 12345
+li s1, 0
+li s2, 0
+branch_loop:
+mul a0, a0, a1
+add a0, a0, a2
+srli t0, a0, 16
+andi t1, t0, 1
+beqz t1, even
+addi s1, s1, 1
+j next
+even:
+addi s2, s2, 1
+next:
+andi t2, t0, 6
+li t3, 4
+blt t2, t3, low
+addi s3, s3, 1
+low:
+bltu s1, s2, branch_loop
+addi s4, s4, 1
+j branch_loop
@@ -0,0 +1,32 @@
+# call heavy: recursive fibonacci with frames built on fp and torn down by leave
+_start:
+lui sp, 64
+calls_loop:
+li a0, 20
+call fib
+j calls_loop
+
+# a0 = fib(a0)
+fib:
+addi sp, sp, -4
+sw fp, 0(sp)
+mv fp, sp
+addi sp, sp, -12
+sw ra, 0(sp)
+sw s1, 4(sp)
+sw s2, 8(sp)
+li t0, 2
+blt a0, t0, fib_done
+mv s1, a0
+addi a0, s1, -1
+call fib
+mv s2, a0
+addi a0, s1, -2
+call fib
+add a0, a0, s2
+fib_done:
+lw ra, 0(sp)
+lw s1, 4(sp)
+lw s2, 8(sp)
+leave
+ret
@@ -0,0 +1,25 @@
+# MMIO heavy: draws every page of the display through DISPLAY_ADDR (0x100040)
+_start:
+lui t1, 256
+lui t2, 12300
+lui t4, 12288
+addi t4, t4, 176
+li a4, 132
+li a5, 8
+li t3, 0
+frame:
+li a1, 0
+page_loop:
+add a0, t4, a1
+sw a0, 64(t1)
+li a2, 0
+col_loop:
+andi a3, t3, 255
+or a0, t2, a3
+sw a0, 64(t1)
+addi t3, t3, 1
+addi a2, a2, 1
+blt a2, a4, col_loop
+addi a1, a1, 1
+blt a1, a5, page_loop
+j frame
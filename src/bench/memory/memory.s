@@ -0,0 +1,21 @@
+# memory streaming: fill a 64 KiB array with SW, then sum it up with LW
+_start:
+lui s1, 16
+lui t0, 16
+add s2, s1, t0
+stream:
+mv t1, s1
+li a0, 0
+fill:
+sw a0, 0(t1)
+addi a0, a0, 3
+addi t1, t1, 4
+blt t1, s2, fill
+mv t1, s1
+li a1, 0
+sum:
+lw a2, 0(t1)
+add a1, a1, a2
+addi t1, t1, 4
+blt t1, s2, sum
+j stream
@@ -0,0 +1,353 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include "cpu.h"
+#include "blocks.h"
+
+//---------------------------------------------
+
+// The block engine keeps a translation cache of basic blocks. A block starts
+// at the pc it was first entered at and runs until the first branch or jump
+// (or an instruction it cannot handle). Its body is a straight line of
+// MicroOps without pc updates, and its exits point directly at the blocks
+// they lead to, so following a loop back edge costs one pointer load. The
+// budget is taken per block; instructions outside any block go through
+// runCommand. The cache only depends on the program, but is dropped on
+// resetCPU and readProgram as well. A store to the halt device leaves the
+// block right after it and gives back the budget of the rest.
+
+#define MAX_BLOCK 64
+#define SINK 32
+
+typedef struct MicroOp {
+	uint8_t type;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	int32_t imm;
+} MicroOp;
+
+typedef struct Block {
+	MicroOp *ops;
+	int32_t count;
+	int32_t takenPc;
+	int32_t nextPc;
+	struct Block *taken;
+	struct Block *next;
+} Block;
+
+typedef struct BlockCache {
+	int32_t length;
+	Block **byPc; // block starting at pc, by pc/4
+	uint8_t *uncached; // 1 if no block can start at pc/4
+	Block *blocks;
+	int32_t blockCount;
+	MicroOp *ops;
+	int32_t opCount;
+	int32_t opSize;
+	uint32_t flushes; // blocks from before a flush must not be linked
+} BlockCache;
+
+static int validReg (int32_t r) {
+
+	return r >= 0 && r < 32;
+
+}
+
+static int cacheable (Command cmd) {
+
+	switch (cmd.type) {
+		case ADD ... MUL:
+			return validReg(cmd.a) && validReg(cmd.b) && validReg(cmd.c);
+		case SLLI ... SRLI:
+		case LW:
+		case SW:
+		case BEQ ... BGEU:
+		case JALR:
+		case JALRX:
+			return validReg(cmd.a) && validReg(cmd.b);
+		case LUI:
+		case AUIPC:
+		case JAL:
+			return validReg(cmd.a);
+		case EMPTY:
+		case FLAG:
+		case NOP:
+		case LEAVE:
+			return 1;
+		default:
+			return 0;
+	}
+
+}
+
+static int endsBlock (CommandType type) {
+
+	return (type >= BEQ && type <= JALR) || type == JALRX;
+
+}
+
+static BlockCache *createBlockCache (int32_t length) {
+
+	BlockCache *cache = malloc(sizeof(BlockCache));
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->length = length;
+	cache->opSize = length*4 + MAX_BLOCK;
+	cache->byPc = malloc(sizeof(Block *)*(length+1));
+	cache->uncached = malloc(length+1);
+	cache->blocks = malloc(sizeof(Block)*(length+1));
+	cache->ops = malloc(sizeof(MicroOp)*cache->opSize);
+	if (cache->byPc == NULL || cache->uncached == NULL || cache->blocks == NULL || cache->ops == NULL) {
+		free(cache->byPc);
+		free(cache->uncached);
+		free(cache->blocks);
+		free(cache->ops);
+		free(cache);
+		return NULL;
+	}
+	memset(cache->byPc, 0, sizeof(Block *)*(length+1));
+	memset(cache->uncached, 0, length+1);
+	cache->blockCount = 0;
+	cache->opCount = 0;
+	cache->flushes = 0;
+	return cache;
+
+}
+
+void invalidateBlocks (CPU *cpu) {
+
+	BlockCache *cache = cpu->blocks;
+	if (cache != NULL) {
+		free(cache->byPc);
+		free(cache->uncached);
+		free(cache->blocks);
+		free(cache->ops);
+		free(cache);
+		cpu->blocks = NULL;
+	}
+
+}
+
+static Block *buildBlock (BlockCache *cache, Program *pgrm, int32_t start) {
+
+	if (start % 4 != 0 || start < 0 || start >= cache->length*4 || cache->uncached[start/4]) {
+		return NULL;
+	}
+	if (cache->byPc[start/4] != NULL) {
+		return cache->byPc[start/4];
+	}
+
+	if (cache->opSize - cache->opCount < MAX_BLOCK) {
+		// out of space: forget every block, links included, and start over
+		memset(cache->byPc, 0, sizeof(Block *)*(cache->length+1));
+		cache->blockCount = 0;
+		cache->opCount = 0;
+		cache->flushes++;
+	}
+
+	Block *block = &cache->blocks[cache->blockCount];
+	block->ops = &cache->ops[cache->opCount];
+	block->count = 0;
+	block->taken = NULL;
+	block->next = NULL;
+	block->takenPc = -1;
+
+	int32_t pc = start;
+	while (block->count < MAX_BLOCK && pc < cache->length*4 && cacheable(commandAt(pgrm, pc/4))) {
+		Command cmd = commandAt(pgrm, pc/4);
+		MicroOp *op = &block->ops[block->count++];
+		op->type = cmd.type;
+		op->rd = cmd.a == 0 ? SINK : cmd.a;
+		op->rs1 = validReg(cmd.b) ? cmd.b : 0;
+		op->rs2 = validReg(cmd.c) ? cmd.c : 0;
+		op->imm = cmd.c;
+		switch (cmd.type) {
+			case LUI:
+				op->imm = (int32_t)((uint32_t)cmd.b << 12);
+				break;
+			case AUIPC:
+				op->imm = (int32_t)((uint32_t)cmd.b << 12) + pc;
+				break;
+			case SW:
+			case BEQ ... BGEU:
+				op->rd = cmd.a;
+				break;
+			case JAL:
+				op->imm = pc + 4;
+				break;
+			default:
+				break;
+		}
+		if (cmd.type >= BEQ && cmd.type <= BGEU) {
+			block->takenPc = pc + cmd.c;
+		} else if (cmd.type == JAL) {
+			block->takenPc = pc + cmd.b;
+		}
+		pc += 4;
+		if (endsBlock(cmd.type)) {
+			break;
+		}
+	}
+	block->nextPc = pc;
+
+	if (block->count == 0) {
+		cache->uncached[start/4] = 1;
+		return NULL;
+	}
+	cache->opCount += block->count;
+	cache->blockCount++;
+	cache->byPc[start/4] = block;
+	return block;
+
+}
+
+uint64_t runBlocks (CPU *cpu, int lifetime) {
+
+	Program *pgrm = cpu->pgrm;
+	Memory *mem = cpu->shared->mem;
+	int32_t *x = cpu->reg->data;
+	uint64_t budget = lifetime < 0 ? UINT64_MAX : (uint64_t)lifetime;
+	uint64_t start = budget;
+	uint64_t clock = cpu->retired + start; // minus budget is storeClock
+
+	if (cpu->blocks == NULL) {
+		cpu->blocks = createBlockCache(pgrm->length);
+		if (cpu->blocks == NULL) {
+			printf("ERROR: Cannot allocate block cache\n");
+			return 0;
+		}
+	}
+	BlockCache *cache = cpu->blocks;
+
+	int32_t pc = pgrm->pc;
+	Block *block = buildBlock(cache, pgrm, pc);
+
+	while (budget > 0 && !mem->halted) {
+		if (block == NULL || budget < (uint64_t)block->count) {
+			pgrm->pc = pc;
+			storeClock = clock - budget + 1;
+			runCommand(cpu);
+			pc = pgrm->pc;
+			budget--;
+			block = buildBlock(cache, pgrm, pc);
+			continue;
+		}
+		budget -= block->count;
+
+		MicroOp *op = block->ops;
+		MicroOp *end = op + block->count;
+		int taken = 0;
+		for (; op < end; op++) {
+			switch (op->type) {
+				case ADD: x[op->rd] = x[op->rs1] + x[op->rs2]; break;
+				case SUB: x[op->rd] = x[op->rs1] - x[op->rs2]; break;
+				case AND: x[op->rd] = x[op->rs1] & x[op->rs2]; break;
+				case OR: x[op->rd] = x[op->rs1] | x[op->rs2]; break;
+				case XOR: x[op->rd] = x[op->rs1] ^ x[op->rs2]; break;
+				case SLT: x[op->rd] = x[op->rs1] < x[op->rs2] ? 1 : 0; break;
+				case SLTU: x[op->rd] = (uint32_t)x[op->rs1] < (uint32_t)x[op->rs2] ? 1 : 0; break;
+				case SRA: x[op->rd] = x[op->rs1] >> (x[op->rs2]&31); break;
+				case SRL: x[op->rd] = (uint32_t)x[op->rs1] >> (x[op->rs2]&31); break;
+				case SLL: x[op->rd] = x[op->rs1] << (x[op->rs2]&31); break;
+				case MUL: x[op->rd] = x[op->rs1] * x[op->rs2]; break;
+				case SLLI: x[op->rd] = x[op->rs1] << op->imm; break;
+				case ADDI: x[op->rd] = x[op->rs1] + op->imm; break;
+				case ANDI: x[op->rd] = x[op->rs1] & op->imm; break;
+				case ORI: x[op->rd] = x[op->rs1] | op->imm; break;
+				case XORI: x[op->rd] = x[op->rs1] ^ op->imm; break;
+				case SLTI: x[op->rd] = x[op->rs1] < op->imm ? 1 : 0; break;
+				case SLTIU: x[op->rd] = (uint32_t)x[op->rs1] < (uint32_t)op->imm ? 1 : 0; break;
+				case SRAI: x[op->rd] = x[op->rs1] >> (op->imm & 31); break;
+				case SRLI: x[op->rd] = (uint32_t)x[op->rs1] >> (op->imm & 31); break;
+				case LUI:
+				case AUIPC: x[op->rd] = op->imm; break;
+				case LW:
+					x[op->rd] = rM(mem, x[op->rs1] + op->imm);
+					break;
+				case SW:
+					// the budget was taken for the whole block
+					storeClock = clock - budget - (end - op - 1);
+					wM(mem, x[op->rs1] + op->imm, x[op->rd]);
+					if (mem->halted) {
+						budget += end - op - 1;
+						pc = block->nextPc - (int32_t)(end - op - 1)*4;
+						taken = 3;
+						op = end - 1;
+					}
+					break;
+				case LEAVE:
+					x[2] = x[8];
+					x[8] = rM(mem, x[2]);
+					x[2] = x[2] + 4;
+					break;
+				case BEQ: taken = x[op->rd] == x[op->rs1]; break;
+				case BNE: taken = x[op->rd] != x[op->rs1]; break;
+				case BLT: taken = x[op->rd] < x[op->rs1]; break;
+				case BGE: taken = x[op->rd] >= x[op->rs1]; break;
+				case BLTU: taken = (uint32_t)x[op->rd] < (uint32_t)x[op->rs1]; break;
+				case BGEU: taken = (uint32_t)x[op->rd] >= (uint32_t)x[op->rs1]; break;
+				case JAL:
+					x[op->rd] = op->imm;
+					taken = 1;
+					break;
+				case JALR:
+					// link first: with rd == rs1 the target uses the new value, as in executeCommand
+					x[op->rd] = block->nextPc;
+					pc = (x[op->rs1] + op->imm) & 0xfffffffe;
+					taken = 2;
+					break;
+				case JALRX:
+					pc = (x[op->rs1] + op->imm) & 0xfffffffe;
+					x[op->rd] = block->nextPc;
+					taken = 2;
+					break;
+				default:
+					break;
+			}
+		}
+
+		// follow the exit, linking it to its block the first time
+		uint32_t flushes = cache->flushes;
+		if (taken == 1) {
+			pc = block->takenPc;
+			if (block->taken != NULL) {
+				block = block->taken;
+			} else {
+				Block *target = buildBlock(cache, pgrm, pc);
+				if (cache->flushes == flushes) {
+					block->taken = target;
+				}
+				block = target;
+			}
+		} else if (taken == 0) {
+			pc = block->nextPc;
+			if (block->next != NULL) {
+				block = block->next;
+			} else {
+				Block *target = buildBlock(cache, pgrm, pc);
+				if (cache->flushes == flushes) {
+					block->next = target;
+				}
+				block = target;
+			}
+		} else if (taken == 2) {
+			block = buildBlock(cache, pgrm, pc);
+		}
+	}
+	pgrm->pc = pc;
+	return start - budget;
+
+}
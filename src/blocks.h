@@ -0,0 +1,20 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef BLOCKS_H_
+#define BLOCKS_H_
+
+#include "cpu.h"
+
+// BLOCK CACHE INTERFACE
+
+uint64_t runBlocks (CPU *cpu, int lifetime);
+
+void invalidateBlocks (CPU *cpu);
+
+#endif
@@ -0,0 +1,272 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include<time.h>
+#include<sys/stat.h>
+#include "display.h"
+#include "cpu.h"
+#include "capture.h"
+
+//---------------------------------------------
+
+// The display hands over a frame whenever the guest finished one, on the
+// thread that drains the I2C bus. It only copies the pages into a slot of
+// the queue, the writer thread does the rest: the hash, the delta to the
+// frame before, the run length coding, the file and the PBM images. Frames
+// are never dropped, a full queue makes the display wait for the writer.
+//
+// The display only wakes the writer once CAPTURE_BATCH frames wait, so a
+// guest drawing quickly costs a wakeup per batch and not per frame. Slower
+// frames are picked up when the writer looks again after CAPTURE_IDLE_MS.
+//
+// The PBM images are P4, 1 is a lit pixel and the instruction count and
+// power are in a comment line.
+
+#define CAPTURE_BATCH (CAPTURE_QUEUE/2)
+#define CAPTURE_IDLE_MS 100
+#define FRAME_BYTES (PAGES*COLS)
+#define CODED_BYTES (FRAME_BYTES + FRAME_BYTES/128 + 1) // all literal at worst
+
+typedef struct Frame {
+	uint8_t ram[PAGES][COLS];
+	int power;
+	uint64_t clock;
+} Frame;
+
+typedef struct Capture {
+	Frame queue[CAPTURE_QUEUE];
+	uint32_t head; // both under lock
+	uint32_t tail;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t emptied;
+	pthread_t thread;
+	FILE *file;
+	char *path;
+	char *pbmDir;
+	uint8_t last[FRAME_BYTES]; // the frame before, only used by the writer
+	uint64_t frames;
+	int failed;
+} Capture;
+
+Capture *capture = NULL;
+
+static uint64_t hashFrame (const uint8_t *bytes) {
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < FRAME_BYTES; i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+	return hash;
+
+}
+
+// codes the XOR of bytes and last into out and returns the length
+static uint32_t codeFrame (const uint8_t *bytes, const uint8_t *last, uint8_t *out) {
+
+	uint8_t delta[FRAME_BYTES];
+	for (int i = 0; i < FRAME_BYTES; i++) {
+		delta[i] = bytes[i] ^ last[i];
+	}
+	uint32_t size = 0;
+	int i = 0;
+	while (i < FRAME_BYTES) {
+		int run = 0;
+		if (delta[i] == 0) {
+			while (i + run < FRAME_BYTES && run < 128 && delta[i + run] == 0) {
+				run++;
+			}
+			out[size++] = run - 1;
+		} else {
+			// a single unchanged byte is cheaper as a literal
+			while (i + run < FRAME_BYTES && run < 128 && (delta[i + run] != 0 ||
+					(i + run + 1 < FRAME_BYTES && delta[i + run + 1] != 0))) {
+				run++;
+			}
+			out[size++] = 127 + run;
+			memcpy(out + size, delta + i, run);
+			size += run;
+		}
+		i += run;
+	}
+	return size;
+
+}
+
+static void writePbm (Frame *frame, uint64_t number) {
+
+	char name[4096];
+	snprintf(name, sizeof(name), "%s/frame_%06llu.pbm", capture->pbmDir, (unsigned long long)number);
+	FILE *file = fopen(name, "wb");
+	if (file == NULL) {
+		if (!capture->failed) {
+			printf("ERROR: cannot write %s\n", name);
+		}
+		capture->failed = 1;
+		return;
+	}
+	fprintf(file, "P4\n# instructions %llu power %d\n%d %d\n", (unsigned long long)frame->clock, frame->power, COLS, PAGES*8);
+	for (int row = 0; row < PAGES*8; row++) {
+		uint8_t line[(COLS + 7)/8] = {0};
+		for (int col = 0; col < COLS; col++) {
+			if (frame->ram[row/8][col] & (1 << (row%8))) {
+				line[col/8] |= 0x80 >> (col%8);
+			}
+		}
+		fwrite(line, 1, sizeof(line), file);
+	}
+	fclose(file);
+
+}
+
+static void writeFrame (Frame *frame) {
+
+	const uint8_t *bytes = &frame->ram[0][0];
+	uint8_t coded[CODED_BYTES];
+	FrameHeader header;
+	header.instructions = frame->clock;
+	header.hash = hashFrame(bytes);
+	header.power = frame->power;
+	header.size = codeFrame(bytes, capture->last, coded);
+	memcpy(capture->last, bytes, FRAME_BYTES);
+	if (fwrite(&header, sizeof(header), 1, capture->file) != 1 || fwrite(coded, 1, header.size, capture->file) != header.size) {
+		if (!capture->failed) {
+			printf("ERROR: cannot write capture %s\n", capture->path);
+		}
+		capture->failed = 1;
+	}
+	if (capture->pbmDir != NULL) {
+		writePbm(frame, capture->frames);
+	}
+	capture->frames++;
+
+}
+
+static void *runWriter (void *args) {
+
+	pthread_mutex_lock(&capture->lock);
+	while (1) {
+		while (capture->head == capture->tail && !capture->stop) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += CAPTURE_IDLE_MS * 1000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&capture->filled, &capture->lock, &until);
+		}
+		if (capture->head == capture->tail) {
+			break;
+		}
+		// the slot stays ours until tail moves past it
+		Frame *frame = &capture->queue[capture->tail % CAPTURE_QUEUE];
+		pthread_mutex_unlock(&capture->lock);
+		writeFrame(frame);
+		pthread_mutex_lock(&capture->lock);
+		capture->tail++;
+		pthread_cond_signal(&capture->emptied);
+	}
+	pthread_mutex_unlock(&capture->lock);
+	return NULL;
+
+}
+
+int startCapture (char *path, char *pbmDir) {
+
+	struct stat st;
+	if (pbmDir != NULL && stat(pbmDir, &st) != 0 && mkdir(pbmDir, 0777) != 0) {
+		printf("ERROR: cannot create frame directory %s\n", pbmDir);
+		return 0;
+	}
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		printf("ERROR: cannot write capture %s\n", path);
+		return 0;
+	}
+	capture = malloc(sizeof(Capture));
+	if (capture == NULL) {
+		printf("ERROR: Cannot allocate capture\n");
+		fclose(file);
+		return 0;
+	}
+	capture->head = 0;
+	capture->tail = 0;
+	capture->stop = 0;
+	capture->file = file;
+	capture->path = path;
+	capture->pbmDir = pbmDir;
+	capture->frames = 0;
+	capture->failed = 0;
+	memset(capture->last, 0, FRAME_BYTES);
+	pthread_mutex_init(&capture->lock, NULL);
+	pthread_cond_init(&capture->filled, NULL);
+	pthread_cond_init(&capture->emptied, NULL);
+
+	CaptureHeader header = {CAPTURE_MAGIC, CAPTURE_VERSION, COLS, PAGES};
+	fwrite(&header, sizeof(header), 1, file);
+
+	if (pthread_create(&capture->thread, NULL, runWriter, NULL)) {
+		printf("ERROR: Failed to create Capture Thread\n");
+		exit(EXIT_FAILURE);
+	}
+	return 1;
+
+}
+
+void captureFrame (const uint8_t ram[PAGES][COLS], int power, uint64_t clock) {
+
+	if (capture == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&capture->lock);
+	while (capture->head - capture->tail == CAPTURE_QUEUE) {
+		pthread_cond_wait(&capture->emptied, &capture->lock);
+	}
+	Frame *frame = &capture->queue[capture->head % CAPTURE_QUEUE];
+	pthread_mutex_unlock(&capture->lock);
+	// the writer does not look at the slot before head moves
+	memcpy(frame->ram, ram, FRAME_BYTES);
+	frame->power = power;
+	frame->clock = clock;
+	pthread_mutex_lock(&capture->lock);
+	capture->head++;
+	if (capture->head - capture->tail == CAPTURE_BATCH) {
+		pthread_cond_signal(&capture->filled);
+	}
+	pthread_mutex_unlock(&capture->lock);
+
+}
+
+void stopCapture () {
+
+	if (capture == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&capture->lock);
+	capture->stop = 1;
+	pthread_cond_signal(&capture->filled);
+	pthread_mutex_unlock(&capture->lock);
+	pthread_join(capture->thread, NULL);
+	fclose(capture->file);
+	printf("Capture: %llu frames written to %s\n", (unsigned long long)capture->frames, capture->path);
+	pthread_mutex_destroy(&capture->lock);
+	pthread_cond_destroy(&capture->filled);
+	pthread_cond_destroy(&capture->emptied);
+	free(capture);
+	capture = NULL;
+
+}
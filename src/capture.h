@@ -0,0 +1,50 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include<stdint.h>
+#include "display.h"
+
+#define CAPTURE_MAGIC "TRVF"
+#define CAPTURE_VERSION 1
+#define CAPTURE_QUEUE 64 // frames waiting for the writer, a full queue blocks
+
+// CAPTURE INTERFACE
+
+// A capture file starts with a CaptureHeader, then every frame follows as
+// a FrameHeader and size bytes of its pages XORed with the frame before
+// (zeros before the first), run length coded: a control byte c below 128
+// stands for c+1 unchanged bytes, one of 128 or more is followed by c-127
+// bytes as they are.
+typedef struct CaptureHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t cols;
+	uint32_t pages;
+} CaptureHeader;
+
+typedef struct FrameHeader {
+	uint64_t instructions; // clock of the store that ended the frame
+	uint64_t hash; // FNV-1a of the PAGES*COLS bytes of the frame
+	uint32_t power;
+	uint32_t size;
+} FrameHeader;
+
+// opens path and starts the writer thread, with pbmDir every frame is
+// also written as DIR/frame_NNNNNN.pbm. Returns 0 if path cannot be opened.
+int startCapture (char *path, char *pbmDir);
+
+// queues a copy of the pages, called by the display at the end of a frame
+void captureFrame (const uint8_t ram[PAGES][COLS], int power, uint64_t clock);
+
+// writes what is queued, stops the writer and closes the file
+void stopCapture ();
+
+#endif
@@ -1,5 +1,7 @@
 import os
 import re
+import struct
+import sys
 
 # this is just the enum copied from the simulator
 instructions_list = [
@@ -7,7 +9,11 @@ instructions_list = [
     "ADDI", "ANDI", "ORI", "XORI", "SLTI", "SLTIU", "SRAI", "SRLI", "LUI", "AUIPC",
     "LW", "SW", "BEQ", "BNE", "BLT", "BGE", "BLTU", "BGEU", "JAL", "JALR", "FLAG",
     "NOP", "LI", "LA", "MV", "NOT", "NEG", "SEQZ", "SNEZ", "SLTZ", "SGTZ", "BEQZ", "BNEZ", "BLEZ", "BGEZ", "BLTZ", "BGTZ",
-    "BGT", "BLE", "BGTU", "BLEU", "J", "JR", "RET", "CALL", "LEAVE"]
+    "BGT", "BLE", "BGTU", "BLEU", "J", "JR", "RET", "CALL", "LEAVE",
+    "LB", "LH", "LBU", "LHU", "SB", "SH", "MULH", "MULHSU", "MULHU", "DIV", "DIVU", "REM", "REMU",
+    "ECALL", "EBREAK", "ILLEGAL",
+    "LR", "SC", "AMOSWAP", "AMOADD", "AMOXOR", "AMOAND", "AMOOR", "AMOMIN", "AMOMAX", "AMOMINU", "AMOMAXU",
+    "FENCE", "CSRR", "JALRX"]
 
 instructions_dict = {}
 
@@ -208,6 +214,85 @@ def compile(input_file, output_file):
         outfile.writelines(lines)
 
     # print(lines)
+    return startline
+
+
+def write_image(text_file, image_file, startline):
+    """
+    packs compiled text into the binary image read by image.c:
+    header (magic, version, entry, count, line table offset, commands offset),
+    the line table and the page aligned commands, all little-endian.
+    commands are lowered like lowerProgram does when loading, so the
+    simulator finds nothing to write to the mapped image, and packed like
+    packCommand: type, index of the operand kept as 32 bit immediate, the
+    other two as signed bytes
+    """
+    with open(text_file, 'r') as infile:
+        commands = [[int(v) for v in line.split()] for line in infile if line.strip() != ""]
+
+    header_size = 24
+    line_table_offset = header_size
+    commands_offset = line_table_offset + 4 * len(commands)
+    commands_offset = (commands_offset + 4095) // 4096 * 4096
+
+    with open(image_file, 'wb') as outfile:
+        outfile.write(struct.pack("<4sIIIII", b"TRVB", 2, startline * 4, len(commands),
+                                  line_table_offset, commands_offset))
+        # source line of every command, the compiled text keeps one command per line
+        outfile.write(struct.pack(f"<{len(commands)}I", *range(1, len(commands) + 1)))
+        outfile.write(bytes(commands_offset - outfile.tell()))
+        for c in commands:
+            outfile.write(pack_command(lower_command(c)))
+
+
+# pseudo instruction -> base instruction, as lowerCommand in the simulator
+lowering = {
+    "NOP": lambda rd, rs1, rs2: ("ADDI", 0, 0, 0),
+    "LI": lambda rd, rs1, rs2: ("ADDI", rd, 0, rs1),
+    "MV": lambda rd, rs1, rs2: ("ADDI", rd, rs1, 0),
+    "NOT": lambda rd, rs1, rs2: ("XORI", rd, rs1, 0),
+    "NEG": lambda rd, rs1, rs2: ("SUB", rd, 0, 0),
+    "SEQZ": lambda rd, rs1, rs2: ("SLTIU", rd, rs1, 1),
+    "SNEZ": lambda rd, rs1, rs2: ("SLTU", rd, 0, rs1),
+    "SLTZ": lambda rd, rs1, rs2: ("SLT", rd, rs1, 0),
+    "SGTZ": lambda rd, rs1, rs2: ("SLT", rd, 0, rs1),
+    "BEQZ": lambda rd, rs1, rs2: ("BEQ", rd, 0, rs1),
+    "BNEZ": lambda rd, rs1, rs2: ("BNE", rd, 0, rs1),
+    "BLEZ": lambda rd, rs1, rs2: ("BGE", 0, rd, rs1),
+    "BGEZ": lambda rd, rs1, rs2: ("BGE", rd, 0, rs1),
+    "BLTZ": lambda rd, rs1, rs2: ("BLT", rd, 0, rs1),
+    "BGTZ": lambda rd, rs1, rs2: ("BLT", 0, rd, rs1),
+    "BGT": lambda rd, rs1, rs2: ("BLT", rs1, rd, rs2),
+    "BLE": lambda rd, rs1, rs2: ("BGE", rs1, rd, rs2),
+    "BGTU": lambda rd, rs1, rs2: ("BLTU", rs1, rd, rs2),
+    "BLEU": lambda rd, rs1, rs2: ("BLTU", rs1, rd, rs2),
+    "J": lambda rd, rs1, rs2: ("JAL", 0, rd, 0),
+    "JR": lambda rd, rs1, rs2: ("JALR", 0, rd, 0),
+    "RET": lambda rd, rs1, rs2: ("JALR", 0, 1, 0),
+    "CALL": lambda rd, rs1, rs2: ("JAL", 1, rd, 0),
+}
+
+
+def lower_command(command):
+    kind = command[0]
+    if kind < 0 or kind >= len(instructions_list) or instructions_list[kind] not in lowering:
+        return command
+    low = lowering[instructions_list[kind]](*command[1:])
+    return [instructions_list.index(low[0])] + list(low[1:])
+
+
+def pack_command(command):
+    def fits(v):
+        return -128 <= v <= 127
+
+    kind, ops = command[0], command[1:]
+    wide = 2
+    for i in range(3):
+        if not fits(ops[i]):
+            wide = i
+            break
+    small = [v if fits(v) else -128 for i, v in enumerate(ops) if i != wide]
+    return struct.pack("<BBbbi", kind, wide, small[0], small[1], ops[wide])
 
 
 alias_list = ["zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2", "a3", "a4",
@@ -284,9 +369,17 @@ if __name__ == "__main__":
     init_instruction_dict()
     init_alias_dict()
 
+    # usage: python3 compiler.py [--binary] [asm directory] [output file]
+    # --binary also writes compiled.bin (or the output file with .bin)
+    binary = "--binary" in sys.argv
+    args = [a for a in sys.argv[1:] if a != "--binary"]
     output_file = "compiled.txt"
     debug_file = "debugger_info.txt"
     directory = "./asm"
+    if len(args) > 0:
+        directory = args[0]
+    if len(args) > 1:
+        output_file = args[1]
 
     file_paths = []
 
@@ -309,4 +402,6 @@ if __name__ == "__main__":
     ranges = concatenate_files(output_file, *file_paths)
     expand_macros(output_file, debug_file)
     get_breakpoints(debug_file)
-    compile(debug_file, output_file)
+    startline = compile(debug_file, output_file)
+    if binary:
+        write_image(output_file, os.path.splitext(output_file)[0] + ".bin", startline)
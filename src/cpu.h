@@ -10,27 +10,67 @@
 #define CPU_H_
 
 #include<stdint.h>
+#include<stddef.h>
 #include<pthread.h>
 
 // CPU INTERFACE
 
+typedef struct LockStats {
+	uint64_t acquired; // times the device lock was taken
+	uint64_t contended; // times it was already held by another thread
+	uint64_t waitNs; // time spent waiting for it
+} LockStats;
+
+#define PAGE_SHIFT 12 // guest memory is mapped and tracked in 4 KiB pages
+#define MAX_DEVICES 8
+
+struct Memory;
+
+typedef int32_t (*DeviceRead) (struct Memory *mem, int32_t addr);
+
+typedef void (*DeviceWrite) (struct Memory *mem, int32_t addr, int32_t data);
+
+typedef struct Device {
+	int32_t min; // first and last address the device answers to
+	int32_t max;
+	DeviceRead read;
+	DeviceWrite write;
+} Device;
+
 typedef struct Memory {
-	int32_t *data;
+	int32_t *data; // reserved with mmap, pages are committed on first touch
 	int32_t size;
+	uint8_t **map; // host address of every page, NULL if it needs the slow path
+	uint8_t *touched; // 1 for every page written since the last reset
+	int32_t pages;
+	int fileMapped; // some pages are mapped from a snapshot, see snapshot.c
+	Device devices[MAX_DEVICES];
+	int32_t deviceCount;
+	// device registers, only accessed through __atomic builtins, so loads and
+	// stores to RAM never need a lock even while runIOConnector writes GPIO_IN
 	uint8_t GPIO_IN;
 	uint8_t GPIO_OUT;
 	int32_t I2C_REST;
 	int32_t DISPLAY;
+	pthread_mutex_t *deviceLock; // serializes display commands, owned by SharedMemory
+	LockStats *lockStats;
+	int halted; // set once the guest stored its exit code to the halt device
+	int32_t exitCode;
 } Memory;
 
 typedef struct SharedMemory {
 	Memory *mem;
 	pthread_mutex_t mutex;
+	LockStats stats;
 } SharedMemory;
 
 typedef struct Register {
 	int32_t *data;
 	int32_t size;
+	int32_t hartId; // read by csrr mhartid, see harts.c
+	int reserved; // set by lr, cleared by sc
+	int32_t reservation; // address and value lr read, sc only stores if
+	int32_t reservedValue; // the word still holds that value
 } Register;
 
 typedef enum CommandType {
@@ -39,7 +79,13 @@ typedef enum CommandType {
 	LW,SW,BEQ,BNE,BLT,BGE,BLTU,BGEU,JAL,JALR,FLAG,
 	//pseudo instructions
 	NOP,LI,LA,MV,NOT,NEG,SEQZ,SNEZ,SLTZ,SGTZ,BEQZ,BNEZ,BLEZ,BGEZ,BLTZ,BGTZ,
-	BGT,BLE, BGTU, BLEU, J,JR,RET,CALL,LEAVE
+	BGT,BLE, BGTU, BLEU, J,JR,RET,CALL,LEAVE,
+	//decoded from ELF files, see elfloader.c
+	LB,LH,LBU,LHU,SB,SH,MULH,MULHSU,MULHU,DIV,DIVU,REM,REMU,ECALL,EBREAK,ILLEGAL,
+	//atomics and CSRs for several harts, see harts.c
+	LR,SC,AMOSWAP,AMOADD,AMOXOR,AMOAND,AMOOR,AMOMIN,AMOMAX,AMOMINU,AMOMAXU,FENCE,CSRR,
+	//jalr of ELF files, reads rs1 before it links, see elfloader.c
+	JALRX
 } CommandType;
 
 typedef struct Command {
@@ -49,21 +95,58 @@ typedef struct Command {
 	int32_t c;
 } Command;
 
+// Commands are stored in 8 bytes: the operand that needs more than a byte
+// (the immediate, if there is one) goes to imm, the other two to small.
+typedef struct PackedCommand {
+	uint8_t type;
+	uint8_t wide; // which of a, b, c is kept in imm
+	int8_t small[2];
+	int32_t imm;
+} PackedCommand;
+
 typedef struct Program {
 	int32_t pc;
-	Command *addr;
-	int32_t size;
+	PackedCommand *addr;
+	int32_t size; // allocated commands, grows while loading up to maxSize
+	int32_t maxSize;
+	int32_t length; // number of commands loaded by readProgram
+	void *decoded; // threaded engine's copy of the program, see engine.c
+	int decodedValid;
+	int32_t entry; // pc the program starts at, 0 for text programs
+	void *image; // addr is mapped from a binary image if set, see image.c
+	size_t imageSize;
+	void *segments; // initial memory of an ELF program, see elfloader.c
+	int32_t stack; // initial sp, 0 for text programs
+	void *listing; // source lines for the debugger, see assembler.c
 } Program;
 
+typedef enum Engine {
+	ENGINE_SWITCH, // executeCommand, one instruction at a time
+	ENGINE_THREADED, // pre-decoded handlers, see engine.c
+	ENGINE_BLOCK, // cached basic blocks with linked exits, see blocks.c
+	ENGINE_JIT // x86-64 translation of basic blocks, see jit.c
+} Engine;
+
 typedef struct CPU {
 	Register *reg;
 	SharedMemory *shared;
 	Program *pgrm;
+	Engine engine;
+	struct BlockCache *blocks;
+	struct JitState *jit; // translated code, kept between runJit calls
+	uint64_t retired; // by runEngine since the last reset
 } CPU;
 
 typedef struct CPUargs {
 	CPU *cpu;
-	int lifetime;
+	int lifetime; // per hart
+	int harts; // more than 1 runs them on their own threads, see harts.c
+	int quantum;
+	int freeRunning;
+	char *snapshotSave; // written after the run if set, see snapshot.c
+	uint64_t retired; // filled in by runCPU
+	double seconds;
+	double loadSeconds; // readProgram, filled in by runSimulation
 } CPUargs;
 
 typedef struct IOargs {
@@ -71,8 +154,60 @@ typedef struct IOargs {
 	int32_t baseAddr; // NO LONGER IN USE, SEE FIRST CODE SECTION INSTEAD
 } IOargs;
 
+// malloc, calloc and realloc calls of the whole process so far
+uint64_t getAllocations ();
+
+int32_t rR (Register *reg, int32_t addr);
+
+void wR (Register *reg, int32_t addr, int32_t data);
+
+int32_t rM (Memory *mem, int32_t addr);
+
+void wM (Memory *mem, int32_t addr, int32_t data);
+
+// 1, 2 or 4 byte accesses, loads are zero extended
+int32_t rMn (Memory *mem, int32_t addr, int bytes);
+
+void wMn (Memory *mem, int32_t addr, int32_t data, int bytes);
+
+// atomic read-modify-write of an aligned RAM word with one of the AMO
+// types, returns the old value. LR only loads.
+int32_t amoM (Memory *mem, int32_t addr, CommandType type, int32_t data);
+
+// stores data if the word still holds expected, returns 1 if it did
+int casM (Memory *mem, int32_t addr, int32_t expected, int32_t data);
+
+int32_t countTouched (Memory *mem);
+
+SharedMemory *createSharedMemory (int32_t size);
+
+void freeSharedMemory (SharedMemory *shared);
+
+void resetMemory (Memory *mem);
+
+void addCommand (Program *pgrm, int32_t line, CommandType type, int32_t a, int32_t b, int32_t c);
+
+Command commandAt (Program *pgrm, int32_t index);
+
+#define ACCESS_LOAD 1
+#define ACCESS_STORE 2
+
+// the memory the command at pc is about to access: sets addr and bytes and
+// returns ACCESS_LOAD, ACCESS_STORE, both, or 0 if it does not access any
+int memoryAccess (Program *pgrm, Register *reg, int32_t *addr, int32_t *bytes);
+
 void runCommand (CPU *cpu);
 
+// runs up to lifetime instructions (-1 for no limit) on the selected
+// engine, returns how many retired
+uint64_t runEngine (CPU *cpu, int lifetime);
+
+// cpu->retired plus the instructions of the current runEngine call up to
+// and including the store, set by every engine before a store that can
+// reach a device. One per thread, so each hart has its own. The I2C bus
+// stamps its transfers with it.
+extern __thread uint64_t storeClock;
+
 void resetCPU(CPU *cpu);
 
 #endif
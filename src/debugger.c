@@ -6,17 +6,25 @@
  *
  */
 
+#include <ctype.h>
 #include <curses.h>
 #include <ncurses.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "assembler.h"
 #include "cpu.h"
 #include "display.h"
+#include "debugger.h"
+#include "history.h"
+#include "i2c.h"
+#include "memory.h"
 
 #define MAX_LINES 10024           // Maximum number of lines
 #define MAX_LINE_LENGTH 1024     // Maximum length of a single line
@@ -28,12 +36,35 @@ const int SLEEPTIME = 1000;
 const int CYCLES_PER_SLEEP = 1000;
 const int RES_X = 270;
 const int RES_Y = 70;
+const long PUBLISH_NS = 10000000; // at most 100 states a second while running
 
 int mem_base_addr = 0;
 
-int nextCommand = 0;
-int nextBreakpoint = 0;
-int justRun = 0;
+typedef enum RunMode {
+  MODE_PAUSED,
+  MODE_STEP,               // n
+  MODE_TO_BREAKPOINT,      // b, runs until a breakpoint or watchpoint
+  MODE_RUN,                // r, ignores breakpoints
+  MODE_STEP_BACK,          // N
+  MODE_BACK_TO_BREAKPOINT, // B
+  MODE_RESET               // q
+} RunMode;
+
+const char *mode_names[] = {"paused", "step", "running to breakpoint",
+                            "running", "step back", "back to breakpoint",
+                            "reset"};
+
+// The key thread asks for a mode and signals, the runner sleeps on the
+// condition variable while paused, so a step starts right away and a paused
+// debugger takes no CPU time. While running, the runner loads the mode
+// atomically between instructions and stops once it changes. The throttle
+// of a run waits on the same condition variable, so keys cut it short.
+pthread_mutex_t mode_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mode_changed = PTHREAD_COND_INITIALIZER;
+RunMode mode = MODE_PAUSED;
+int full_speed = 0; // f, runs without the throttle
+
+History *history = NULL;
 
 int showDisplay = 1;
 int showRegister = 1;
@@ -49,12 +80,64 @@ int line_count = 0;
 int *breakpoints;
 int breakpoint_count;
 
+// every breakpoint including the --break ones, sorted by line, and one bit
+// per instruction that has any, so instructions without a breakpoint cost
+// one bit test no matter how many breakpoints there are
+Breakpoint *breaks = NULL;
+int32_t break_count = 0;
+uint8_t *break_bits = NULL;
+int32_t break_lines = 0;
+
+// only looked at when there are any, otherwise loads and stores run as is
+Watchpoint *watches = NULL;
+int32_t watch_count = 0;
+char watch_message[128] = "";
+
+// The UI draws only from the state the runner published last and never
+// reads the CPU, so it cannot see a register file or memory half way
+// through an instruction. The runner publishes under a sequence count that
+// is odd while it writes, the UI copies and tries again if the count
+// changed meanwhile, so neither waits for the other. The runner publishes
+// after every action, when it pauses and at most every PUBLISH_NS while
+// running, a run at full speed pays one clock read per CYCLES_PER_SLEEP
+// instructions for it.
+typedef struct UiState {
+  RunMode mode;
+  int full_speed;
+  int32_t pc;
+  int32_t registers[32];
+  int32_t register_count;
+  int32_t mem_base;
+  uint8_t memory[64]; // bytes outside of the memory read as 0
+  int32_t gpio_in;
+  int32_t gpio_out;
+  int32_t display;
+  int32_t i2c_rest;
+  uint64_t step;
+  uint64_t reach;
+  char watch_message[128];
+  uint64_t display_version; // the screen is only copied when it changed
+  Display screen;
+} UiState;
+
+UiState ui_state;
+uint32_t ui_sequence = 0;
+int publish_requested = 0; // j, k and m move the window while paused
+
 //panel vars
 int next_panel_y = 1;
 int next_panel_x = 1;
 WINDOW *win;
 
-void print_instructions(int line) {
+// The panels below draw themselves only when dirty, otherwise they just
+// move next_panel_x/y past their place, so the panels after them stay put.
+
+void print_instructions(UiState *state, int dirty) {
+  int line = state->pc / 4;
+  if (!dirty) {
+    next_panel_y += NUMBER_OF_INSTRUCTIONS + 1 + (watch_count > 0);
+    return;
+  }
   // Print all lines
   int max_lines = (line + NUMBER_OF_INSTRUCTIONS) < (line_count)
                       ? (line + NUMBER_OF_INSTRUCTIONS)
@@ -70,9 +153,26 @@ void print_instructions(int line) {
   }
 
   next_panel_y += NUMBER_OF_INSTRUCTIONS;
+  wmove(win, next_panel_y++, next_panel_x);
+  wprintw(win, "%-24s%-12s", mode_names[state->mode],
+          state->full_speed ? "full speed" : "");
+  if (history != NULL) {
+    wprintw(win, "step %llu, %llu steps back   ",
+            (unsigned long long)state->step,
+            (unsigned long long)state->reach);
+  }
+  if (watch_count > 0) {
+    wmove(win, next_panel_y++, next_panel_x);
+    wprintw(win, "%-60s", state->watch_message);
+  }
 }
 
-void printRegister(Register *reg) {
+void printRegister(UiState *state, int dirty) {
+  int32_t *data = state->registers;
+  if (!dirty) {
+    next_panel_y += 4 + (state->register_count + 3) / 4;
+    return;
+  }
   wmove(win, next_panel_y++, next_panel_x); // Adjust the position as needed
   wprintw(win, "==============================================================="
                "======================\n");
@@ -83,12 +183,12 @@ void printRegister(Register *reg) {
                "----------------------\n");
 
   int i = 0;
-  for (; i < reg->size; i += 4) {
+  for (; i < state->register_count; i += 4) {
     wmove(win, next_panel_y + i / 4, next_panel_x);
     wprintw(win,
             "x%-2d: 0x%12x | x%-2d: 0x%12x | x%-2d: 0x%12x | x%-2d: 0x%12x\n",
-            i, (uint32_t)reg->data[i], i + 1, (uint32_t)reg->data[i + 1], i + 2,
-            (uint32_t)reg->data[i + 2], i + 3, (uint32_t)reg->data[i + 3]);
+            i, (uint32_t)data[i], i + 1, (uint32_t)data[i + 1], i + 2,
+            (uint32_t)data[i + 2], i + 3, (uint32_t)data[i + 3]);
   }
   next_panel_y += i / 4;
   wmove(win, next_panel_y++, next_panel_x);
@@ -96,8 +196,13 @@ void printRegister(Register *reg) {
                "======================\n");
 }
 
-void printMemory(Memory *mem, int addr) {
-  int8_t *memaddr = (int8_t *)(mem->data);
+void printMemory(UiState *state, int dirty) {
+  int addr = state->mem_base;
+  uint8_t *memaddr = state->memory;
+  if (!dirty) {
+    next_panel_y += 3 + 64 / 4 + 2;
+    return;
+  }
   wmove(win, next_panel_y++, next_panel_x); // Adjust the position as needed
   wprintw(win, "==============================================================="
                "==========================\n");
@@ -111,31 +216,36 @@ void printMemory(Memory *mem, int addr) {
   for (; i < 64; i += 4) {
     wmove(win, next_panel_y + i / 4, next_panel_x);
     wprintw(win, "%-4d: 0x%12x | %-4d: 0x%12x | %-4d: 0x%12x | %-4d: 0x%12x\n",
-            addr + i, (uint8_t)memaddr[addr + i], addr + i + 1,
-            (uint8_t)memaddr[addr + i + 1], addr + i + 2,
-            (uint8_t)memaddr[addr + i + 2], addr + i + 3,
-            (uint8_t)memaddr[addr + i + 3]);
+            addr + i, memaddr[i], addr + i + 1, memaddr[i + 1], addr + i + 2,
+            memaddr[i + 2], addr + i + 3, memaddr[i + 3]);
   }
   next_panel_y += i / 4;
   wmove(win, next_panel_y++, next_panel_x);
   wprintw(win, "GPIO-IN: 0x%x GPIO-OUT: 0x%x I2C-DISPLAY: 0x%x I2C-REST: 0x%x",
-          (uint8_t)mem->GPIO_IN, (uint8_t)mem->GPIO_OUT, (uint32_t)mem->DISPLAY,
-          (uint32_t)mem->I2C_REST);
+          state->gpio_in, state->gpio_out, (uint32_t)state->display,
+          (uint32_t)state->i2c_rest);
   wmove(win, next_panel_y++, next_panel_x);
   wprintw(win, "==============================================================="
                "==========================\n");
 }
 
-void print_display(char (*display)[COLS + 1]) {
-  wmove(win, next_panel_y, next_panel_x);
-  int i;
-  for (i = 0; i < PAGES * 8; i++) {
-    wprintw(win, "%s\n", display[i]);
-    wmove(win, i + next_panel_y, next_panel_x);
-  }
-  // draw box around display
-  whline(win, next_panel_x - 1, COLS);
-  mvwvline(win, 1, next_panel_x + COLS + 1, 0, PAGES * 8 - 1);
+// the rows the display panel shows, only rows that differ are drawn again
+char display_rows[PAGES * 8][COLS + 1];
+
+void print_display(Display *screen, int dirty) {
+  if (dirty) {
+    char rows[PAGES * 8][COLS + 1];
+    renderDisplay(screen, rows);
+    for (int i = 0; i < PAGES * 8; i++) {
+      if (memcmp(rows[i], display_rows[i], COLS) != 0) {
+        mvwaddnstr(win, next_panel_y + i, next_panel_x, rows[i], COLS);
+        memcpy(display_rows[i], rows[i], COLS + 1);
+      }
+    }
+    // draw box around display
+    mvwhline(win, next_panel_y + PAGES * 8, next_panel_x, 0, COLS);
+    mvwvline(win, next_panel_y, next_panel_x + COLS + 1, 0, PAGES * 8);
+  }
   next_panel_x += COLS+2;
 }
 
@@ -173,6 +283,29 @@ void load_debug_file() {
   return;
 }
 
+// programs assembled by the simulator bring their listing along, only
+// programs from compiler.py need its files
+void load_listing(Listing *listing) {
+  for (int i = 0; i < listing->count && line_count < MAX_LINES; i++) {
+    lines[line_count] = malloc(strlen(listing->lines[i]) + 1);
+    if (lines[line_count] == NULL) {
+      perror("Error allocating memory");
+      return;
+    }
+    strcpy(lines[line_count], listing->lines[i]);
+    line_count++;
+  }
+
+  breakpoints = malloc((listing->breakpointCount + 1) * sizeof(int));
+  if (breakpoints == NULL) {
+    perror("Memory allocation error");
+    breakpoint_count = 0;
+    return;
+  }
+  memcpy(breakpoints, listing->breakpoints, listing->breakpointCount * sizeof(int));
+  breakpoint_count = listing->breakpointCount;
+}
+
 void read_breakpoint_info() {
   const char *filename = "breakpoint_info.txt";
   FILE *file = fopen(filename, "r");
@@ -241,28 +374,128 @@ void init_screen() {
   wrefresh(win);
 }
 
-void init_debugger() {
+void init_debugger(CPU *cpu) {
   init_screen();
-  load_debug_file();
-  read_breakpoint_info();
+  if (cpu->pgrm->listing != NULL) {
+    load_listing(cpu->pgrm->listing);
+  } else {
+    load_debug_file();
+    read_breakpoint_info();
+  }
 
   getch();
   endwin();
 }
 
+// only called by the runner, between instructions
+void publish_state(CPU *cpu) {
+  Memory *mem = cpu->shared->mem;
+  UiState *state = &ui_state;
+  __atomic_store_n(&ui_sequence, ui_sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  state->mode = __atomic_load_n(&mode, __ATOMIC_ACQUIRE);
+  state->full_speed = __atomic_load_n(&full_speed, __ATOMIC_RELAXED);
+  state->pc = cpu->pgrm->pc;
+  state->register_count = cpu->reg->size < 32 ? cpu->reg->size : 32;
+  memcpy(state->registers, cpu->reg->data,
+         state->register_count * sizeof(int32_t));
+  state->mem_base = __atomic_load_n(&mem_base_addr, __ATOMIC_RELAXED);
+  for (int i = 0; i < 64; i++) {
+    int64_t addr = (int64_t)state->mem_base + i;
+    state->memory[i] =
+        addr >= 0 && addr < mem->size ? ((uint8_t *)mem->data)[addr] : 0;
+  }
+  state->gpio_in = __atomic_load_n(&mem->GPIO_IN, __ATOMIC_ACQUIRE);
+  state->gpio_out = __atomic_load_n(&mem->GPIO_OUT, __ATOMIC_ACQUIRE);
+  state->display = __atomic_load_n(&mem->DISPLAY, __ATOMIC_ACQUIRE);
+  state->i2c_rest = __atomic_load_n(&mem->I2C_REST, __ATOMIC_ACQUIRE);
+  state->step = history != NULL ? historyStep(history) : 0;
+  state->reach = history != NULL ? historyReach(history) : 0;
+  memcpy(state->watch_message, watch_message, sizeof(watch_message));
+  busSync(); // the transfers of the last instructions may still be queued
+  if (state->display_version != displayVersion() || ui_sequence == 1) {
+    state->display_version = displayVersion();
+    saveDisplayState(&state->screen);
+  }
+
+  __atomic_store_n(&ui_sequence, ui_sequence + 1, __ATOMIC_RELEASE);
+}
+
+// copies the last published state, returns its sequence count
+uint32_t read_state(UiState *out) {
+  while (1) {
+    uint32_t before = __atomic_load_n(&ui_sequence, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+      sched_yield();
+      continue;
+    }
+    memcpy(out, &ui_state, sizeof(UiState));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&ui_sequence, __ATOMIC_RELAXED) == before) {
+      return before;
+    }
+  }
+}
+
+int code_dirty(UiState *state, UiState *drawn) {
+  return state->pc != drawn->pc || state->mode != drawn->mode ||
+         state->full_speed != drawn->full_speed ||
+         state->step != drawn->step || state->reach != drawn->reach ||
+         strcmp(state->watch_message, drawn->watch_message) != 0;
+}
+
+int registers_dirty(UiState *state, UiState *drawn) {
+  return state->register_count != drawn->register_count ||
+         memcmp(state->registers, drawn->registers,
+                state->register_count * sizeof(int32_t)) != 0;
+}
+
+int memory_dirty(UiState *state, UiState *drawn) {
+  return state->mem_base != drawn->mem_base ||
+         memcmp(state->memory, drawn->memory, sizeof(state->memory)) != 0 ||
+         state->gpio_in != drawn->gpio_in ||
+         state->gpio_out != drawn->gpio_out ||
+         state->display != drawn->display || state->i2c_rest != drawn->i2c_rest;
+}
+
 void *threadOne(void *args) {
 
-  CPU *cpu = (CPU *)args;
+  // the state to draw and the one on screen, swapped after every frame
+  UiState *state = malloc(sizeof(UiState));
+  UiState *drawn = malloc(sizeof(UiState));
+  uint32_t shown = 1; // never even, the first state is always drawn
+  int all = 1;        // nothing on screen yet, or it was cleared
+  if (state == NULL || drawn == NULL) {
+    perror("Memory allocation error");
+    exit(EXIT_FAILURE);
+  }
 
   while (1) {
+    uint32_t sequence = read_state(state);
+    if (sequence == shown && !shouldClear) {
+      usleep(10000);
+      continue;
+    }
+    shown = sequence;
     if (shouldClear) {
       wclear(win);
       shouldClear = 0;
+      all = 1;
+      memset(display_rows, 0, sizeof(display_rows));
     }
-    showDisplay ? print_display(getPixels()) : NULL;
-    showCode ? print_instructions(cpu->pgrm->pc / 4) : NULL;
-    showRegister ? printRegister(cpu->reg) : NULL;
-    showMemory ? printMemory(cpu->shared->mem, mem_base_addr) : NULL;
+    showDisplay ? print_display(&state->screen,
+                                all || state->display_version !=
+                                           drawn->display_version)
+                : NULL;
+    showCode ? print_instructions(state, all || code_dirty(state, drawn)) : NULL;
+    showRegister ? printRegister(state, all || registers_dirty(state, drawn))
+                 : NULL;
+    showMemory ? printMemory(state, all || memory_dirty(state, drawn)) : NULL;
+    UiState *swap = drawn;
+    drawn = state;
+    state = swap;
+    all = 0;
     next_panel_x = 1;
     next_panel_y = 1;
 
@@ -275,35 +508,113 @@ void *threadOne(void *args) {
   return NULL;
 }
 
-void *threadTwo(void *args) {
+void request_mode(RunMode next) {
+  pthread_mutex_lock(&mode_lock);
+  __atomic_store_n(&mode, next, __ATOMIC_RELEASE);
+  pthread_cond_signal(&mode_changed);
+  pthread_mutex_unlock(&mode_lock);
+}
 
-  CPU *cpu = (CPU *)args;
+// asks the runner for a new state while it is paused
+void request_publish() {
+  pthread_mutex_lock(&mode_lock);
+  publish_requested = 1;
+  pthread_cond_signal(&mode_changed);
+  pthread_mutex_unlock(&mode_lock);
+}
+
+// waits until there is something to do, the modes that are done after one
+// action are taken, so the runner pauses afterwards
+RunMode take_mode(CPU *cpu) {
+  pthread_mutex_lock(&mode_lock);
+  while (mode == MODE_PAUSED) {
+    if (publish_requested) {
+      publish_requested = 0;
+      pthread_mutex_unlock(&mode_lock);
+      publish_state(cpu);
+      pthread_mutex_lock(&mode_lock);
+      continue;
+    }
+    pthread_cond_wait(&mode_changed, &mode_lock);
+  }
+  RunMode current = mode;
+  if (current != MODE_TO_BREAKPOINT && current != MODE_RUN) {
+    __atomic_store_n(&mode, MODE_PAUSED, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&mode_lock);
+  return current;
+}
+
+// pauses a run, unless a key asked for something else meanwhile
+void stop_running(RunMode running) {
+  pthread_mutex_lock(&mode_lock);
+  if (mode == running) {
+    __atomic_store_n(&mode, MODE_PAUSED, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&mode_lock);
+}
+
+// sleeps SLEEPTIME between the slices of a throttled run
+void throttle() {
+  struct timespec until;
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += SLEEPTIME * 1000L;
+  if (until.tv_nsec >= 1000000000L) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&mode_lock);
+  pthread_cond_timedwait(&mode_changed, &mode_lock, &until);
+  pthread_mutex_unlock(&mode_lock);
+}
+
+void *threadTwo(void *args) {
 
   while (1) {
 
     char in = getch();
     switch (in) {
     case 'n':
-      nextCommand = 1;
+      request_mode(MODE_STEP);
       break;
     case 'j':
-      mem_base_addr+=4;
+      __atomic_add_fetch(&mem_base_addr, 4, __ATOMIC_RELAXED);
+      request_publish();
       break;
     case 'k':
-      mem_base_addr-= 4;
+      __atomic_sub_fetch(&mem_base_addr, 4, __ATOMIC_RELAXED);
+      request_publish();
       break;
     case 'b':
-      nextBreakpoint = 1;
+      request_mode(MODE_TO_BREAKPOINT);
+      break;
+    case 'N':
+      request_mode(MODE_STEP_BACK);
+      break;
+    case 'B':
+      request_mode(MODE_BACK_TO_BREAKPOINT);
       break;
     case 'r':
-      justRun = 1;
+      request_mode(MODE_RUN);
+      break;
+    case 's':
+      request_mode(MODE_PAUSED);
+      break;
+    case 'f':
+      __atomic_xor_fetch(&full_speed, 1, __ATOMIC_RELAXED);
+      request_publish();
       break;
     case 'p':
       exit(EXIT_SUCCESS);
       break;
-    case 'm':
-      scanf("%d",&mem_base_addr);
+    case 'm': {
+      int addr;
+      if (scanf("%d", &addr) == 1) {
+        __atomic_store_n(&mem_base_addr, addr, __ATOMIC_RELAXED);
+      }
+      request_publish();
       break;
+    }
     case '1':
       showDisplay = showDisplay ^ 1;
         shouldClear++;
@@ -321,23 +632,267 @@ void *threadTwo(void *args) {
         shouldClear++;
       break;
     case 'q':
-        resetCPU(cpu);
-        nextCommand = 0;
-        nextBreakpoint = 0;
-        justRun = 0;
+        // the runner resets the CPU, so it never does so in the middle of
+        // an instruction
+        request_mode(MODE_RESET);
     };
   }
 
   return NULL;
 }
 
+int parseBreakpoint(char *spec, Breakpoint *breakpoint) {
+  char *end;
+  breakpoint->line = strtol(spec, &end, 10);
+  breakpoint->reg = 0;
+  breakpoint->compare = COMPARE_NONE;
+  breakpoint->value = 0;
+  breakpoint->hits = 1;
+  breakpoint->hitCount = 0;
+  if (end == spec || breakpoint->line < 1) {
+    return 0;
+  }
+  while (*end == ':') {
+    char *part = end + 1;
+    if (strncmp(part, "hits=", 5) == 0) {
+      breakpoint->hits = strtol(part + 5, &end, 10);
+      if (end == part + 5 || breakpoint->hits < 1) {
+        return 0;
+      }
+      continue;
+    }
+    size_t length = strcspn(part, "=!<>");
+    if (length == 0 || !parseRegister(part, length, &breakpoint->reg) ||
+        breakpoint->reg > 31) {
+      return 0;
+    }
+    // the two character operators first, < would match <= as well
+    static const char *operators[] = {"==", "!=", "<=", ">=", "<", ">"};
+    static const Compare compares[] = {COMPARE_EQ, COMPARE_NE, COMPARE_LE,
+                                       COMPARE_GE, COMPARE_LT, COMPARE_GT};
+    char *op = part + length;
+    breakpoint->compare = COMPARE_NONE;
+    for (int i = 0; i < 6; i++) {
+      if (strncmp(op, operators[i], strlen(operators[i])) == 0) {
+        breakpoint->compare = compares[i];
+        op += strlen(operators[i]);
+        break;
+      }
+    }
+    if (breakpoint->compare == COMPARE_NONE) {
+      return 0;
+    }
+    breakpoint->value = strtol(op, &end, 0);
+    if (end == op) {
+      return 0;
+    }
+  }
+  return *end == '\0';
+}
+
+int parseWatchpoint(char *spec, Watchpoint *watchpoint) {
+  char *end;
+  long addr = strtol(spec, &end, 0);
+  watchpoint->bytes = 4;
+  watchpoint->mode = WATCH_WRITE;
+  if (end == spec || addr < 0 || addr > INT32_MAX) {
+    return 0;
+  }
+  watchpoint->addr = addr;
+  if (*end == ':' && isdigit((unsigned char)end[1])) {
+    watchpoint->bytes = strtol(end + 1, &end, 0);
+    if (watchpoint->bytes < 1) {
+      return 0;
+    }
+  }
+  if (*end == ':') {
+    char *mode = end + 1;
+    if (strcmp(mode, "r") == 0) {
+      watchpoint->mode = WATCH_READ;
+    } else if (strcmp(mode, "w") == 0) {
+      watchpoint->mode = WATCH_WRITE;
+    } else if (strcmp(mode, "rw") == 0) {
+      watchpoint->mode = WATCH_READ | WATCH_WRITE;
+    } else if (strcmp(mode, "c") == 0) {
+      watchpoint->mode = WATCH_CHANGE;
+    } else {
+      return 0;
+    }
+    end = mode + strlen(mode);
+  }
+  return *end == '\0';
+}
+
+int compare_lines(const void *a, const void *b) {
+  return ((Breakpoint *)a)->line - ((Breakpoint *)b)->line;
+}
+
+void build_breakpoints(CPU *cpu, Breakpoint *extra, int32_t extra_count) {
+  break_count = breakpoint_count + extra_count;
+  breaks = malloc((break_count + 1) * sizeof(Breakpoint));
+  break_lines = cpu->pgrm->length;
+  break_bits = calloc(break_lines / 8 + 1, 1);
+  if (breaks == NULL || break_bits == NULL) {
+    perror("Memory allocation error");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < breakpoint_count; i++) {
+    breaks[i] = (Breakpoint){breakpoints[i], 0, COMPARE_NONE, 0, 1, 0};
+  }
+  memcpy(breaks + breakpoint_count, extra, extra_count * sizeof(Breakpoint));
+  qsort(breaks, break_count, sizeof(Breakpoint), compare_lines);
+  for (int i = 0; i < break_count; i++) {
+    int32_t index = breaks[i].line - 1; // line numbers are 1-indexed
+    if (index >= 0 && index < break_lines) {
+      break_bits[index >> 3] |= 1 << (index & 7);
+    }
+  }
+}
+
+int condition_holds(Breakpoint *breakpoint, Register *reg) {
+  int32_t value = rR(reg, breakpoint->reg);
+  switch (breakpoint->compare) {
+  case COMPARE_EQ: return value == breakpoint->value;
+  case COMPARE_NE: return value != breakpoint->value;
+  case COMPARE_LT: return value < breakpoint->value;
+  case COMPARE_GT: return value > breakpoint->value;
+  case COMPARE_LE: return value <= breakpoint->value;
+  case COMPARE_GE: return value >= breakpoint->value;
+  default: return 1;
+  }
+}
+
+// hit counts only count on the way forward, stepping back passes 0
+int breakpoint_at(CPU *cpu, int count_hits) {
+  int32_t index = cpu->pgrm->pc / 4;
+  if (index < 0 || index >= break_lines ||
+      !(break_bits[index >> 3] & (1 << (index & 7)))) {
+    return 0;
+  }
+  // first breakpoint of the line
+  int32_t low = 0;
+  int32_t high = break_count;
+  while (low < high) {
+    int32_t mid = (low + high) / 2;
+    if (breaks[mid].line < index + 1) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  int stop = 0;
+  for (; low < break_count && breaks[low].line == index + 1; low++) {
+    if (!condition_holds(&breaks[low], cpu->reg)) {
+      continue;
+    }
+    if (count_hits) {
+      breaks[low].hitCount++;
+    }
+    stop |= !count_hits || breaks[low].hitCount >= breaks[low].hits;
+  }
+  return stop;
+}
+
+void reset_hits() {
+  for (int i = 0; i < break_count; i++) {
+    breaks[i].hitCount = 0;
+  }
+  watch_message[0] = '\0';
+}
+
+// copies RAM, returns 0 for addresses outside of it or on a device
+int read_ram(Memory *mem, int32_t addr, int32_t bytes, uint8_t *out) {
+  int32_t min, max;
+  deviceWindow(mem, &min, &max);
+  if (addr < 0 || addr > mem->size - bytes ||
+      (addr <= max && addr + bytes - 1 >= min)) {
+    return 0;
+  }
+  memcpy(out, (uint8_t *)mem->data + addr, bytes);
+  return 1;
+}
+
+// runs one instruction, returns 1 if it hit a watchpoint
+int step_forward(CPU *cpu) {
+  int32_t pc = cpu->pgrm->pc;
+  int32_t addr = 0;
+  int32_t bytes = 0;
+  int access = watch_count > 0
+                   ? memoryAccess(cpu->pgrm, cpu->reg, &addr, &bytes)
+                   : 0;
+  uint8_t before[4];
+  uint8_t after[4];
+  int in_ram = (access & ACCESS_STORE) &&
+               read_ram(cpu->shared->mem, addr, bytes, before);
+
+  if (history != NULL) {
+    stepForward(history, cpu);
+  } else {
+    runCommand(cpu);
+  }
+  if (access == 0) {
+    return 0;
+  }
+  if (in_ram) {
+    read_ram(cpu->shared->mem, addr, bytes, after);
+  }
+
+  for (int i = 0; i < watch_count; i++) {
+    Watchpoint *watch = &watches[i];
+    int32_t first = addr > watch->addr ? addr : watch->addr;
+    int32_t last = addr + bytes < watch->addr + watch->bytes
+                       ? addr + bytes
+                       : watch->addr + watch->bytes;
+    if (first >= last) {
+      continue;
+    }
+    const char *what = NULL;
+    // a store to a device always counts as a change
+    if ((watch->mode & WATCH_CHANGE) && (access & ACCESS_STORE) &&
+        (!in_ram || memcmp(before + first - addr, after + first - addr,
+                           last - first) != 0)) {
+      what = "changed";
+    } else if ((watch->mode & WATCH_WRITE) && (access & ACCESS_STORE)) {
+      what = "written";
+    } else if ((watch->mode & WATCH_READ) && (access & ACCESS_LOAD)) {
+      what = "read";
+    }
+    if (what != NULL) {
+      snprintf(watch_message, sizeof(watch_message),
+               "watchpoint 0x%x %s by line %d", watch->addr, what, pc / 4 + 1);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// steps back once, or with toBreakpoint until the next breakpoint behind
+// the current instruction or as far as the history reaches
+void step_back(CPU *cpu, int toBreakpoint) {
+  if (history == NULL) {
+    return;
+  }
+  while (stepBackward(history, cpu)) {
+    if (!toBreakpoint || breakpoint_at(cpu, 0)) {
+      break;
+    }
+  }
+}
+
 void *startDebugger(void *args) {
 
-  CPU *cpu = (CPU *)args;
+  CPU *cpu = ((DebuggerArgs *)args)->cpu;
   printf("Started running Debugger\n");
-
-  init_debugger();
-  print_instructions(0);
+  history = createHistory(((DebuggerArgs *)args)->historyBudget,
+                          ((DebuggerArgs *)args)->checkpointInterval);
+
+  init_debugger(cpu);
+  build_breakpoints(cpu, ((DebuggerArgs *)args)->breakpoints,
+                    ((DebuggerArgs *)args)->breakpointCount);
+  watches = ((DebuggerArgs *)args)->watchpoints;
+  watch_count = ((DebuggerArgs *)args)->watchpointCount;
+  publish_state(cpu);
+  print_instructions(&ui_state, 1);
   refresh();
   wrefresh(win);
   getch();
@@ -350,24 +905,53 @@ void *startDebugger(void *args) {
   // -------------------------------------------
 
   while (1) {
-    int i;
-    for (i = 0; i < CYCLES_PER_SLEEP; i++) {
-      // could upgrade breakpoint lookup to binary search
-
-      for (int j = 0; j < breakpoint_count; j++) {
-        if (breakpoints[j] ==
-            cpu->pgrm->pc / 4 + 1) { // line numbers are 1-indexed
-          nextBreakpoint = 0;
-        }
+    // the state after the last action, with the mode it left behind
+    publish_state(cpu);
+    RunMode current = take_mode(cpu);
+    if (current == MODE_RESET) {
+      resetCPU(cpu);
+      if (history != NULL) {
+        clearHistory(history);
       }
+      reset_hits();
+      continue;
+    }
+    if (current == MODE_STEP_BACK || current == MODE_BACK_TO_BREAKPOINT) {
+      step_back(cpu, current == MODE_BACK_TO_BREAKPOINT);
+      continue;
+    }
+    if (current == MODE_STEP) {
+      step_forward(cpu);
+      breakpoint_at(cpu, 1); // counts the hit
+      continue;
+    }
 
-      while ((nextCommand == 0) && (nextBreakpoint == 0) && (justRun == 0)) {
-        usleep(100000);
+    // runs until a key asks for something else, b also stops at
+    // breakpoints and watchpoints
+    int cycles = 0;
+    struct timespec published;
+    clock_gettime(CLOCK_MONOTONIC, &published);
+    while (__atomic_load_n(&mode, __ATOMIC_ACQUIRE) == current) {
+      int watched = step_forward(cpu);
+      int stopped = breakpoint_at(cpu, 1);
+      if ((watched || stopped) && current == MODE_TO_BREAKPOINT) {
+        stop_running(current);
+        break;
+      }
+      if (++cycles == CYCLES_PER_SLEEP) {
+        cycles = 0;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - published.tv_sec) * 1000000000L +
+                (now.tv_nsec - published.tv_nsec) >= PUBLISH_NS) {
+          publish_state(cpu);
+          published = now;
+        }
+        if (!__atomic_load_n(&full_speed, __ATOMIC_RELAXED)) {
+          throttle();
+        }
       }
-      runCommand(cpu);
-      nextCommand = 0;
     }
-    usleep(SLEEPTIME);
   }
 
   // ------------------------------------------
@@ -10,9 +10,52 @@
 #define DEBUGGER_H_
 
 #include<stdint.h>
+#include<stddef.h>
+#include "cpu.h"
 
 // DEBUGGER INTERFACE
 
+typedef enum Compare {
+	COMPARE_NONE, COMPARE_EQ, COMPARE_NE, COMPARE_LT, COMPARE_GT, COMPARE_LE, COMPARE_GE
+} Compare;
+
+typedef struct Breakpoint {
+	int32_t line; // 1-indexed like #breakpoint
+	int32_t reg; // stops only if reg compare value holds
+	Compare compare;
+	int32_t value;
+	int32_t hits; // stops from the hits-th time the condition held on
+	int32_t hitCount;
+} Breakpoint;
+
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+#define WATCH_CHANGE 4
+
+typedef struct Watchpoint {
+	int32_t addr;
+	int32_t bytes;
+	int mode;
+} Watchpoint;
+
+typedef struct DebuggerArgs {
+	CPU *cpu;
+	size_t historyBudget; // bytes for stepping backwards, see history.c
+	uint64_t checkpointInterval;
+	Breakpoint *breakpoints; // from --break, added to the #breakpoint lines
+	int32_t breakpointCount;
+	Watchpoint *watchpoints;
+	int32_t watchpointCount;
+} DebuggerArgs;
+
+// LINE[:REG OP VALUE][:hits=N], OP one of == != < > <= >=, returns 0 if
+// spec is none
+int parseBreakpoint (char *spec, Breakpoint *breakpoint);
+
+// ADDR[:BYTES][:r|w|rw|c], c stops when a store changes the value,
+// returns 0 if spec is none
+int parseWatchpoint (char *spec, Watchpoint *watchpoint);
+
 void *startDebugger (void *args);
 
 #endif
@@ -11,24 +11,33 @@
 #include<stdio.h>
 #include<stdlib.h>
 #include<stdint.h>
+#include<string.h>
 #include "display.h"
+#include "i2c.h"
+#include "capture.h"
 
 //---------------------------------------------
 
 
 //------------ DEFINE DISPLAY -----------------
 
-typedef struct Display {
-	char pixels[PAGES*8][COLS+1];
-	int pages;
-	int cols;
-	int pageIDX;
-	int colIDX;
-	int power;
-} Display;
-
+// The display keeps the bytes the program sent in the controller's own
+// layout, a byte per page and column with the top row in bit 0, so an
+// update stores that byte and marks the column as sent. Characters only
+// exist once someone renders them.
 Display *display;
 
+// counts pixel updates, lets readers skip copying an unchanged display.
+// Only written by whoever drains the I2C bus.
+uint64_t pixelVersion = 0;
+
+// With --capture a frame ends when a write wraps from the last column of
+// the last page, when the page goes back while there are unsent updates or
+// when the power changes. frameClock is the clock of the transfer running.
+int capturing = 0;
+int frameDirty = 0;
+uint64_t frameClock = 0;
+
 //---------------------------------------------
 
 void createDisplay () {
@@ -39,12 +48,8 @@ void createDisplay () {
 	display->pages = PAGES;
 	display->colIDX = 0;
 	display->pageIDX = 0;
-	for (int i = 0; i< PAGES*8; i++) {
-		for (int j = 0; j < COLS; j++) {
-			display->pixels[i][j] = '-';
-		}
-		display->pixels[i][COLS] = '\00';
-	}
+	memset(display->ram, 0, sizeof(display->ram));
+	memset(display->written, 0, sizeof(display->written));
 
 }
 
@@ -54,14 +59,33 @@ void deleteDisplay () {
 
 }
 
+static void endFrame () {
+
+	if (capturing) {
+		captureFrame(display->ram, display->power, frameClock);
+	}
+	frameDirty = 0;
+
+}
+
 void runDisplayCommand (uint8_t data) {
 
 	switch (data) {
-		case 0xAE: display->power = 0; break;
-		case 0xAF: display->power = 1; break;
+		case 0xAE:
+		case 0xAF:
+			if (display->power != (data & 1)) {
+				display->power = data & 1;
+				endFrame();
+			}
+			break;
 		case 0x00 ... 0x0F: display->colIDX = (display->colIDX & 0xF0) + (data & 0x0F); break;
 		case 0x10 ... 0x1F: display->colIDX = (display->colIDX & 0x0F) + ((data & 0x0F) << 4); break;
-		case 0xB0 ... 0xB7: display->pageIDX = data & 0x0F; break;
+		case 0xB0 ... 0xB7:
+			if (frameDirty && (data & 0x0F) < display->pageIDX) {
+				endFrame();
+			}
+			display->pageIDX = data & 0x0F;
+			break;
 		default: break;
 	};
 
@@ -69,44 +93,106 @@ void runDisplayCommand (uint8_t data) {
 
 void runUpdate (uint8_t data) {
 
-	display->pixels[display->pageIDX*8 + 0][display->colIDX] = data & 1 ? '#' : ' ';
-	display->pixels[display->pageIDX*8 + 1][display->colIDX] = data & 2 ? '#' : ' ';
-	display->pixels[display->pageIDX*8 + 2][display->colIDX] = data & 4 ? '#' : ' ';
-	display->pixels[display->pageIDX*8 + 3][display->colIDX] = data & 8 ? '#' : ' ';
-	display->pixels[display->pageIDX*8 + 4][display->colIDX] = data & 16 ? '#' : ' ';
-	display->pixels[display->pageIDX*8 + 5][display->colIDX] = data & 32 ? '#' : ' ';
-	display->pixels[display->pageIDX*8 + 6][display->colIDX] = data & 64 ? '#' : ' ';
-	display->pixels[display->pageIDX*8 + 7][display->colIDX] = data & 128 ? '#' : ' ';
+	// columns past the glass are dropped, the controller has no RAM there
+	if (display->colIDX < COLS) {
+		display->ram[display->pageIDX][display->colIDX] = data;
+		display->written[display->pageIDX][display->colIDX] = 0xFF;
+	}
 	display->colIDX = (display->colIDX + 1) % COLS;
+	__atomic_store_n(&pixelVersion, pixelVersion + 1, __ATOMIC_RELEASE);
+	frameDirty = 1;
+	if (display->colIDX == 0 && display->pageIDX == PAGES-1) {
+		endFrame();
+	}
 
 }
 
-char (*getPixels()) [COLS+1] {
+// 16 columns at once, GCC turns these into SSE2 or NEON operations
+typedef uint8_t Columns __attribute__((vector_size(16)));
 
-	return &(display->pixels[0]);
+void renderDisplay (const Display *state, char (*out)[COLS+1]) {
+
+	if (state == NULL) {
+		busAcquire();
+		renderDisplay(display, out);
+		busRelease();
+		return;
+	}
+	for (int page = 0; page < PAGES; page++) {
+		const uint8_t *ram = state->ram[page];
+		const uint8_t *written = state->written[page];
+		for (int row = 0; row < 8; row++) {
+			char *line = out[page*8 + row];
+			const uint8_t bit = 1 << row;
+			int col = 0;
+			// '#' and ' ' differ in the two low bits, a column that was
+			// never written shows '-'
+			for (; col + 16 <= COLS; col += 16) {
+				Columns data, mask, chars;
+				memcpy(&data, ram + col, 16);
+				memcpy(&mask, written + col, 16);
+				Columns set = (Columns)((data & bit) != 0) & 3;
+				chars = (mask & (' ' | set)) | (~mask & '-');
+				memcpy(line + col, &chars, 16);
+			}
+			for (; col < COLS; col++) {
+				line[col] = !written[col] ? '-' : ram[col] & bit ? '#' : ' ';
+			}
+			line[COLS] = '\0';
+		}
+	}
 
 }
 
-void sendCommand (int32_t command) {
+size_t displayStateSize () {
 
-    uint8_t fourthByte = (command >> 0) & 0xFF;
-    uint8_t thirdByte = (command >> 8) & 0xFF;
-    uint8_t secondByte = (command >> 16) & 0xFF;
-    uint8_t mask = (command >> 24) & 0xFF;
-	uint8_t identifier;
-	uint8_t data;
+	return sizeof(Display);
 
-	switch (mask) {
-		case 0x03: identifier = thirdByte; data = fourthByte; break;
-		case 0x06: identifier = secondByte; data = thirdByte; break;
-		case 0x05: identifier = secondByte; data = fourthByte; break;
-		default: break;
-	};
+}
 
-	switch (identifier) {
+void saveDisplayState (void *out) {
+
+	busAcquire();
+	memcpy(out, display, sizeof(Display));
+	busRelease();
+
+}
+
+void loadDisplayState (const void *in) {
+
+	busAcquire();
+	memcpy(display, in, sizeof(Display));
+	__atomic_store_n(&pixelVersion, pixelVersion + 1, __ATOMIC_RELEASE);
+	busRelease();
+
+}
+
+uint64_t displayVersion () {
+
+	return __atomic_load_n(&pixelVersion, __ATOMIC_ACQUIRE);
+
+}
+
+void captureFrames (int on) {
+
+	busAcquire();
+	if (!on && frameDirty) {
+		endFrame();
+	}
+	capturing = on;
+	frameDirty = 0;
+	stampBus(on);
+	busRelease();
+
+}
+
+void displayTransfer (uint8_t control, uint8_t data, uint64_t clock) {
+
+	frameClock = clock;
+	switch (control) {
 		case 0x00: runDisplayCommand(data); break;
 		case 0xC0: runUpdate(data); break;
 		default: break;
 	};
-    
+
 }
@@ -10,10 +10,13 @@
 #define DISPLAY_H_
 
 #include<stdint.h>
+#include<stddef.h>
 
 // DISPLAY INTERFACE
 
-void sendCommand (int32_t command);
+// a transfer to the display from the I2C bus, control 0x00 is a command
+// and 0xC0 pixel data
+void displayTransfer (uint8_t control, uint8_t data, uint64_t clock);
 
 void createDisplay ();
 
@@ -23,6 +26,33 @@ void deleteDisplay ();
 
 #define PAGES 8
 
-char (*getPixels()) [COLS+1];
+typedef struct Display {
+	uint8_t ram[PAGES][COLS]; // bit n of a byte is row page*8+n
+	uint8_t written[PAGES][COLS]; // 0xFF once the column of the page was sent
+	int pages;
+	int cols;
+	int pageIDX;
+	int colIDX;
+	int power;
+} Display;
+
+// expands a display, as saved by saveDisplayState or NULL for the live
+// one, to rows of '#', ' ' and '-' for columns that were never sent
+void renderDisplay (const Display *state, char (*out)[COLS+1]);
+
+// changes whenever the pixels may have changed
+uint64_t displayVersion ();
+
+// the whole display state as bytes, for snapshots. Saving, loading and
+// rendering the live display run the I2C bus queue first.
+size_t displayStateSize ();
+
+void saveDisplayState (void *out);
+
+void loadDisplayState (const void *in);
+
+// hands every frame the guest finishes to captureFrame, see capture.h.
+// Turning it off also hands over a frame that was begun.
+void captureFrames (int on);
 
 #endif
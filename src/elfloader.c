@@ -0,0 +1,321 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<elf.h>
+#include "cpu.h"
+#include "memory.h"
+#include "elfloader.h"
+
+//---------------------------------------------
+
+// An ELF file is decoded once while loading. Every word of an executable
+// segment becomes the command at index vaddr/4, so the pc stays the guest
+// address and branch offsets need no fixing. Every segment is also copied
+// into memory, code included, so constants next to the code can be loaded.
+// The program has to be linked below the size of memory and around the
+// devices, which sit at 0x100000.
+
+typedef struct Segment {
+	int32_t vaddr;
+	int32_t size; // bytes from the file, the rest up to p_memsz stays zero
+	uint8_t *data;
+} Segment;
+
+typedef struct Segments {
+	int32_t count;
+	Segment segment[];
+} Segments;
+
+int isElf (FILE *file) {
+
+	char magic[SELFMAG];
+	int found = fread(magic, 1, SELFMAG, file) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+	rewind(file);
+	return found;
+
+}
+
+static Command decode (uint32_t ins) {
+
+	int32_t rd = (ins >> 7) & 31;
+	int32_t rs1 = (ins >> 15) & 31;
+	int32_t rs2 = (ins >> 20) & 31;
+	int32_t funct3 = (ins >> 12) & 7;
+	int32_t funct7 = ins >> 25;
+	int32_t immI = (int32_t)ins >> 20;
+	int32_t immS = ((int32_t)ins >> 25 << 5) | ((ins >> 7) & 31);
+	int32_t immB = ((int32_t)ins >> 31 << 12) | (((ins >> 7) & 1) << 11) | (((ins >> 25) & 63) << 5) | (((ins >> 8) & 15) << 1);
+	int32_t immJ = ((int32_t)ins >> 31 << 20) | (ins & 0xFF000) | (((ins >> 20) & 1) << 11) | (((ins >> 21) & 0x3FF) << 1);
+	Command illegal = {ILLEGAL, 0, 0, (int32_t)ins};
+
+	static const CommandType branches[8] = {BEQ, BNE, ILLEGAL, ILLEGAL, BLT, BGE, BLTU, BGEU};
+	static const CommandType loads[8] = {LB, LH, LW, ILLEGAL, LBU, LHU, ILLEGAL, ILLEGAL};
+	static const CommandType stores[8] = {SB, SH, SW, ILLEGAL, ILLEGAL, ILLEGAL, ILLEGAL, ILLEGAL};
+	static const CommandType opImm[8] = {ADDI, SLLI, SLTI, SLTIU, XORI, SRLI, ORI, ANDI};
+	static const CommandType op[8] = {ADD, SLL, SLT, SLTU, XOR, SRL, OR, AND};
+	static const CommandType opM[8] = {MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU};
+	static const CommandType amo[32] = {
+		[0x00] = AMOADD, [0x01] = AMOSWAP, [0x02] = LR, [0x03] = SC, [0x04] = AMOXOR, [0x08] = AMOOR,
+		[0x0C] = AMOAND, [0x10] = AMOMIN, [0x14] = AMOMAX, [0x18] = AMOMINU, [0x1C] = AMOMAXU
+	};
+
+	switch (ins & 0x7F) {
+		case 0x37:
+			return (Command){LUI, rd, (int32_t)ins >> 12, 0};
+		case 0x17:
+			return (Command){AUIPC, rd, (int32_t)ins >> 12, 0};
+		case 0x6F:
+			return (Command){JAL, rd, immJ, 0};
+		case 0x67:
+			return funct3 == 0 ? (Command){JALR, rd, rs1, immI} : illegal;
+		case 0x63:
+			return branches[funct3] == ILLEGAL ? illegal : (Command){branches[funct3], rs1, rs2, immB};
+		case 0x03:
+			return loads[funct3] == ILLEGAL ? illegal : (Command){loads[funct3], rd, rs1, immI};
+		case 0x23:
+			return stores[funct3] == ILLEGAL ? illegal : (Command){stores[funct3], rs2, rs1, immS};
+		case 0x13:
+			if (funct3 == 1) {
+				return funct7 == 0 ? (Command){SLLI, rd, rs1, rs2} : illegal;
+			} else if (funct3 == 5) {
+				if (funct7 == 0 || funct7 == 0x20) {
+					return (Command){funct7 == 0 ? SRLI : SRAI, rd, rs1, rs2};
+				}
+				return illegal;
+			}
+			return (Command){opImm[funct3], rd, rs1, immI};
+		case 0x33:
+			if (funct7 == 0) {
+				return (Command){op[funct3], rd, rs1, rs2};
+			} else if (funct7 == 1) {
+				return (Command){opM[funct3], rd, rs1, rs2};
+			} else if (funct7 == 0x20 && (funct3 == 0 || funct3 == 5)) {
+				return (Command){funct3 == 0 ? SUB : SRA, rd, rs1, rs2};
+			}
+			return illegal;
+		case 0x0F:
+			// fence.i has nothing to do, the program cannot be written
+			return funct3 == 0 ? (Command){FENCE, 0, 0, 0} : (Command){ADDI, 0, 0, 0};
+		case 0x2F: {
+			// aq and rl are ignored, every atomic is sequentially consistent
+			CommandType type = amo[funct7 >> 2];
+			if (funct3 != 2 || type == EMPTY || (type == LR && rs2 != 0)) {
+				return illegal;
+			}
+			return type == LR ? (Command){LR, rd, rs1, 0} : (Command){type, rd, rs2, rs1};
+		}
+		case 0x73:
+			if (ins == 0x73) {
+				return (Command){ECALL, 0, 0, 0};
+			} else if (ins == 0x100073) {
+				return (Command){EBREAK, 0, 0, 0};
+			} else if (funct3 == 2 && rs1 == 0) {
+				// csrrs rd, csr, x0 only reads
+				return (Command){CSRR, rd, (ins >> 20) & 0xFFF, 0};
+			}
+			return illegal;
+		default:
+			return illegal;
+	}
+
+}
+
+// JALR of the assembler writes the link register before it reads rs1,
+// which programs written for it rely on. A jalr that links into its own
+// base register becomes JALRX, which reads rs1 first as RISC-V does. After
+// auipc ra, hi the pair always goes to the same address, jalr ra, lo(ra)
+// becomes a jal instead.
+static Command fuseCall (Command cmd, Command prev, int32_t pc) {
+
+	if (cmd.type != JALR || cmd.a != cmd.b || cmd.a == 0) {
+		return cmd;
+	}
+	if (prev.type == AUIPC && prev.a == cmd.a) {
+		int32_t target = ((pc - 4) + (prev.b << 12) + cmd.c) & 0xfffffffe;
+		return (Command){JAL, cmd.a, target - pc, 0};
+	}
+	return (Command){JALRX, cmd.a, cmd.b, cmd.c};
+
+}
+
+// a segment may be anywhere in RAM as long as it stays clear of the devices
+static int fitsMemory (Memory *mem, uint32_t vaddr, uint32_t size) {
+
+	int32_t min, max;
+	deviceWindow(mem, &min, &max);
+	if ((uint64_t)vaddr + size > (uint64_t)mem->size) {
+		return 0;
+	}
+	return size == 0 || max < min || vaddr + size - 1 < (uint32_t)min || vaddr > (uint32_t)max;
+
+}
+
+static uint8_t *readFile (char *name, size_t *size) {
+
+	FILE *file = fopen(name, "rb");
+	if (file == NULL) {
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	rewind(file);
+	uint8_t *data = length > 0 ? malloc(length) : NULL;
+	if (data != NULL && fread(data, 1, length, file) != (size_t)length) {
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	*size = length;
+	return data;
+
+}
+
+static int checkHeader (Elf32_Ehdr *ehdr, size_t size, char *name) {
+
+	if (size < sizeof(Elf32_Ehdr) || ehdr->e_ident[EI_CLASS] != ELFCLASS32 || ehdr->e_ident[EI_DATA] != ELFDATA2LSB) {
+		printf("ERROR: %s is not a 32 bit little-endian ELF file\n", name);
+		return 0;
+	}
+	if (ehdr->e_machine != EM_RISCV || ehdr->e_type != ET_EXEC) {
+		printf("ERROR: %s is not a RISC-V executable\n", name);
+		return 0;
+	}
+	if (ehdr->e_flags & EF_RISCV_RVC) {
+		printf("ERROR: %s uses compressed instructions, build it with -march=rv32im\n", name);
+		return 0;
+	}
+	if (ehdr->e_phentsize != sizeof(Elf32_Phdr) || (uint64_t)ehdr->e_phoff + (uint64_t)ehdr->e_phnum*sizeof(Elf32_Phdr) > size) {
+		printf("ERROR: %s has no valid program headers\n", name);
+		return 0;
+	}
+	return 1;
+
+}
+
+static int decodeSegment (Program *pgrm, Elf32_Phdr *phdr, uint8_t *data) {
+
+	if (phdr->p_vaddr % 4 != 0 || (phdr->p_vaddr + phdr->p_filesz)/4 > (uint32_t)pgrm->maxSize) {
+		printf("ERROR: code at %u / %u does not fit into a program of %d commands\n",
+			phdr->p_vaddr, phdr->p_vaddr + phdr->p_filesz, pgrm->maxSize);
+		return 0;
+	}
+	Command prev = {EMPTY, 0, 0, 0};
+	for (uint32_t offset = 0; offset + 4 <= phdr->p_filesz; offset += 4) {
+		uint32_t ins;
+		memcpy(&ins, data + offset, 4);
+		int32_t pc = phdr->p_vaddr + offset;
+		Command cmd = fuseCall(decode(ins), prev, pc);
+		addCommand(pgrm, pc/4, cmd.type, cmd.a, cmd.b, cmd.c);
+		prev = decode(ins);
+	}
+	int32_t end = (phdr->p_vaddr + phdr->p_filesz)/4;
+	pgrm->length = end > pgrm->length ? end : pgrm->length;
+	return 1;
+
+}
+
+int loadElf (CPU *cpu, char *name) {
+
+	Memory *mem = cpu->shared->mem;
+	Program *pgrm = cpu->pgrm;
+	size_t size = 0;
+	uint8_t *file = readFile(name, &size);
+	if (file == NULL) {
+		printf("ERROR: cannot open provided file\n");
+		return 0;
+	}
+	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)file;
+	if (!checkHeader(ehdr, size, name)) {
+		free(file);
+		return 0;
+	}
+
+	Segments *segments = malloc(sizeof(Segments) + sizeof(Segment)*ehdr->e_phnum);
+	if (segments == NULL) {
+		printf("ERROR: Cannot allocate program\n");
+		free(file);
+		return 0;
+	}
+	segments->count = 0;
+	pgrm->length = 0;
+	int ok = 1;
+	for (int i = 0; i < ehdr->e_phnum && ok; i++) {
+		Elf32_Phdr *phdr = (Elf32_Phdr *)(file + ehdr->e_phoff) + i;
+		if (phdr->p_type != PT_LOAD) {
+			continue;
+		}
+		if ((uint64_t)phdr->p_offset + phdr->p_filesz > size || phdr->p_filesz > phdr->p_memsz) {
+			printf("ERROR: %s has a segment outside of the file\n", name);
+			ok = 0;
+		} else if (!fitsMemory(mem, phdr->p_vaddr, phdr->p_memsz)) {
+			printf("ERROR: segment at %u / %u is outside of memory 0 / %d or covers a device\n",
+				phdr->p_vaddr, phdr->p_vaddr + phdr->p_memsz, mem->size-1);
+			ok = 0;
+		} else if ((phdr->p_flags & PF_X) && !decodeSegment(pgrm, phdr, file + phdr->p_offset)) {
+			ok = 0;
+		} else if (phdr->p_filesz > 0) {
+			Segment *seg = &segments->segment[segments->count];
+			seg->vaddr = phdr->p_vaddr;
+			seg->size = phdr->p_filesz;
+			seg->data = malloc(phdr->p_filesz);
+			if (seg->data == NULL) {
+				printf("ERROR: Cannot allocate program\n");
+				ok = 0;
+			} else {
+				memcpy(seg->data, file + phdr->p_offset, phdr->p_filesz);
+				segments->count++;
+			}
+		}
+	}
+	free(file);
+	if (ok && pgrm->length == 0) {
+		printf("ERROR: %s has no code\n", name);
+		ok = 0;
+	}
+	pgrm->segments = segments;
+	if (!ok) {
+		freeElf(pgrm);
+		pgrm->length = 0;
+		return 0;
+	}
+
+	pgrm->entry = ehdr->e_entry;
+	// the stack grows down from the top of memory
+	pgrm->stack = mem->size & ~15;
+	restoreElf(cpu);
+	return 1;
+
+}
+
+void restoreElf (CPU *cpu) {
+
+	Segments *segments = cpu->pgrm->segments;
+	for (int32_t i = 0; i < segments->count; i++) {
+		Segment *seg = &segments->segment[i];
+		writeBlock(cpu->shared->mem, seg->vaddr, seg->data, seg->size);
+	}
+	wR(cpu->reg, 2, cpu->pgrm->stack);
+
+}
+
+void freeElf (Program *pgrm) {
+
+	Segments *segments = pgrm->segments;
+	for (int32_t i = 0; i < segments->count; i++) {
+		free(segments->segment[i].data);
+	}
+	free(segments);
+	pgrm->segments = NULL;
+
+}
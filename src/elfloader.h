@@ -0,0 +1,30 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef ELFLOADER_H_
+#define ELFLOADER_H_
+
+#include<stdint.h>
+#include<stdio.h>
+#include "cpu.h"
+
+// ELF LOADER INTERFACE
+
+// checks the magic and rewinds the file
+int isElf (FILE *file);
+
+// loads a statically linked RV32IM executable, its code into the program
+// and every segment into memory. Returns 0 and prints why on errors.
+int loadElf (CPU *cpu, char *name);
+
+// writes the segments into memory again and sets sp, used after a reset
+void restoreElf (CPU *cpu);
+
+void freeElf (Program *pgrm);
+
+#endif
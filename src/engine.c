@@ -0,0 +1,296 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include "cpu.h"
+#include "engine.h"
+
+//---------------------------------------------
+
+// The threaded engine decodes the whole program once into an array of Ops,
+// each holding the address of its handler label. Handlers jump straight to
+// the next handler (computed goto), so there is no central switch, no
+// getCommand copy and no register bounds check in the hot loop: register
+// numbers are validated while decoding. Everything the decoder cannot prove
+// safe (LA, bad operands, odd branch targets, pc outside the loaded
+// program) is handed to runCommand, so both engines always agree. Stores
+// check for the halt device and stop right after the halting instruction.
+
+#define SINK 32 // writes to x0 land in this extra slot, see createRegister
+
+typedef struct Op {
+	const void *handler;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	int32_t imm;
+	struct Op *target; // taken branch / jump, NULL if it leaves the program
+} Op;
+
+static int validReg (int32_t r) {
+
+	return r >= 0 && r < 32;
+
+}
+
+static Op *branchTarget (Op *ops, int32_t length, int32_t pc) {
+
+	if (pc % 4 == 0 && pc >= 0 && pc < length*4) {
+		return &ops[pc/4];
+	}
+	return NULL;
+
+}
+
+void prepareThreaded (Program *pgrm) {
+
+	// one extra Op behind the program catches falling off its end
+	free(pgrm->decoded);
+	pgrm->decoded = malloc(sizeof(Op)*(pgrm->length+1));
+	pgrm->decodedValid = 0;
+	if (pgrm->decoded == NULL) {
+		printf("ERROR: Cannot allocate decoded program\n");
+	}
+
+}
+
+uint64_t runThreaded (CPU *cpu, int lifetime) {
+
+	static const void *handlers[] = {
+		[ADD] = &&do_add, [SUB] = &&do_sub, [AND] = &&do_and, [OR] = &&do_or,
+		[XOR] = &&do_xor, [SLT] = &&do_slt, [SLTU] = &&do_sltu, [SRA] = &&do_sra,
+		[SRL] = &&do_srl, [SLL] = &&do_sll, [MUL] = &&do_mul,
+		[SLLI] = &&do_slli, [ADDI] = &&do_addi, [ANDI] = &&do_andi, [ORI] = &&do_ori,
+		[XORI] = &&do_xori, [SLTI] = &&do_slti, [SLTIU] = &&do_sltiu,
+		[SRAI] = &&do_srai, [SRLI] = &&do_srli,
+		[BEQ] = &&do_beq, [BNE] = &&do_bne, [BLT] = &&do_blt, [BGE] = &&do_bge,
+		[BLTU] = &&do_bltu, [BGEU] = &&do_bgeu
+	};
+
+	Program *pgrm = cpu->pgrm;
+	Memory *mem = cpu->shared->mem;
+	int32_t *x = cpu->reg->data;
+	int32_t length = pgrm->length;
+	uint64_t budget = lifetime < 0 ? UINT64_MAX : (uint64_t)lifetime;
+	uint64_t start = budget;
+	uint64_t clock = cpu->retired + start; // minus budget is storeClock
+
+	Op *ops = pgrm->decoded;
+	if (ops == NULL) {
+		printf("ERROR: Program was not prepared for the threaded engine\n");
+		return 0;
+	}
+
+	// decode once, the result stays valid until the program changes
+	for (int32_t i = 0; i < length && !pgrm->decodedValid; i++) {
+		Command cmd = commandAt(pgrm, i);
+		Op *op = &ops[i];
+		int32_t pc = i*4;
+		op->handler = &&do_slow;
+		op->rd = validReg(cmd.a) && cmd.a != 0 ? cmd.a : SINK;
+		op->rs1 = validReg(cmd.b) ? cmd.b : 0;
+		op->rs2 = validReg(cmd.c) ? cmd.c : 0;
+		op->imm = cmd.c;
+		op->target = NULL;
+		switch (cmd.type) {
+			case ADD ... MUL:
+				if (validReg(cmd.a) && validReg(cmd.b) && validReg(cmd.c)) {
+					op->handler = handlers[cmd.type];
+				}
+				break;
+			case SLLI ... SRLI:
+				if (validReg(cmd.a) && validReg(cmd.b)) {
+					op->handler = handlers[cmd.type];
+				}
+				break;
+			case LUI:
+			case AUIPC:
+				if (validReg(cmd.a)) {
+					op->imm = (int32_t)((uint32_t)cmd.b << 12) + (cmd.type == AUIPC ? pc : 0);
+					op->handler = &&do_set;
+				}
+				break;
+			case LW:
+				if (validReg(cmd.a) && validReg(cmd.b)) {
+					op->handler = &&do_lw;
+				}
+				break;
+			case SW:
+				if (validReg(cmd.a) && validReg(cmd.b)) {
+					op->rd = cmd.a;
+					op->handler = &&do_sw;
+				}
+				break;
+			case BEQ ... BGEU:
+				if (validReg(cmd.a) && validReg(cmd.b)) {
+					op->rd = cmd.a;
+					op->target = branchTarget(ops, length, pc + cmd.c);
+					op->handler = handlers[cmd.type];
+				}
+				break;
+			case JAL:
+				if (validReg(cmd.a)) {
+					op->imm = cmd.b;
+					op->target = branchTarget(ops, length, pc + cmd.b);
+					op->handler = &&do_jal;
+				}
+				break;
+			case JALR:
+				if (validReg(cmd.a) && validReg(cmd.b)) {
+					op->handler = &&do_jalr;
+				}
+				break;
+			case JALRX:
+				if (validReg(cmd.a) && validReg(cmd.b)) {
+					op->handler = &&do_jalrx;
+				}
+				break;
+			case LEAVE:
+				op->handler = &&do_leave;
+				break;
+			case EMPTY:
+			case FLAG:
+			case NOP:
+				op->handler = &&do_next;
+				break;
+			default:
+				break;
+		}
+	}
+	ops[length].handler = &&do_slow;
+	pgrm->decodedValid = 1;
+
+	Op *op;
+	int32_t pc = pgrm->pc;
+
+#define PC(o) ((int32_t)((o) - ops)*4)
+#define NEXT(o) do { op = (o); if (budget-- == 0) goto done; goto *op->handler; } while (0)
+#define STEP() NEXT(op + 1)
+#define BRANCH(cond) do { if (cond) { if (op->target) NEXT(op->target); pc = PC(op) + op->imm; goto leave; } STEP(); } while (0)
+
+resume:
+	if (mem->halted) {
+		goto halt;
+	}
+	if (pc % 4 == 0 && pc >= 0 && pc < length*4) {
+		NEXT(&ops[pc/4]);
+	}
+	if (budget-- == 0) {
+		goto done_pc;
+	}
+	pgrm->pc = pc;
+	storeClock = clock - budget;
+	runCommand(cpu);
+	pc = pgrm->pc;
+	goto resume;
+
+do_slow:
+	pgrm->pc = PC(op);
+	storeClock = clock - budget;
+	runCommand(cpu);
+	pc = pgrm->pc;
+	goto resume;
+
+leave:
+	// jumped out of the decoded program, continue on the switch engine
+	if (budget-- == 0) {
+		goto done_pc;
+	}
+	pgrm->pc = pc;
+	storeClock = clock - budget;
+	runCommand(cpu);
+	pc = pgrm->pc;
+	goto resume;
+
+do_add: x[op->rd] = x[op->rs1] + x[op->rs2]; STEP();
+do_sub: x[op->rd] = x[op->rs1] - x[op->rs2]; STEP();
+do_and: x[op->rd] = x[op->rs1] & x[op->rs2]; STEP();
+do_or: x[op->rd] = x[op->rs1] | x[op->rs2]; STEP();
+do_xor: x[op->rd] = x[op->rs1] ^ x[op->rs2]; STEP();
+do_slt: x[op->rd] = x[op->rs1] < x[op->rs2] ? 1 : 0; STEP();
+do_sltu: x[op->rd] = (uint32_t)x[op->rs1] < (uint32_t)x[op->rs2] ? 1 : 0; STEP();
+do_sra: x[op->rd] = x[op->rs1] >> (x[op->rs2]&31); STEP();
+do_srl: x[op->rd] = (uint32_t)x[op->rs1] >> (x[op->rs2]&31); STEP();
+do_sll: x[op->rd] = x[op->rs1] << (x[op->rs2]&31); STEP();
+do_mul: x[op->rd] = x[op->rs1] * x[op->rs2]; STEP();
+do_slli: x[op->rd] = x[op->rs1] << op->imm; STEP();
+do_addi: x[op->rd] = x[op->rs1] + op->imm; STEP();
+do_andi: x[op->rd] = x[op->rs1] & op->imm; STEP();
+do_ori: x[op->rd] = x[op->rs1] | op->imm; STEP();
+do_xori: x[op->rd] = x[op->rs1] ^ op->imm; STEP();
+do_slti: x[op->rd] = x[op->rs1] < op->imm ? 1 : 0; STEP();
+do_sltiu: x[op->rd] = (uint32_t)x[op->rs1] < (uint32_t)op->imm ? 1 : 0; STEP();
+do_srai: x[op->rd] = x[op->rs1] >> (op->imm & 31); STEP();
+do_srli: x[op->rd] = (uint32_t)x[op->rs1] >> (op->imm & 31); STEP();
+do_set: x[op->rd] = op->imm; STEP();
+do_next: STEP();
+
+do_lw:
+	x[op->rd] = rM(mem, x[op->rs1] + op->imm);
+	STEP();
+do_sw:
+	storeClock = clock - budget;
+	wM(mem, x[op->rs1] + op->imm, x[op->rd]);
+	if (mem->halted) {
+		pc = PC(op) + 4;
+		goto halt;
+	}
+	STEP();
+do_leave:
+	// fused mv sp, fp ; lw fp, 0(sp) ; addi sp, sp, 4
+	x[2] = x[8];
+	x[8] = rM(mem, x[2]);
+	x[2] = x[2] + 4;
+	STEP();
+
+do_beq: BRANCH(x[op->rd] == x[op->rs1]);
+do_bne: BRANCH(x[op->rd] != x[op->rs1]);
+do_blt: BRANCH(x[op->rd] < x[op->rs1]);
+do_bge: BRANCH(x[op->rd] >= x[op->rs1]);
+do_bltu: BRANCH((uint32_t)x[op->rd] < (uint32_t)x[op->rs1]);
+do_bgeu: BRANCH((uint32_t)x[op->rd] >= (uint32_t)x[op->rs1]);
+
+do_jal:
+	x[op->rd] = PC(op) + 4;
+	if (op->target) {
+		NEXT(op->target);
+	}
+	pc = PC(op) + op->imm;
+	goto leave;
+do_jalr:
+	// link first: with rd == rs1 the target uses the new value, as in executeCommand
+	x[op->rd] = PC(op) + 4;
+	pc = (x[op->rs1] + op->imm) & 0xfffffffe;
+	goto resume;
+do_jalrx:
+	pc = (x[op->rs1] + op->imm) & 0xfffffffe;
+	x[op->rd] = PC(op) + 4;
+	goto resume;
+
+done:
+	pgrm->pc = PC(op);
+	return start;
+
+done_pc:
+	pgrm->pc = pc;
+	return start;
+
+halt:
+	pgrm->pc = pc;
+	return start - budget;
+
+#undef BRANCH
+#undef STEP
+#undef NEXT
+#undef PC
+
+}
@@ -0,0 +1,20 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include "cpu.h"
+
+// THREADED ENGINE INTERFACE
+
+void prepareThreaded (Program *pgrm);
+
+uint64_t runThreaded (CPU *cpu, int lifetime);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include "cpu.h"
+#include "engine.h"
+#include "blocks.h"
+#include "jit.h"
+#include "harts.h"
+
+//---------------------------------------------
+
+// Every hart is a CPU of its own: its registers, its pc and its block cache,
+// but the memory and the commands of the program are shared. The Program of
+// a hart is a copy of the boot hart's struct, so addr and the decoded
+// program are only read and never freed through it.
+//
+// Each hart runs on its own thread in slices of quantum instructions on the
+// selected engine. Deterministic runs pass a turn from hart to hart, only
+// one runs at a time and they always interleave the same way. Free running
+// harts run at the same time and only meet in the atomics. Either way a
+// hart looks at the halt device between its slices, so after one hart
+// halted the others stop within a quantum.
+
+typedef struct Harts Harts;
+
+typedef struct Hart {
+	CPU *cpu;
+	int32_t id;
+	uint64_t left; // instructions it may still run
+	uint64_t retired;
+	int done;
+	Harts *all;
+} Hart;
+
+struct Harts {
+	Hart *hart;
+	int32_t count;
+	int quantum;
+	int freeRunning;
+	pthread_mutex_t lock; // turn and done, only used by deterministic runs
+	pthread_cond_t changed;
+	int32_t turn;
+};
+
+CPU *createHart (CPU *boot, int32_t id) {
+
+	CPU *cpu = malloc(sizeof(CPU));
+	Register *reg = malloc(sizeof(Register));
+	Program *pgrm = malloc(sizeof(Program));
+	int32_t *data = malloc(sizeof(int32_t)*(boot->reg->size+1));
+	if (cpu == NULL || reg == NULL || pgrm == NULL || data == NULL) {
+		printf("ERROR: Cannot allocate hart\n");
+		exit(EXIT_FAILURE);
+	}
+	// every hart starts where the boot hart is, the program tells them
+	// apart with mhartid
+	*reg = *boot->reg;
+	reg->data = data;
+	memcpy(reg->data, boot->reg->data, sizeof(int32_t)*(boot->reg->size+1));
+	reg->hartId = id;
+	reg->reserved = 0;
+	*pgrm = *boot->pgrm;
+	*cpu = *boot;
+	cpu->reg = reg;
+	cpu->pgrm = pgrm;
+	cpu->blocks = NULL;
+	cpu->jit = NULL;
+	cpu->retired = 0;
+	return cpu;
+
+}
+
+void freeHart (CPU *cpu) {
+
+	invalidateBlocks(cpu);
+	invalidateJit(cpu);
+	free(cpu->reg->data);
+	free(cpu->reg);
+	free(cpu->pgrm);
+	free(cpu);
+
+}
+
+static int isHalted (Hart *hart) {
+
+	return __atomic_load_n(&hart->cpu->shared->mem->halted, __ATOMIC_ACQUIRE);
+
+}
+
+static void runSlice (Hart *hart) {
+
+	uint64_t slice = hart->left < (uint64_t)hart->all->quantum ? hart->left : (uint64_t)hart->all->quantum;
+	hart->retired += runEngine(hart->cpu, slice);
+	hart->left -= slice;
+
+}
+
+// hands the turn to the next hart that is not done, the caller holds the lock
+static void passTurn (Hart *hart) {
+
+	Harts *all = hart->all;
+	for (int32_t i = 1; i <= all->count; i++) {
+		Hart *next = &all->hart[(hart->id + i) % all->count];
+		if (!next->done) {
+			all->turn = next->id;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&all->changed);
+
+}
+
+static void *runHart (void *args) {
+
+	Hart *hart = args;
+	Harts *all = hart->all;
+	if (all->freeRunning) {
+		while (hart->left > 0 && !isHalted(hart)) {
+			runSlice(hart);
+		}
+		hart->done = 1;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&all->lock);
+	while (!hart->done) {
+		while (all->turn != hart->id) {
+			pthread_cond_wait(&all->changed, &all->lock);
+		}
+		pthread_mutex_unlock(&all->lock);
+		if (!isHalted(hart)) {
+			runSlice(hart);
+		}
+		pthread_mutex_lock(&all->lock);
+		hart->done = hart->left == 0 || isHalted(hart);
+		passTurn(hart);
+	}
+	pthread_mutex_unlock(&all->lock);
+	return NULL;
+
+}
+
+uint64_t runHarts (CPU *cpu, int count, int quantum, int freeRunning, int lifetime) {
+
+	// the threaded program is decoded once here, the harts only read it
+	if (cpu->engine != ENGINE_SWITCH) {
+		runThreaded(cpu, 0);
+	}
+
+	Harts all;
+	all.count = count;
+	all.quantum = quantum;
+	all.freeRunning = freeRunning;
+	all.turn = 0;
+	all.hart = malloc(sizeof(Hart)*count);
+	pthread_t *threads = malloc(sizeof(pthread_t)*count);
+	if (all.hart == NULL || threads == NULL) {
+		printf("ERROR: Cannot allocate harts\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_init(&all.lock, NULL);
+	pthread_cond_init(&all.changed, NULL);
+	printf("Running %d harts, %s, quantum %d\n", count, freeRunning ? "free running" : "deterministic", quantum);
+
+	for (int32_t i = 0; i < count; i++) {
+		Hart *hart = &all.hart[i];
+		hart->cpu = i == 0 ? cpu : createHart(cpu, i);
+		hart->id = i;
+		hart->left = lifetime < 0 ? UINT64_MAX : (uint64_t)lifetime;
+		hart->retired = 0;
+		hart->done = 0;
+		hart->all = &all;
+	}
+	for (int32_t i = 0; i < count; i++) {
+		if (pthread_create(&threads[i], NULL, runHart, &all.hart[i])) {
+			printf("ERROR: Failed to create Hart Thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	uint64_t retired = 0;
+	for (int32_t i = 0; i < count; i++) {
+		if (pthread_join(threads[i], NULL)) {
+			printf("ERROR: joining thread Hart\n");
+			exit(EXIT_FAILURE);
+		}
+		printf("Hart %d: %llu instructions, pc %d\n", i, (unsigned long long)all.hart[i].retired, all.hart[i].cpu->pgrm->pc);
+		retired += all.hart[i].retired;
+		if (i > 0) {
+			freeHart(all.hart[i].cpu);
+		}
+	}
+	pthread_mutex_destroy(&all.lock);
+	pthread_cond_destroy(&all.changed);
+	free(all.hart);
+	free(threads);
+	return retired;
+
+}
@@ -0,0 +1,30 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef HARTS_H_
+#define HARTS_H_
+
+#include<stdint.h>
+#include "cpu.h"
+
+#define MAX_HARTS 64
+
+// HARTS INTERFACE
+
+// a CPU with its own registers, pc and block cache that shares the memory
+// and the commands of boot, reg->hartId is id
+CPU *createHart (CPU *boot, int32_t id);
+
+void freeHart (CPU *cpu);
+
+// runs count harts on their own threads, all sharing the memory and the
+// program of cpu, which becomes hart 0. Every hart retires up to lifetime
+// instructions (-1 for no limit). Returns the instructions of all harts.
+uint64_t runHarts (CPU *cpu, int count, int quantum, int freeRunning, int lifetime);
+
+#endif
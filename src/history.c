@@ -0,0 +1,548 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include "display.h"
+#include "cpu.h"
+#include "memory.h"
+#include "history.h"
+
+//---------------------------------------------
+
+// The debugger steps backwards with an undo log: before an instruction runs
+// the words it is going to store to, the registers and the device state are
+// kept, afterwards the registers that changed are logged together with the
+// old words. A store to the display logs the bytes of the display state it
+// changed in a second ring, the journal. Undoing an instruction pops its
+// entry and writes the old values back, nothing is executed again.
+//
+// Both rings drop their oldest entries once they are full. To get further
+// back than the log reaches, a checkpoint of the whole machine (registers,
+// devices, display and every touched page that is not all zeros) is taken
+// every interval instructions. Stepping back past the log restores the
+// newest checkpoint before the target and runs forward from there, which
+// fills the log again, so the next steps back are cheap. Checkpoints share
+// half of the budget and the oldest ones are dropped first.
+//
+// GPIO_IN is an input and is not undone, instructions run again from a
+// checkpoint read the input the way it is now.
+
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+typedef struct DeviceState {
+	int32_t i2cRest;
+	int32_t display;
+	int32_t exitCode;
+	int32_t reservation;
+	int32_t reservedValue;
+	uint8_t gpioOut;
+	uint8_t halted;
+	uint8_t reserved;
+} DeviceState;
+
+typedef struct UndoEntry {
+	int32_t pc;
+	int8_t regs[2]; // registers the instruction changed, 0 for none
+	uint16_t displayBytes; // offset and old value pairs in the journal
+	int32_t regValues[2];
+	int32_t addrs[2]; // words the instruction stored to, -1 for none
+	int32_t words[2];
+	DeviceState devices;
+} UndoEntry;
+
+typedef struct Checkpoint {
+	uint64_t step;
+	int32_t pc;
+	int32_t *registers;
+	DeviceState devices;
+	void *display;
+	int32_t *pages;
+	int32_t pageCount;
+	uint8_t *data;
+	size_t bytes;
+} Checkpoint;
+
+struct History {
+	uint64_t step;
+	uint64_t interval;
+	UndoEntry *log;
+	uint32_t logSize;
+	uint32_t logStart; // oldest entry
+	uint32_t logCount;
+	uint8_t *journal; // 3 bytes per pair: offset low, offset high, old value
+	size_t journalSize;
+	size_t journalStart;
+	size_t journalCount;
+	Checkpoint *checkpoints; // oldest first
+	int32_t checkpointCount;
+	int32_t checkpointCapacity;
+	size_t checkpointBytes;
+	size_t checkpointBudget;
+	int32_t *registers; // before the instruction ran
+	uint8_t *displayBefore;
+	uint8_t *displayAfter;
+};
+
+History *createHistory (size_t budget, uint64_t interval) {
+
+	if (budget == 0) {
+		return NULL;
+	}
+	History *history = malloc(sizeof(History));
+	if (history == NULL) {
+		printf("ERROR: Cannot allocate history\n");
+		return NULL;
+	}
+	history->step = 0;
+	history->interval = interval > 0 ? interval : 1;
+	history->journalSize = budget/16 - budget/16 % 3 + 3;
+	history->logSize = (budget/2 - budget/16)/sizeof(UndoEntry) + 1;
+	history->log = malloc(sizeof(UndoEntry)*history->logSize);
+	history->journal = malloc(history->journalSize);
+	history->logStart = 0;
+	history->logCount = 0;
+	history->journalStart = 0;
+	history->journalCount = 0;
+	history->checkpoints = NULL;
+	history->checkpointCount = 0;
+	history->checkpointCapacity = 0;
+	history->checkpointBytes = 0;
+	history->checkpointBudget = budget/2;
+	history->registers = NULL;
+	history->displayBefore = malloc(displayStateSize());
+	history->displayAfter = malloc(displayStateSize());
+	if (history->log == NULL || history->journal == NULL || history->displayBefore == NULL || history->displayAfter == NULL) {
+		printf("ERROR: Cannot allocate history\n");
+		freeHistory(history);
+		return NULL;
+	}
+	return history;
+
+}
+
+static void freeCheckpoint (Checkpoint *checkpoint) {
+
+	free(checkpoint->registers);
+	free(checkpoint->display);
+	free(checkpoint->pages);
+	free(checkpoint->data);
+
+}
+
+// drops the checkpoints from index on
+static void dropCheckpoints (History *history, int32_t index) {
+
+	while (history->checkpointCount > index) {
+		Checkpoint *checkpoint = &history->checkpoints[--history->checkpointCount];
+		history->checkpointBytes -= checkpoint->bytes;
+		freeCheckpoint(checkpoint);
+	}
+
+}
+
+static void dropOldestCheckpoint (History *history) {
+
+	history->checkpointBytes -= history->checkpoints[0].bytes;
+	freeCheckpoint(&history->checkpoints[0]);
+	history->checkpointCount--;
+	memmove(history->checkpoints, history->checkpoints + 1, sizeof(Checkpoint)*history->checkpointCount);
+
+}
+
+static void clearLog (History *history) {
+
+	history->logStart = 0;
+	history->logCount = 0;
+	history->journalStart = 0;
+	history->journalCount = 0;
+
+}
+
+void clearHistory (History *history) {
+
+	dropCheckpoints(history, 0);
+	clearLog(history);
+	history->step = 0;
+
+}
+
+void freeHistory (History *history) {
+
+	dropCheckpoints(history, 0);
+	free(history->checkpoints);
+	free(history->log);
+	free(history->journal);
+	free(history->registers);
+	free(history->displayBefore);
+	free(history->displayAfter);
+	free(history);
+
+}
+
+uint64_t historyStep (History *history) {
+
+	return history->step;
+
+}
+
+uint64_t historyReach (History *history) {
+
+	uint64_t reach = history->logCount;
+	if (history->checkpointCount > 0 && history->step - history->checkpoints[0].step > reach) {
+		reach = history->step - history->checkpoints[0].step;
+	}
+	return reach;
+
+}
+
+static void saveDevices (CPU *cpu, DeviceState *devices) {
+
+	Memory *mem = cpu->shared->mem;
+	devices->i2cRest = __atomic_load_n(&mem->I2C_REST, __ATOMIC_ACQUIRE);
+	devices->display = __atomic_load_n(&mem->DISPLAY, __ATOMIC_ACQUIRE);
+	devices->gpioOut = __atomic_load_n(&mem->GPIO_OUT, __ATOMIC_ACQUIRE);
+	devices->halted = __atomic_load_n(&mem->halted, __ATOMIC_ACQUIRE);
+	devices->exitCode = mem->exitCode;
+	devices->reserved = cpu->reg->reserved;
+	devices->reservation = cpu->reg->reservation;
+	devices->reservedValue = cpu->reg->reservedValue;
+
+}
+
+static void loadDevices (CPU *cpu, DeviceState *devices) {
+
+	Memory *mem = cpu->shared->mem;
+	__atomic_store_n(&mem->I2C_REST, devices->i2cRest, __ATOMIC_RELEASE);
+	__atomic_store_n(&mem->DISPLAY, devices->display, __ATOMIC_RELEASE);
+	__atomic_store_n(&mem->GPIO_OUT, devices->gpioOut, __ATOMIC_RELEASE);
+	mem->exitCode = devices->exitCode;
+	__atomic_store_n(&mem->halted, devices->halted, __ATOMIC_RELEASE);
+	cpu->reg->reserved = devices->reserved;
+	cpu->reg->reservation = devices->reservation;
+	cpu->reg->reservedValue = devices->reservedValue;
+
+}
+
+static int inRam (Memory *mem, int32_t addr) {
+
+	return addr >= 0 && addr <= mem->size - 4;
+
+}
+
+static int32_t readWord (Memory *mem, int32_t addr) {
+
+	int32_t word;
+	memcpy(&word, (uint8_t *)mem->data + addr, 4);
+	return word;
+
+}
+
+static void writeWord (Memory *mem, int32_t addr, int32_t word) {
+
+	memcpy((uint8_t *)mem->data + addr, &word, 4);
+
+}
+
+// the RAM words the instruction at pc stores to go to entry, returns 1 if
+// it stores to a device instead
+static int findStores (CPU *cpu, UndoEntry *entry) {
+
+	Memory *mem = cpu->shared->mem;
+	entry->addrs[0] = -1;
+	entry->addrs[1] = -1;
+	int32_t addr;
+	int32_t bytes;
+	if (!(memoryAccess(cpu->pgrm, cpu->reg, &addr, &bytes) & ACCESS_STORE)) {
+		return 0;
+	}
+
+	int32_t min, max;
+	deviceWindow(mem, &min, &max);
+	if (addr <= max && addr + bytes - 1 >= min) {
+		return 1;
+	}
+	int32_t first = addr & ~3;
+	int32_t last = (addr + bytes - 1) & ~3;
+	if (inRam(mem, first)) {
+		entry->addrs[0] = first;
+		entry->words[0] = readWord(mem, first);
+	}
+	if (last != first && inRam(mem, last)) {
+		entry->addrs[1] = last;
+		entry->words[1] = readWord(mem, last);
+	}
+	return 0;
+
+}
+
+static void dropOldestEntry (History *history) {
+
+	UndoEntry *entry = &history->log[history->logStart];
+	history->journalStart = (history->journalStart + 3*entry->displayBytes) % history->journalSize;
+	history->journalCount -= 3*entry->displayBytes;
+	history->logStart = (history->logStart + 1) % history->logSize;
+	history->logCount--;
+
+}
+
+static void pushJournal (History *history, uint8_t byte) {
+
+	history->journal[(history->journalStart + history->journalCount) % history->journalSize] = byte;
+	history->journalCount++;
+
+}
+
+static uint8_t popJournal (History *history) {
+
+	history->journalCount--;
+	return history->journal[(history->journalStart + history->journalCount) % history->journalSize];
+
+}
+
+// logs every byte of the display state that changed, returns 0 if they do
+// not fit into the journal
+static int logDisplay (History *history, UndoEntry *entry) {
+
+	size_t size = displayStateSize();
+	saveDisplayState(history->displayAfter);
+	size_t changed = 0;
+	for (size_t i = 0; i < size; i++) {
+		changed += history->displayBefore[i] != history->displayAfter[i];
+	}
+	if (3*changed > history->journalSize || changed > UINT16_MAX) {
+		return 0;
+	}
+	while (history->logCount > 0 && history->journalCount + 3*changed > history->journalSize) {
+		dropOldestEntry(history);
+	}
+	for (size_t i = 0; i < size; i++) {
+		if (history->displayBefore[i] != history->displayAfter[i]) {
+			pushJournal(history, i & 0xFF);
+			pushJournal(history, i >> 8);
+			pushJournal(history, history->displayBefore[i]);
+		}
+	}
+	entry->displayBytes = changed;
+	return 1;
+
+}
+
+static int zeroPage (Memory *mem, int32_t page) {
+
+	const uint64_t *words = (uint64_t *)((uint8_t *)mem->data + ((size_t)page << PAGE_SHIFT));
+	for (int32_t i = 0; i < PAGE_SIZE/8; i++) {
+		if (words[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+
+}
+
+static void takeCheckpoint (History *history, CPU *cpu) {
+
+	Memory *mem = cpu->shared->mem;
+	Checkpoint checkpoint;
+	memset(&checkpoint, 0, sizeof(Checkpoint));
+	checkpoint.step = history->step;
+	checkpoint.pc = cpu->pgrm->pc;
+	saveDevices(cpu, &checkpoint.devices);
+
+	// pages that were touched but hold only zeros are left out, restoring
+	// clears them anyway
+	int32_t count = 0;
+	for (int32_t page = 0; page < mem->pages; page++) {
+		count += mem->touched[page];
+	}
+	checkpoint.registers = malloc(sizeof(int32_t)*(cpu->reg->size+1));
+	checkpoint.display = malloc(displayStateSize());
+	checkpoint.pages = malloc(sizeof(int32_t)*(count+1));
+	if (checkpoint.registers == NULL || checkpoint.display == NULL || checkpoint.pages == NULL) {
+		freeCheckpoint(&checkpoint);
+		return;
+	}
+	for (int32_t page = 0; page < mem->pages; page++) {
+		if (mem->touched[page] && !zeroPage(mem, page)) {
+			checkpoint.pages[checkpoint.pageCount++] = page;
+		}
+	}
+	int32_t *pages = realloc(checkpoint.pages, sizeof(int32_t)*(checkpoint.pageCount+1));
+	if (pages != NULL) {
+		checkpoint.pages = pages;
+	}
+	checkpoint.data = malloc((size_t)checkpoint.pageCount*PAGE_SIZE + 1);
+	if (checkpoint.data == NULL) {
+		freeCheckpoint(&checkpoint);
+		return;
+	}
+	memcpy(checkpoint.registers, cpu->reg->data, sizeof(int32_t)*(cpu->reg->size+1));
+	saveDisplayState(checkpoint.display);
+	for (int32_t i = 0; i < checkpoint.pageCount; i++) {
+		memcpy(checkpoint.data + (size_t)i*PAGE_SIZE,
+			(uint8_t *)mem->data + ((size_t)checkpoint.pages[i] << PAGE_SHIFT), PAGE_SIZE);
+	}
+	checkpoint.bytes = (size_t)checkpoint.pageCount*PAGE_SIZE + sizeof(int32_t)*(checkpoint.pageCount+1)
+		+ displayStateSize() + sizeof(int32_t)*(cpu->reg->size+1);
+	if (checkpoint.bytes > history->checkpointBudget) {
+		freeCheckpoint(&checkpoint);
+		return;
+	}
+	while (history->checkpointBytes + checkpoint.bytes > history->checkpointBudget) {
+		dropOldestCheckpoint(history);
+	}
+	if (history->checkpointCount == history->checkpointCapacity) {
+		int32_t capacity = history->checkpointCapacity == 0 ? 16 : history->checkpointCapacity*2;
+		Checkpoint *checkpoints = realloc(history->checkpoints, sizeof(Checkpoint)*capacity);
+		if (checkpoints == NULL) {
+			freeCheckpoint(&checkpoint);
+			return;
+		}
+		history->checkpoints = checkpoints;
+		history->checkpointCapacity = capacity;
+	}
+	history->checkpoints[history->checkpointCount++] = checkpoint;
+	history->checkpointBytes += checkpoint.bytes;
+
+}
+
+static void restoreCheckpoint (History *history, CPU *cpu, Checkpoint *checkpoint) {
+
+	Memory *mem = cpu->shared->mem;
+	resetMemory(mem);
+	for (int32_t i = 0; i < checkpoint->pageCount; i++) {
+		memcpy((uint8_t *)mem->data + ((size_t)checkpoint->pages[i] << PAGE_SHIFT),
+			checkpoint->data + (size_t)i*PAGE_SIZE, PAGE_SIZE);
+		mem->touched[checkpoint->pages[i]] = 1;
+	}
+	memcpy(cpu->reg->data, checkpoint->registers, sizeof(int32_t)*(cpu->reg->size+1));
+	loadDevices(cpu, &checkpoint->devices);
+	loadDisplayState(checkpoint->display);
+	cpu->pgrm->pc = checkpoint->pc;
+	history->step = checkpoint->step;
+
+}
+
+void stepForward (History *history, CPU *cpu) {
+
+	Register *reg = cpu->reg;
+	if (history->step % history->interval == 0
+		&& (history->checkpointCount == 0 || history->checkpoints[history->checkpointCount-1].step < history->step)) {
+		takeCheckpoint(history, cpu);
+	}
+	if (history->registers == NULL) {
+		history->registers = malloc(sizeof(int32_t)*(reg->size+1));
+		if (history->registers == NULL) {
+			printf("ERROR: Cannot allocate history\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	UndoEntry entry;
+	entry.pc = cpu->pgrm->pc;
+	entry.regs[0] = 0;
+	entry.regs[1] = 0;
+	entry.displayBytes = 0;
+	saveDevices(cpu, &entry.devices);
+	memcpy(history->registers, reg->data, sizeof(int32_t)*reg->size);
+	int toDevice = findStores(cpu, &entry);
+	if (toDevice) {
+		saveDisplayState(history->displayBefore);
+	}
+
+	runCommand(cpu);
+	history->step++;
+
+	// no instruction writes more than two registers (leave writes sp and fp)
+	int changed = 0;
+	for (int32_t i = 1; i < reg->size && changed < 2; i++) {
+		if (reg->data[i] != history->registers[i]) {
+			entry.regs[changed] = i;
+			entry.regValues[changed++] = history->registers[i];
+		}
+	}
+	if (history->logCount == history->logSize) {
+		dropOldestEntry(history);
+	}
+	if (toDevice && !logDisplay(history, &entry)) {
+		// cannot be undone, going back has to start from a checkpoint
+		clearLog(history);
+		return;
+	}
+	history->log[(history->logStart + history->logCount) % history->logSize] = entry;
+	history->logCount++;
+
+}
+
+static void undoEntry (History *history, CPU *cpu) {
+
+	Memory *mem = cpu->shared->mem;
+	history->logCount--;
+	UndoEntry *entry = &history->log[(history->logStart + history->logCount) % history->logSize];
+	for (int i = 1; i >= 0; i--) {
+		if (entry->addrs[i] != -1) {
+			writeWord(mem, entry->addrs[i], entry->words[i]);
+		}
+	}
+	for (int i = 1; i >= 0; i--) {
+		if (entry->regs[i] != 0) {
+			cpu->reg->data[entry->regs[i]] = entry->regValues[i];
+		}
+	}
+	if (entry->displayBytes > 0) {
+		saveDisplayState(history->displayAfter);
+		for (int32_t i = 0; i < entry->displayBytes; i++) {
+			uint8_t old = popJournal(history);
+			uint8_t high = popJournal(history);
+			uint8_t low = popJournal(history);
+			history->displayAfter[low | high << 8] = old;
+		}
+		loadDisplayState(history->displayAfter);
+	}
+	loadDevices(cpu, &entry->devices);
+	cpu->pgrm->pc = entry->pc;
+	history->step--;
+
+}
+
+int stepBackward (History *history, CPU *cpu) {
+
+	if (history->step == 0) {
+		return 0;
+	}
+	if (history->logCount > 0) {
+		undoEntry(history, cpu);
+	} else {
+		uint64_t target = history->step - 1;
+		int32_t i = history->checkpointCount - 1;
+		while (i >= 0 && history->checkpoints[i].step > target) {
+			i--;
+		}
+		if (i < 0) {
+			return 0;
+		}
+		restoreCheckpoint(history, cpu, &history->checkpoints[i]);
+		clearLog(history);
+		dropCheckpoints(history, i + 1);
+		while (history->step < target) {
+			stepForward(history, cpu);
+		}
+	}
+	// checkpoints ahead of the current step are taken again on the way forward
+	int32_t keep = history->checkpointCount;
+	while (keep > 0 && history->checkpoints[keep-1].step > history->step) {
+		keep--;
+	}
+	dropCheckpoints(history, keep);
+	return 1;
+
+}
@@ -0,0 +1,41 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include<stdint.h>
+#include<stddef.h>
+#include "cpu.h"
+
+// HISTORY INTERFACE
+
+typedef struct History History;
+
+// keeps at most budget bytes of undo log and checkpoints, a checkpoint is
+// taken every interval instructions. Returns NULL if budget is 0.
+History *createHistory (size_t budget, uint64_t interval);
+
+void freeHistory (History *history);
+
+// forgets everything, used after a reset of the CPU
+void clearHistory (History *history);
+
+// runs one instruction through runCommand and logs how to undo it
+void stepForward (History *history, CPU *cpu);
+
+// undoes the last instruction, returns 0 if it is not in the history
+int stepBackward (History *history, CPU *cpu);
+
+// instructions run since the last reset
+uint64_t historyStep (History *history);
+
+// how far back stepBackward reaches, in instructions
+uint64_t historyReach (History *history);
+
+#endif
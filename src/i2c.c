@@ -0,0 +1,281 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<pthread.h>
+#include<unistd.h>
+#include<time.h>
+#include "display.h"
+#include "cpu.h"
+#include "i2c.h"
+
+//---------------------------------------------
+
+// Stores of the guest to a device on the bus land in a ring with one
+// producer and one consumer: the CPU thread only copies the word into the
+// ring and moves head, the device thread decodes the transfers and runs
+// the devices. Several harts serialize their stores with the device lock,
+// so there is still one producer at a time.
+//
+// Whoever consumes holds drain, normally the device thread. Readers of
+// device state take it as well and run the rest of the queue themselves,
+// so they see every store the guest made before and never wait for the
+// device thread to be scheduled. A full ring is drained the same way by
+// the writer, which is the only time the CPU thread runs a device.
+//
+// The device thread sleeps on ready while the ring is empty, a writer only
+// takes the lock to wake it if it said it sleeps. Once woken it lets
+// BUS_BATCH_US pass, so a burst of stores costs one wakeup. If a wakeup
+// gets lost between the two, the thread looks again after BUS_IDLE_MS;
+// nobody who reads a device waits for it anyway.
+//
+// With a single CPU a device thread could only run instead of the guest,
+// there is none then. The ring still collects the stores and is run in one
+// go when it is full or someone reads a device, which costs less than
+// running every store on its own.
+//
+// The clock of a store only goes into clocks while the bus is stamped,
+// the ring stays at 8 bytes a transfer for everyone else.
+
+#define BUS_MASK (BUS_SIZE - 1)
+#define BUS_BATCH_US 200
+#define BUS_IDLE_MS 10
+
+typedef struct Transfer {
+	int32_t addr;
+	int32_t word;
+} Transfer;
+
+typedef struct BusDevice {
+	int32_t addr;
+	BusWrite write;
+} BusDevice;
+
+typedef struct Bus {
+	Transfer ring[BUS_SIZE];
+	uint64_t clocks[BUS_SIZE]; // beside ring, see stampBus
+	int stamped;
+	uint32_t head; // written by the producer
+	uint32_t tail; // written under drain
+	pthread_mutex_t drain;
+	pthread_mutex_t lock; // sleeping, stop and ready
+	pthread_cond_t ready;
+	int sleeping;
+	int stop;
+	int threaded; // 0 on a single CPU, then the ring is drained by readers
+	pthread_t thread;
+} Bus;
+
+Bus *bus = NULL;
+
+BusDevice busDevices[MAX_BUS_DEVICES] = {{DISPLAY_ADDR, displayTransfer}};
+int32_t busDeviceCount = 1;
+
+void attachBusDevice (int32_t addr, BusWrite write) {
+
+	if (busDeviceCount == MAX_BUS_DEVICES) {
+		printf("ERROR: Too many I2C devices, %d at most\n", MAX_BUS_DEVICES);
+		exit(EXIT_FAILURE);
+	}
+	busDevices[busDeviceCount].addr = addr;
+	busDevices[busDeviceCount].write = write;
+	busDeviceCount++;
+
+}
+
+static BusDevice *findBusDevice (int32_t addr) {
+
+	for (int32_t i = 0; i < busDeviceCount; i++) {
+		if (busDevices[i].addr == addr) {
+			return &busDevices[i];
+		}
+	}
+	return NULL;
+
+}
+
+int busDevice (int32_t addr) {
+
+	return findBusDevice(addr) != NULL;
+
+}
+
+// the first byte of a word tells which of the others are the control and
+// the data byte, other words are not a transfer
+static void runTransfer (Transfer *transfer, uint64_t clock) {
+
+	uint8_t fourthByte = (transfer->word >> 0) & 0xFF;
+	uint8_t thirdByte = (transfer->word >> 8) & 0xFF;
+	uint8_t secondByte = (transfer->word >> 16) & 0xFF;
+	uint8_t mask = (transfer->word >> 24) & 0xFF;
+	uint8_t control;
+	uint8_t data;
+
+	switch (mask) {
+		case 0x03: control = thirdByte; data = fourthByte; break;
+		case 0x06: control = secondByte; data = thirdByte; break;
+		case 0x05: control = secondByte; data = fourthByte; break;
+		default: return;
+	};
+
+	BusDevice *device = findBusDevice(transfer->addr);
+	if (device != NULL) {
+		device->write(control, data, clock);
+	}
+
+}
+
+// only called with drain held
+static void drainBus () {
+
+	uint32_t tail = bus->tail;
+	uint32_t head = __atomic_load_n(&bus->head, __ATOMIC_ACQUIRE);
+	for (; tail != head; tail++) {
+		runTransfer(&bus->ring[tail & BUS_MASK], bus->stamped ? bus->clocks[tail & BUS_MASK] : 0);
+	}
+	__atomic_store_n(&bus->tail, tail, __ATOMIC_RELEASE);
+
+}
+
+static void *runBus (void *args) {
+
+	pthread_mutex_lock(&bus->lock);
+	while (1) {
+		// a writer clears sleeping when it wakes us, so it is set again
+		// before every look at the ring
+		while (1) {
+			__atomic_store_n(&bus->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (bus->stop || __atomic_load_n(&bus->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&bus->tail, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += BUS_IDLE_MS * 1000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&bus->ready, &bus->lock, &until);
+		}
+		__atomic_store_n(&bus->sleeping, 0, __ATOMIC_RELAXED);
+		if (bus->stop) {
+			break;
+		}
+		pthread_mutex_unlock(&bus->lock);
+		usleep(BUS_BATCH_US);
+		pthread_mutex_lock(&bus->drain);
+		drainBus();
+		pthread_mutex_unlock(&bus->drain);
+		pthread_mutex_lock(&bus->lock);
+	}
+	pthread_mutex_unlock(&bus->lock);
+	return NULL;
+
+}
+
+void createBus () {
+
+	bus = malloc(sizeof(Bus));
+	if (bus == NULL) {
+		printf("ERROR: Cannot allocate I2C bus\n");
+		exit(EXIT_FAILURE);
+	}
+	bus->head = 0;
+	bus->tail = 0;
+	bus->sleeping = 0;
+	bus->stop = 0;
+	bus->stamped = 0;
+	pthread_mutex_init(&bus->drain, NULL);
+	pthread_mutex_init(&bus->lock, NULL);
+	pthread_cond_init(&bus->ready, NULL);
+	bus->threaded = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+	if (bus->threaded && pthread_create(&bus->thread, NULL, runBus, NULL)) {
+		printf("ERROR: Failed to create I2C Thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+}
+
+void deleteBus () {
+
+	if (bus->threaded) {
+		pthread_mutex_lock(&bus->lock);
+		bus->stop = 1;
+		pthread_cond_signal(&bus->ready);
+		pthread_mutex_unlock(&bus->lock);
+		pthread_join(bus->thread, NULL);
+	}
+	busSync();
+	pthread_mutex_destroy(&bus->drain);
+	pthread_mutex_destroy(&bus->lock);
+	pthread_cond_destroy(&bus->ready);
+	free(bus);
+	bus = NULL;
+
+}
+
+void busWrite (int32_t addr, int32_t word, uint64_t clock) {
+
+	Transfer transfer = {addr, word};
+	if (bus == NULL) {
+		runTransfer(&transfer, clock);
+		return;
+	}
+	uint32_t head = bus->head;
+	if (head - __atomic_load_n(&bus->tail, __ATOMIC_ACQUIRE) == BUS_SIZE) {
+		busSync();
+	}
+	bus->ring[head & BUS_MASK] = transfer;
+	if (bus->stamped) {
+		bus->clocks[head & BUS_MASK] = clock;
+	}
+	__atomic_store_n(&bus->head, head + 1, __ATOMIC_RELEASE);
+	// only the first writer after the device thread fell asleep wakes it
+	if (__atomic_load_n(&bus->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&bus->sleeping, 0, __ATOMIC_ACQ_REL)) {
+		pthread_mutex_lock(&bus->lock);
+		pthread_cond_signal(&bus->ready);
+		pthread_mutex_unlock(&bus->lock);
+	}
+
+}
+
+void busAcquire () {
+
+	if (bus != NULL) {
+		pthread_mutex_lock(&bus->drain);
+		drainBus();
+	}
+
+}
+
+void busRelease () {
+
+	if (bus != NULL) {
+		pthread_mutex_unlock(&bus->drain);
+	}
+
+}
+
+void busSync () {
+
+	busAcquire();
+	busRelease();
+
+}
+
+void stampBus (int on) {
+
+	if (bus != NULL) {
+		bus->stamped = on;
+	}
+
+}
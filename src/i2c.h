@@ -0,0 +1,58 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef I2C_H_
+#define I2C_H_
+
+#include<stdint.h>
+
+#define I2C_ADDR_MIN 0x100004
+#define I2C_ADDR_MAX 0x100084
+#define DISPLAY_ADDR 0x100040
+
+#define BUS_SIZE (1 << 12) // queued writes, a power of two
+#define MAX_BUS_DEVICES 16
+
+// I2C BUS INTERFACE
+
+// gets the control and the data byte of one transfer and the clock of the
+// store that made it, 0 unless the bus is stamped
+typedef void (*BusWrite) (uint8_t control, uint8_t data, uint64_t clock);
+
+// the display sits at DISPLAY_ADDR from the start
+void attachBusDevice (int32_t addr, BusWrite write);
+
+// returns 1 if a device listens on addr, only those go through the bus
+int busDevice (int32_t addr);
+
+// starts the device thread, without it busWrite runs the device at once
+void createBus ();
+
+// runs what is still queued and stops the device thread
+void deleteBus ();
+
+// queues a store of the guest to addr, clock is the instruction count of
+// the hart that made it. Only one thread may write at a time, the harts do
+// so under the device lock.
+void busWrite (int32_t addr, int32_t word, uint64_t clock);
+
+// runs everything queued so far on the calling thread, the devices stay
+// as they are until busRelease. Anything reading device state the guest
+// wrote goes through here.
+void busAcquire ();
+
+void busRelease ();
+
+// busAcquire and busRelease
+void busSync ();
+
+// passes the clock of every store on to the devices. Only changed while
+// no hart runs, transfers queued before miss their clock.
+void stampBus (int on);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include "cpu.h"
+#include "image.h"
+
+//---------------------------------------------
+
+// A binary image is mapped instead of parsed. Its commands are stored in
+// the same packed form as in memory, so they are mapped privately and used
+// in place. compiler.py writes them already lowered, so lowerProgram finds
+// nothing to write and no page is copied. Images with pseudo instructions
+// still work, only the pages holding them are copied.
+
+_Static_assert(sizeof(PackedCommand) == 8, "image commands are packed into 8 bytes");
+
+int isImage (FILE *file) {
+
+	char magic[4];
+	int found = fread(magic, 1, 4, file) == 4 && memcmp(magic, IMAGE_MAGIC, 4) == 0;
+	rewind(file);
+	return found;
+
+}
+
+int loadImage (Program *pgrm, char *name) {
+
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		printf("ERROR: cannot open provided file\n");
+		return 0;
+	}
+
+	ImageHeader header;
+	struct stat st;
+	if (read(fd, &header, sizeof(ImageHeader)) != sizeof(ImageHeader) || fstat(fd, &st) != 0) {
+		printf("ERROR: %s is not a valid program image\n", name);
+		close(fd);
+		return 0;
+	}
+	if (header.version != IMAGE_VERSION) {
+		printf("ERROR: program image version %u is not supported, expected %d\n", header.version, IMAGE_VERSION);
+		close(fd);
+		return 0;
+	}
+	if (header.commandsOffset % sysconf(_SC_PAGESIZE) != 0
+		|| (uint64_t)header.commandsOffset + (uint64_t)header.count*sizeof(PackedCommand) > (uint64_t)st.st_size
+		|| header.count == 0) {
+		printf("ERROR: %s is not a valid program image\n", name);
+		close(fd);
+		return 0;
+	}
+
+	int32_t length = header.count < (uint32_t)pgrm->maxSize ? (int32_t)header.count : pgrm->maxSize;
+	size_t size = sizeof(PackedCommand)*length;
+	PackedCommand *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, header.commandsOffset);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		printf("ERROR: Cannot map program image %s\n", name);
+		return 0;
+	}
+
+	if (pgrm->image != NULL) {
+		freeImage(pgrm);
+	} else {
+		free(pgrm->addr);
+	}
+	pgrm->addr = addr;
+	pgrm->image = addr;
+	pgrm->imageSize = size;
+	pgrm->size = length;
+	pgrm->length = length;
+	pgrm->entry = (int32_t)header.entry;
+	pgrm->decodedValid = 0;
+	return 1;
+
+}
+
+void freeImage (Program *pgrm) {
+
+	munmap(pgrm->image, pgrm->imageSize);
+	pgrm->image = NULL;
+	pgrm->imageSize = 0;
+	pgrm->addr = NULL;
+
+}
@@ -0,0 +1,39 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include<stdint.h>
+#include<stdio.h>
+#include "cpu.h"
+
+// PROGRAM IMAGE INTERFACE
+
+#define IMAGE_MAGIC "TRVB"
+#define IMAGE_VERSION 2
+
+// all fields little-endian, written by compiler.py --binary
+typedef struct ImageHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t entry; // pc of _start
+	uint32_t count; // number of commands
+	uint32_t lineTableOffset; // count uint32_t source lines, for tools
+	uint32_t commandsOffset; // page aligned, count PackedCommands
+} ImageHeader;
+
+// checks the magic and rewinds the file
+int isImage (FILE *file);
+
+// maps the commands into pgrm, returns 0 and leaves pgrm unchanged on errors
+int loadImage (Program *pgrm, char *name);
+
+void freeImage (Program *pgrm);
+
+#endif
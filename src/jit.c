@@ -0,0 +1,658 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stddef.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<sys/mman.h>
+#include "cpu.h"
+#include "engine.h"
+#include "memory.h"
+#include "jit.h"
+
+//---------------------------------------------
+
+#if defined(__x86_64__)
+
+// The JIT translates basic blocks of the Command array into x86-64 code the
+// first time they are reached. A block ends at the first branch or jump, at
+// an instruction it cannot translate or after MAX_BLOCK instructions.
+//
+// Register use inside translated code:
+//   rbx  guest register file (cpu->reg->data, x0 reads as 0, writes to x0
+//        go to the spare slot behind x31)
+//   r12  host address of guest memory
+//   r13  JitState
+//   r14  instruction budget left
+//   r15  entry table, host address of the block starting at pc is at pc*2
+//
+// Every block starts by taking its length from the budget. Exits to a known
+// pc are first compiled as "return pc to runJit" and patched into a direct
+// jump once the target block exists. LW/SW go to guest memory directly
+// unless the address is outside of it or in the window spanned by the
+// devices, those accesses call back into rM/wM. After such a store the
+// block checks whether the guest halted and if so returns the remaining
+// budget and leaves with the pc of the next instruction.
+//
+// Before every instruction translate makes sure MAX_COMMAND_BYTES and the
+// end of the block still fit into the buffer, otherwise it flushes and
+// starts the block again at the beginning of the buffer. An instruction
+// that emits more than MAX_COMMAND_BYTES stops the simulator, so a grown
+// emitter is noticed the first time it runs and not near the end of the
+// buffer.
+
+#define CODE_SIZE (16*1024*1024)
+#define MAX_BLOCK 64
+#define MAX_COMMAND_BYTES 128 // SW is the longest with 120 bytes
+#define BLOCK_FRAME_BYTES 64 // budget check, exit and bail out, 40 bytes
+#define SINK 32
+
+
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define ESI 6
+
+typedef struct Patch {
+	uint8_t *site;
+	int32_t target;
+} Patch;
+
+typedef struct JitState {
+	int32_t *x;
+	uint8_t *ram;
+	uint8_t *touched; // Memory.touched, marked by every store
+	int32_t halted; // copy of Memory.halted, updated by jitStore
+	uint64_t budget;
+	uint8_t **entry;
+	CPU *cpu;
+	uint8_t *interp; // 1 if the instruction at pc/4 has to be interpreted
+	uint8_t *length; // block length by pc/4
+	uint8_t *code;
+	uint8_t *cur;
+	uint8_t *blocks; // first byte after the trampolines
+	uint32_t (*enter)(struct JitState *st, uint8_t *block);
+	uint8_t *exit;
+	Patch *patches;
+	int32_t patchCount;
+	int32_t patchSize;
+	int32_t programLength;
+	int32_t ramLimit;
+	int32_t deviceMin; // every device lies in deviceMin..deviceMax
+	int32_t deviceMax;
+	uint64_t clock; // cpu->retired plus the budget at the start
+} JitState;
+
+static void emit8 (JitState *st, uint8_t v) {
+
+	*st->cur++ = v;
+
+}
+
+static void emit32 (JitState *st, uint32_t v) {
+
+	memcpy(st->cur, &v, 4);
+	st->cur += 4;
+
+}
+
+static void emit64 (JitState *st, uint64_t v) {
+
+	memcpy(st->cur, &v, 8);
+	st->cur += 8;
+
+}
+
+static void setRel32 (uint8_t *field, uint8_t *target) {
+
+	int32_t rel = (int32_t)(target - (field + 4));
+	memcpy(field, &rel, 4);
+
+}
+
+// jcc rel32, returns the field to patch once the target is known
+static uint8_t *emitJcc (JitState *st, uint8_t cc) {
+
+	emit8(st, 0x0F);
+	emit8(st, cc);
+	uint8_t *field = st->cur;
+	emit32(st, 0);
+	return field;
+
+}
+
+static void emitJmp (JitState *st, uint8_t *target) {
+
+	emit8(st, 0xE9);
+	uint8_t *field = st->cur;
+	emit32(st, 0);
+	setRel32(field, target);
+
+}
+
+// mov r32, [rbx + guest*4]
+static void loadReg (JitState *st, int host, int guest) {
+
+	emit8(st, 0x8B);
+	emit8(st, 0x83 | (host << 3));
+	emit32(st, guest*4);
+
+}
+
+// mov [rbx + guest*4], r32
+static void storeReg (JitState *st, int host, int guest) {
+
+	emit8(st, 0x89);
+	emit8(st, 0x83 | (host << 3));
+	emit32(st, guest*4);
+
+}
+
+// mov dword [rbx + guest*4], imm32
+static void storeImm (JitState *st, int guest, int32_t imm) {
+
+	emit8(st, 0xC7);
+	emit8(st, 0x83);
+	emit32(st, guest*4);
+	emit32(st, imm);
+
+}
+
+// mov rdi, r13 ; mov rax, fn ; call rax
+static void emitCall (JitState *st, void *fn) {
+
+	emit8(st, 0x4C); emit8(st, 0x89); emit8(st, 0xEF);
+	emit8(st, 0x48); emit8(st, 0xB8); emit64(st, (uint64_t)(uintptr_t)fn);
+	emit8(st, 0xFF); emit8(st, 0xD0);
+
+}
+
+// setcc al ; movzx eax, al
+static void emitSet (JitState *st, uint8_t cc) {
+
+	emit8(st, 0x0F); emit8(st, cc); emit8(st, 0xC0);
+	emit8(st, 0x0F); emit8(st, 0xB6); emit8(st, 0xC0);
+
+}
+
+static int32_t jitLoad (JitState *st, int32_t addr) {
+
+	return rM(st->cpu->shared->mem, addr);
+
+}
+
+// budget is what is left after the store, r14 plus the rest of its block
+static void jitStore (JitState *st, int32_t addr, int32_t data, uint64_t budget) {
+
+	storeClock = st->clock - budget;
+	wM(st->cpu->shared->mem, addr, data);
+	st->halted = st->cpu->shared->mem->halted;
+
+}
+
+// leaves esi = x[base] + imm and jumps to the returned field if the access
+// has to go through rM/wM
+static void emitAddress (JitState *st, int base, int32_t imm, uint8_t **slow1, uint8_t **slow2) {
+
+	loadReg(st, ESI, base);
+	emit8(st, 0x81); emit8(st, 0xC6); emit32(st, imm); // add esi, imm
+	emit8(st, 0x8D); emit8(st, 0x86); emit32(st, (uint32_t)-st->deviceMin); // lea eax, [rsi - deviceMin]
+	emit8(st, 0x3D); emit32(st, st->deviceMax - st->deviceMin + 1); // cmp eax, window
+	*slow1 = emitJcc(st, 0x82); // jb
+	emit8(st, 0x81); emit8(st, 0xFE); emit32(st, st->ramLimit); // cmp esi, limit
+	*slow2 = emitJcc(st, 0x87); // ja
+
+}
+
+static void emitLoad (JitState *st, int rd, int base, int32_t imm) {
+
+	uint8_t *slow1, *slow2;
+	emitAddress(st, base, imm, &slow1, &slow2);
+	emit8(st, 0x41); emit8(st, 0x8B); emit8(st, 0x04); emit8(st, 0x34); // mov eax, [r12 + rsi]
+	emit8(st, 0xEB); // jmp short done
+	uint8_t *done = st->cur;
+	emit8(st, 0);
+	setRel32(slow1, st->cur);
+	setRel32(slow2, st->cur);
+	emitCall(st, jitLoad);
+	*done = (uint8_t)(st->cur - (done + 1));
+	storeReg(st, EAX, rd);
+
+}
+
+// left is the number of instructions behind the store in its block
+static void emitStore (JitState *st, int src, int base, int32_t imm, int32_t pc, int32_t left) {
+
+	uint8_t *slow1, *slow2;
+	loadReg(st, EDX, src);
+	emitAddress(st, base, imm, &slow1, &slow2);
+	emit8(st, 0x41); emit8(st, 0x89); emit8(st, 0x14); emit8(st, 0x34); // mov [r12 + rsi], edx
+	// mark the pages of the first and last byte, as wM does
+	emit8(st, 0x8D); emit8(st, 0x4E); emit8(st, 0x03); // lea ecx, [rsi + 3]
+	emit8(st, 0xC1); emit8(st, 0xEE); emit8(st, PAGE_SHIFT); // shr esi, PAGE_SHIFT
+	emit8(st, 0xC1); emit8(st, 0xE9); emit8(st, PAGE_SHIFT); // shr ecx, PAGE_SHIFT
+	emit8(st, 0x49); emit8(st, 0x8B); emit8(st, 0x45); emit8(st, offsetof(JitState, touched)); // mov rax, [r13 + touched]
+	emit8(st, 0xC6); emit8(st, 0x04); emit8(st, 0x30); emit8(st, 0x01); // mov byte [rax + rsi], 1
+	emit8(st, 0xC6); emit8(st, 0x04); emit8(st, 0x08); emit8(st, 0x01); // mov byte [rax + rcx], 1
+	emit8(st, 0xEB);
+	uint8_t *done = st->cur;
+	emit8(st, 0);
+	setRel32(slow1, st->cur);
+	setRel32(slow2, st->cur);
+	emit8(st, 0x49); emit8(st, 0x8D); emit8(st, 0x8E); emit32(st, left); // lea rcx, [r14 + left]
+	emitCall(st, jitStore);
+	emit8(st, 0x41); emit8(st, 0x83); emit8(st, 0x7D); emit8(st, offsetof(JitState, halted)); emit8(st, 0x00); // cmp dword [r13 + halted], 0
+	emit8(st, 0x74); emit8(st, 17); // je over the exit
+	emit8(st, 0x49); emit8(st, 0x81); emit8(st, 0xC6); emit32(st, left); // add r14, left
+	emit8(st, 0xB8); emit32(st, pc + 4); // mov eax, pc + 4
+	emitJmp(st, st->exit);
+	*done = (uint8_t)(st->cur - (done + 1));
+
+}
+
+static int inProgram (JitState *st, int32_t pc) {
+
+	return pc % 4 == 0 && pc >= 0 && pc < st->programLength*4;
+
+}
+
+// leave the block towards a fixed pc, chained directly if possible
+static void emitExit (JitState *st, int32_t target) {
+
+	if (inProgram(st, target) && st->entry[target/4] != NULL) {
+		emitJmp(st, st->entry[target/4]);
+		return;
+	}
+	if (inProgram(st, target) && !st->interp[target/4]) {
+		// without room for the patch the exit just stays unchained
+		if (st->patchCount == st->patchSize) {
+			Patch *patches = realloc(st->patches, sizeof(Patch)*st->patchSize*2);
+			if (patches == NULL) {
+				printf("ERROR: Cannot allocate JIT patches\n");
+			} else {
+				st->patches = patches;
+				st->patchSize *= 2;
+			}
+		}
+		if (st->patchCount < st->patchSize) {
+			st->patches[st->patchCount++] = (Patch){st->cur, target};
+		}
+	}
+	emit8(st, 0xB8); emit32(st, target); // mov eax, target
+	emitJmp(st, st->exit);
+
+}
+
+static int validReg (int32_t r) {
+
+	return r >= 0 && r < 32;
+
+}
+
+static int translatable (Command cmd) {
+
+	switch (cmd.type) {
+		case ADD ... MUL:
+			return validReg(cmd.a) && validReg(cmd.b) && validReg(cmd.c);
+		case SLLI ... SRLI:
+		case LW:
+		case SW:
+		case BEQ ... BGEU:
+		case JALR:
+		case JALRX:
+			return validReg(cmd.a) && validReg(cmd.b);
+		case LUI:
+		case AUIPC:
+		case JAL:
+			return validReg(cmd.a);
+		case EMPTY:
+		case FLAG:
+		case NOP:
+		case LEAVE:
+			return 1;
+		default:
+			return 0;
+	}
+
+}
+
+static int endsBlock (Command cmd) {
+
+	return (cmd.type >= BEQ && cmd.type <= JALR) || cmd.type == JALRX;
+
+}
+
+static void flush (JitState *st) {
+
+	memset(st->entry, 0, sizeof(uint8_t *)*(st->programLength+1));
+	st->patchCount = 0;
+	st->cur = st->blocks;
+
+}
+
+static void emitCommand (JitState *st, Command cmd, int32_t pc, int32_t left) {
+
+	int rd = cmd.a == 0 ? SINK : cmd.a;
+
+	switch (cmd.type) {
+		case ADD ... MUL:
+			loadReg(st, EAX, cmd.b);
+			loadReg(st, ECX, cmd.c);
+			switch (cmd.type) {
+				case ADD: emit8(st, 0x01); emit8(st, 0xC8); break;
+				case SUB: emit8(st, 0x29); emit8(st, 0xC8); break;
+				case AND: emit8(st, 0x21); emit8(st, 0xC8); break;
+				case OR: emit8(st, 0x09); emit8(st, 0xC8); break;
+				case XOR: emit8(st, 0x31); emit8(st, 0xC8); break;
+				case SLT: emit8(st, 0x39); emit8(st, 0xC8); emitSet(st, 0x9C); break;
+				case SLTU: emit8(st, 0x39); emit8(st, 0xC8); emitSet(st, 0x92); break;
+				case SRA: emit8(st, 0xD3); emit8(st, 0xF8); break;
+				case SRL: emit8(st, 0xD3); emit8(st, 0xE8); break;
+				case SLL: emit8(st, 0xD3); emit8(st, 0xE0); break;
+				case MUL: emit8(st, 0x0F); emit8(st, 0xAF); emit8(st, 0xC1); break;
+				default: break;
+			}
+			storeReg(st, EAX, rd);
+			break;
+		case SLLI ... SRLI:
+			loadReg(st, EAX, cmd.b);
+			switch (cmd.type) {
+				case SLLI: emit8(st, 0xC1); emit8(st, 0xE0); emit8(st, cmd.c & 31); break;
+				case ADDI: emit8(st, 0x05); emit32(st, cmd.c); break;
+				case ANDI: emit8(st, 0x25); emit32(st, cmd.c); break;
+				case ORI: emit8(st, 0x0D); emit32(st, cmd.c); break;
+				case XORI: emit8(st, 0x35); emit32(st, cmd.c); break;
+				case SLTI: emit8(st, 0x3D); emit32(st, cmd.c); emitSet(st, 0x9C); break;
+				case SLTIU: emit8(st, 0x3D); emit32(st, cmd.c); emitSet(st, 0x92); break;
+				case SRAI: emit8(st, 0xC1); emit8(st, 0xF8); emit8(st, cmd.c & 31); break;
+				case SRLI: emit8(st, 0xC1); emit8(st, 0xE8); emit8(st, cmd.c & 31); break;
+				default: break;
+			}
+			storeReg(st, EAX, rd);
+			break;
+		case LUI:
+			storeImm(st, rd, (int32_t)((uint32_t)cmd.b << 12));
+			break;
+		case AUIPC:
+			storeImm(st, rd, (int32_t)((uint32_t)cmd.b << 12) + pc);
+			break;
+		case LW:
+			emitLoad(st, rd, cmd.b, cmd.c);
+			break;
+		case SW:
+			emitStore(st, cmd.a, cmd.b, cmd.c, pc, left);
+			break;
+		case LEAVE:
+			loadReg(st, EAX, 8);
+			storeReg(st, EAX, 2);
+			emitLoad(st, 8, 2, 0);
+			emit8(st, 0x83); emit8(st, 0x83); emit32(st, 2*4); emit8(st, 4); // add dword [rbx+8], 4
+			break;
+		case BEQ ... BGEU: {
+			static const uint8_t cc[] = {0x84, 0x85, 0x8C, 0x8D, 0x82, 0x83};
+			loadReg(st, EAX, cmd.a);
+			loadReg(st, ECX, cmd.b);
+			emit8(st, 0x39); emit8(st, 0xC8); // cmp eax, ecx
+			uint8_t *taken = emitJcc(st, cc[cmd.type - BEQ]);
+			emitExit(st, pc + 4);
+			setRel32(taken, st->cur);
+			emitExit(st, pc + cmd.c);
+			break;
+		}
+		case JAL:
+			storeImm(st, rd, pc + 4);
+			emitExit(st, pc + cmd.b);
+			break;
+		case JALR:
+		case JALRX: {
+			// JALR links first: with rd == rs1 the target uses the new value,
+			// as in executeCommand. JALRX reads rs1 first.
+			if (cmd.type == JALR) {
+				storeImm(st, rd, pc + 4);
+			}
+			loadReg(st, EAX, cmd.b);
+			emit8(st, 0x05); emit32(st, cmd.c); // add eax, imm
+			emit8(st, 0x83); emit8(st, 0xE0); emit8(st, 0xFE); // and eax, -2
+			if (cmd.type == JALRX) {
+				storeImm(st, rd, pc + 4);
+			}
+			// look the target up in the entry table before returning to runJit
+			emit8(st, 0x3D); emit32(st, st->programLength*4); // cmp eax, length*4
+			uint8_t *out1 = emitJcc(st, 0x83); // jae
+			emit8(st, 0xA8); emit8(st, 0x03); // test al, 3
+			uint8_t *out2 = emitJcc(st, 0x85); // jnz
+			emit8(st, 0x49); emit8(st, 0x8B); emit8(st, 0x14); emit8(st, 0x47); // mov rdx, [r15 + rax*2]
+			emit8(st, 0x48); emit8(st, 0x85); emit8(st, 0xD2); // test rdx, rdx
+			uint8_t *out3 = emitJcc(st, 0x84); // jz
+			emit8(st, 0xFF); emit8(st, 0xE2); // jmp rdx
+			setRel32(out1, st->cur);
+			setRel32(out2, st->cur);
+			setRel32(out3, st->cur);
+			emitJmp(st, st->exit);
+			break;
+		}
+		default:
+			break;
+	}
+
+}
+
+static uint8_t *translate (JitState *st, int32_t start) {
+
+	Program *pgrm = st->cpu->pgrm;
+
+	int32_t n = 0;
+	int32_t pc = start;
+	while (n < MAX_BLOCK && inProgram(st, pc) && translatable(commandAt(pgrm, pc/4))) {
+		n++;
+		if (endsBlock(commandAt(pgrm, pc/4))) {
+			break;
+		}
+		pc += 4;
+	}
+	if (n == 0) {
+		st->interp[start/4] = 1;
+		return NULL;
+	}
+
+	if (st->code + CODE_SIZE - st->cur < MAX_COMMAND_BYTES + BLOCK_FRAME_BYTES) {
+		flush(st);
+	}
+
+	uint8_t *block = st->cur;
+	emit8(st, 0x49); emit8(st, 0x81); emit8(st, 0xFE); emit32(st, n); // cmp r14, n
+	uint8_t *bail = emitJcc(st, 0x82); // jb
+	emit8(st, 0x49); emit8(st, 0x81); emit8(st, 0xEE); emit32(st, n); // sub r14, n
+
+	pc = start;
+	for (int32_t i = 0; i < n; i++, pc += 4) {
+		if (st->code + CODE_SIZE - st->cur < MAX_COMMAND_BYTES + BLOCK_FRAME_BYTES) {
+			// the part emitted so far is dropped with everything else
+			flush(st);
+			return translate(st, start);
+		}
+		uint8_t *before = st->cur;
+		emitCommand(st, commandAt(pgrm, pc/4), pc, n - i - 1);
+		if (st->cur - before > MAX_COMMAND_BYTES) {
+			printf("ERROR: JIT emitted %d bytes for one instruction, MAX_COMMAND_BYTES is %d\n", (int)(st->cur - before), MAX_COMMAND_BYTES);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!endsBlock(commandAt(pgrm, pc/4 - 1))) {
+		emitExit(st, pc);
+	}
+
+	setRel32(bail, st->cur);
+	emit8(st, 0xB8); emit32(st, start); // mov eax, start
+	emitJmp(st, st->exit);
+
+	st->entry[start/4] = block;
+	st->length[start/4] = n;
+
+	// chain every exit that was waiting for this block
+	for (int32_t i = 0; i < st->patchCount; i++) {
+		if (st->patches[i].target == start) {
+			uint8_t *site = st->patches[i].site;
+			site[0] = 0xE9;
+			setRel32(site + 1, block);
+			st->patches[i--] = st->patches[--st->patchCount];
+		}
+	}
+	return block;
+
+}
+
+static void emitTrampolines (JitState *st) {
+
+	// uint32_t enter(JitState *st, uint8_t *block)
+	st->enter = (uint32_t (*)(JitState *, uint8_t *))st->cur;
+	emit8(st, 0x53); emit8(st, 0x55); // push rbx ; push rbp
+	emit8(st, 0x41); emit8(st, 0x54); emit8(st, 0x41); emit8(st, 0x55); // push r12 ; push r13
+	emit8(st, 0x41); emit8(st, 0x56); emit8(st, 0x41); emit8(st, 0x57); // push r14 ; push r15
+	emit8(st, 0x48); emit8(st, 0x83); emit8(st, 0xEC); emit8(st, 0x08); // sub rsp, 8
+	emit8(st, 0x49); emit8(st, 0x89); emit8(st, 0xFD); // mov r13, rdi
+	emit8(st, 0x48); emit8(st, 0x8B); emit8(st, 0x5F); emit8(st, offsetof(JitState, x));
+	emit8(st, 0x4C); emit8(st, 0x8B); emit8(st, 0x67); emit8(st, offsetof(JitState, ram));
+	emit8(st, 0x4C); emit8(st, 0x8B); emit8(st, 0x77); emit8(st, offsetof(JitState, budget));
+	emit8(st, 0x4C); emit8(st, 0x8B); emit8(st, 0x7F); emit8(st, offsetof(JitState, entry));
+	emit8(st, 0xFF); emit8(st, 0xE6); // jmp rsi
+
+	// every block leaves through here with the next pc in eax
+	st->exit = st->cur;
+	emit8(st, 0x4D); emit8(st, 0x89); emit8(st, 0x75); emit8(st, offsetof(JitState, budget)); // mov [r13+budget], r14
+	emit8(st, 0x48); emit8(st, 0x83); emit8(st, 0xC4); emit8(st, 0x08); // add rsp, 8
+	emit8(st, 0x41); emit8(st, 0x5F); emit8(st, 0x41); emit8(st, 0x5E); // pop r15 ; pop r14
+	emit8(st, 0x41); emit8(st, 0x5D); emit8(st, 0x41); emit8(st, 0x5C); // pop r13 ; pop r12
+	emit8(st, 0x5D); emit8(st, 0x5B); // pop rbp ; pop rbx
+	emit8(st, 0xC3); // ret
+
+	st->blocks = st->cur;
+
+}
+
+// the translated code stays with the hart until the program changes, so
+// every slice of a hart only sets the budget and continues
+static JitState *createJit (CPU *cpu) {
+
+	int32_t length = cpu->pgrm->length;
+	JitState *st = malloc(sizeof(JitState));
+	if (st == NULL) {
+		return NULL;
+	}
+	memset(st, 0, sizeof(JitState));
+	st->cpu = cpu;
+	deviceWindow(cpu->shared->mem, &st->deviceMin, &st->deviceMax);
+	st->programLength = length;
+	st->patchSize = 64;
+	st->patches = malloc(sizeof(Patch)*st->patchSize);
+	st->entry = malloc(sizeof(uint8_t *)*(length+1));
+	st->interp = malloc(length+1);
+	st->length = malloc(length+1);
+	st->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (st->code == MAP_FAILED || st->patches == NULL || st->entry == NULL || st->interp == NULL || st->length == NULL) {
+		if (st->code != MAP_FAILED) {
+			munmap(st->code, CODE_SIZE);
+		}
+		free(st->patches);
+		free(st->entry);
+		free(st->interp);
+		free(st->length);
+		free(st);
+		return NULL;
+	}
+	memset(st->interp, 0, length+1);
+	st->cur = st->code;
+	emitTrampolines(st);
+	flush(st);
+	return st;
+
+}
+
+void invalidateJit (CPU *cpu) {
+
+	JitState *st = cpu->jit;
+	if (st != NULL) {
+		munmap(st->code, CODE_SIZE);
+		free(st->patches);
+		free(st->entry);
+		free(st->interp);
+		free(st->length);
+		free(st);
+		cpu->jit = NULL;
+	}
+
+}
+
+uint64_t runJit (CPU *cpu, int lifetime) {
+
+	Program *pgrm = cpu->pgrm;
+	Memory *mem = cpu->shared->mem;
+
+	if (cpu->jit == NULL) {
+		cpu->jit = createJit(cpu);
+		if (cpu->jit == NULL) {
+			printf("ERROR: Cannot set up the JIT, using the threaded engine\n");
+			cpu->engine = ENGINE_THREADED;
+			return runThreaded(cpu, lifetime);
+		}
+	}
+	JitState *st = cpu->jit;
+	// the registers are replaced by resetCPU and snapshots
+	st->x = cpu->reg->data;
+	st->ram = (uint8_t *)mem->data;
+	st->touched = mem->touched;
+	st->ramLimit = mem->size - 4;
+	st->halted = mem->halted;
+	st->budget = lifetime < 0 ? UINT64_MAX : (uint64_t)lifetime;
+
+	int32_t pc = pgrm->pc;
+	uint64_t start = st->budget;
+	st->clock = cpu->retired + start;
+	while (st->budget > 0 && !mem->halted) {
+		uint8_t *block = NULL;
+		if (inProgram(st, pc) && !st->interp[pc/4]) {
+			block = st->entry[pc/4];
+			if (block == NULL) {
+				block = translate(st, pc);
+			}
+		}
+		if (block == NULL || st->budget < st->length[pc/4]) {
+			// not translatable or not enough budget left for the whole block
+			pgrm->pc = pc;
+			storeClock = st->clock - st->budget + 1;
+			runCommand(cpu);
+			pc = pgrm->pc;
+			st->budget--;
+			continue;
+		}
+		pc = (int32_t)st->enter(st, block);
+	}
+	pgrm->pc = pc;
+	return start - st->budget;
+
+}
+
+#else
+
+uint64_t runJit (CPU *cpu, int lifetime) {
+
+	printf("ERROR: The JIT needs an x86-64 host, using the threaded engine\n");
+	cpu->engine = ENGINE_THREADED;
+	return runThreaded(cpu, lifetime);
+
+}
+
+void invalidateJit (CPU *cpu) {
+
+}
+
+#endif
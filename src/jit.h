@@ -0,0 +1,22 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef JIT_H_
+#define JIT_H_
+
+#include "cpu.h"
+
+// JIT ENGINE INTERFACE
+
+uint64_t runJit (CPU *cpu, int lifetime);
+
+// drops the translated code of the hart, needed whenever the program
+// changes and before the CPU is freed
+void invalidateJit (CPU *cpu);
+
+#endif
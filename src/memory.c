@@ -0,0 +1,516 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include<time.h>
+#include<sys/mman.h>
+#include "display.h"
+#include "cpu.h"
+#include "memory.h"
+#include "i2c.h"
+
+#define GPIO_ADDR_IN 0x100001
+#define GPIO_ADDR_OUT 0x100000
+#define HALT_ADDR 0x100088
+
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_MASK (PAGE_SIZE - 1)
+
+//---------------------------------------------
+
+// Guest memory is a page table over one mmap'd region. A RAM page maps to
+// its host address, so rM/wM need a single lookup. Pages holding a device
+// and the partly used last page map to NULL and go through the slow path,
+// which asks the registered devices first and checks the bounds of RAM for
+// the rest of the page.
+
+// Only device side effects take the lock, plain loads and stores never do.
+// The stats tell how often it was taken and how long that had to wait.
+static void lockDevices (Memory *mem) {
+
+	if (mem->deviceLock == NULL) {
+		return;
+	}
+	if (pthread_mutex_trylock(mem->deviceLock) != 0) {
+		struct timespec start, stop;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		pthread_mutex_lock(mem->deviceLock);
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		mem->lockStats->contended++;
+		mem->lockStats->waitNs += (stop.tv_sec - start.tv_sec) * 1000000000ULL + stop.tv_nsec - start.tv_nsec;
+	}
+	mem->lockStats->acquired++;
+
+}
+
+static void unlockDevices (Memory *mem) {
+
+	if (mem->deviceLock != NULL) {
+		pthread_mutex_unlock(mem->deviceLock);
+	}
+
+}
+
+//------------ DEVICES -------------
+
+static int32_t readGpioIn (Memory *mem, int32_t addr) {
+
+	return (int32_t)__atomic_load_n(&mem->GPIO_IN, __ATOMIC_ACQUIRE);
+
+}
+
+static void writeGpioIn (Memory *mem, int32_t addr, int32_t data) {
+
+	printf("ERROR: Writing to GPIO_IN not possible\n");
+
+}
+
+static int32_t readGpioOut (Memory *mem, int32_t addr) {
+
+	printf("ERROR: Reading from GPIO_OUT not possible\n");
+	return 0;
+
+}
+
+static void writeGpioOut (Memory *mem, int32_t addr, int32_t data) {
+
+	__atomic_store_n(&mem->GPIO_OUT, data & 0xFF, __ATOMIC_RELEASE);
+
+}
+
+static int32_t readDisplay (Memory *mem, int32_t addr) {
+
+	return __atomic_load_n(&mem->DISPLAY, __ATOMIC_ACQUIRE);
+
+}
+
+// the display itself runs on the I2C bus thread, the store only queues
+static void writeDisplay (Memory *mem, int32_t addr, int32_t data) {
+
+	lockDevices(mem);
+	__atomic_store_n(&mem->DISPLAY, data, __ATOMIC_RELEASE);
+	busWrite(addr, data, storeClock);
+	unlockDevices(mem);
+
+}
+
+static int32_t readI2C (Memory *mem, int32_t addr) {
+
+	return __atomic_load_n(&mem->I2C_REST, __ATOMIC_ACQUIRE);
+
+}
+
+// addresses without a device on the bus only keep the last word
+static void writeI2C (Memory *mem, int32_t addr, int32_t data) {
+
+	if (busDevice(addr)) {
+		lockDevices(mem);
+		busWrite(addr, data, storeClock);
+		unlockDevices(mem);
+		return;
+	}
+	__atomic_store_n(&mem->I2C_REST, data, __ATOMIC_RELEASE);
+
+}
+
+// a store here ends the run, the stored value becomes the exit code
+static int32_t readHalt (Memory *mem, int32_t addr) {
+
+	return 0;
+
+}
+
+static void writeHalt (Memory *mem, int32_t addr, int32_t data) {
+
+	// other harts poll halted, the exit code has to be there before it
+	mem->exitCode = data;
+	__atomic_store_n(&mem->halted, 1, __ATOMIC_RELEASE);
+
+}
+
+//----------------------------------
+
+int addDevice (Memory *mem, int32_t min, int32_t max, DeviceRead read, DeviceWrite write) {
+
+	if (mem->deviceCount == MAX_DEVICES || min < 0 || min > max || max >= mem->size) {
+		return 0;
+	}
+	Device *dev = &mem->devices[mem->deviceCount++];
+	dev->min = min;
+	dev->max = max;
+	dev->read = read;
+	dev->write = write;
+	for (int32_t page = min >> PAGE_SHIFT; page <= max >> PAGE_SHIFT; page++) {
+		mem->map[page] = NULL;
+	}
+	return 1;
+
+}
+
+void deviceWindow (Memory *mem, int32_t *min, int32_t *max) {
+
+	*min = 0;
+	*max = -1;
+	for (int32_t i = 0; i < mem->deviceCount; i++) {
+		if (i == 0 || mem->devices[i].min < *min) {
+			*min = mem->devices[i].min;
+		}
+		if (i == 0 || mem->devices[i].max > *max) {
+			*max = mem->devices[i].max;
+		}
+	}
+
+}
+
+Memory *createMemory (int32_t size) {
+
+	Memory *mem = malloc(sizeof(Memory));
+	if (mem == NULL) {
+		printf("ERROR: Cannot allocate memory\n");
+		return NULL;
+	} else {
+		// only reserve the address space, the kernel hands out zeroed
+		// pages when they are first touched
+		mem->data = mmap(NULL, sizeof(int32_t)*size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		mem->pages = ((size*4 + 3) >> PAGE_SHIFT) + 1;
+		mem->touched = malloc(mem->pages);
+		mem->map = malloc(sizeof(uint8_t *)*mem->pages);
+		if (mem->data == MAP_FAILED || mem->touched == NULL || mem->map == NULL) {
+			if (mem->data != MAP_FAILED) {
+				munmap(mem->data, sizeof(int32_t)*size);
+			}
+			free(mem->touched);
+			free(mem->map);
+			free(mem);
+			printf("ERROR: Cannot allocate memory\n");
+			return NULL;
+		} else {
+			memset(mem->touched, 0, mem->pages);
+			mem->fileMapped = 0;
+			mem->size = size*4;
+			for (int32_t page = 0; page < mem->pages; page++) {
+				int32_t end = (page + 1) << PAGE_SHIFT;
+				mem->map[page] = end <= mem->size ? (uint8_t *)mem->data + (page << PAGE_SHIFT) : NULL;
+			}
+			mem->deviceCount = 0;
+			mem->GPIO_IN = 0;
+			mem->GPIO_OUT = 0;
+			mem->DISPLAY = 0;
+			mem->I2C_REST = 0;
+			mem->deviceLock = NULL;
+			mem->lockStats = NULL;
+			mem->halted = 0;
+			mem->exitCode = 0;
+			// the display sits inside the I2C range, the first match wins
+			addDevice(mem, GPIO_ADDR_OUT, GPIO_ADDR_OUT, readGpioOut, writeGpioOut);
+			addDevice(mem, GPIO_ADDR_IN, GPIO_ADDR_IN, readGpioIn, writeGpioIn);
+			addDevice(mem, DISPLAY_ADDR, DISPLAY_ADDR, readDisplay, writeDisplay);
+			addDevice(mem, I2C_ADDR_MIN, I2C_ADDR_MAX, readI2C, writeI2C);
+			addDevice(mem, HALT_ADDR, HALT_ADDR, readHalt, writeHalt);
+		}
+	}
+	return mem;
+
+}
+
+void freeMemory (Memory *mem) {
+
+	munmap(mem->data, mem->size);
+	free(mem->touched);
+	free(mem->map);
+	free(mem);
+
+}
+
+int32_t countTouched (Memory *mem) {
+
+	int32_t count = 0;
+	for (int32_t i = 0; i < mem->pages; i++) {
+		count += mem->touched[i];
+	}
+	return count;
+
+}
+
+// Gives every touched page back to the kernel, the next access reads zeros
+// again. Runs of touched pages go out in one madvise call. mmap rounds the
+// mapping up to whole pages, so the last one can be dropped as well. Pages
+// mapped from a snapshot would read the file again after madvise, they are
+// replaced with anonymous memory instead.
+void resetMemory (Memory *mem) {
+
+	int32_t mapped = (mem->size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	int32_t i = 0;
+	while (i < mapped) {
+		if (!mem->touched[i]) {
+			i++;
+			continue;
+		}
+		int32_t start = i;
+		while (i < mapped && mem->touched[i]) {
+			i++;
+		}
+		int8_t *addr = (int8_t *)mem->data + ((size_t)start << PAGE_SHIFT);
+		size_t length = (size_t)(i - start) << PAGE_SHIFT;
+		if (mem->fileMapped) {
+			mmap(addr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+		} else {
+			madvise(addr, length, MADV_DONTNEED);
+		}
+	}
+	memset(mem->touched, 0, mem->pages);
+	mem->fileMapped = 0;
+	__atomic_store_n(&mem->GPIO_IN, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&mem->GPIO_OUT, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&mem->I2C_REST, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&mem->DISPLAY, 0, __ATOMIC_RELEASE);
+	mem->halted = 0;
+	mem->exitCode = 0;
+
+}
+
+static Device *findDevice (Memory *mem, int32_t addr) {
+
+	for (int32_t i = 0; i < mem->deviceCount; i++) {
+		if (addr >= mem->devices[i].min && addr <= mem->devices[i].max) {
+			return &mem->devices[i];
+		}
+	}
+	return NULL;
+
+}
+
+// all four bytes have to be inside of RAM, also across the end of a page
+static int inRam (Memory *mem, int32_t addr) {
+
+	return addr >= 0 && addr <= mem->size - 4;
+
+}
+
+static void writeSlow (Memory *mem, int32_t addr, int32_t data) {
+
+	Device *dev = findDevice(mem, addr);
+	if (dev != NULL) {
+		dev->write(mem, addr, data);
+	} else if (inRam(mem, addr)) {
+		memcpy((int8_t *)mem->data + addr, &data, 4);
+		mem->touched[addr >> PAGE_SHIFT] = 1;
+		mem->touched[(addr + 3) >> PAGE_SHIFT] = 1;
+	} else {
+		printf("ERROR: No valid memory address for write access 0 / %d / %d\n",addr,mem->size-1);
+	}
+
+}
+
+static int32_t readSlow (Memory *mem, int32_t addr) {
+
+	Device *dev = findDevice(mem, addr);
+	if (dev != NULL) {
+		return dev->read(mem, addr);
+	} else if (inRam(mem, addr)) {
+		int32_t data;
+		memcpy(&data, (int8_t *)mem->data + addr, 4);
+		return data;
+	} else {
+		printf("ERROR: No valid memory address for read access 0 / %d / %d\n",addr,mem->size-1);
+		return 0;
+	}
+
+}
+
+void wM (Memory *mem, int32_t addr, int32_t data) {
+
+	uint32_t page = (uint32_t)addr >> PAGE_SHIFT;
+	uint32_t offset = (uint32_t)addr & PAGE_MASK;
+	if (page < (uint32_t)mem->pages && mem->map[page] != NULL && offset <= PAGE_SIZE - 4) {
+		memcpy(mem->map[page] + offset, &data, 4);
+		mem->touched[page] = 1;
+	} else {
+		writeSlow(mem, addr, data);
+	}
+
+}
+
+int32_t rM (Memory *mem, int32_t addr) {
+
+	uint32_t page = (uint32_t)addr >> PAGE_SHIFT;
+	uint32_t offset = (uint32_t)addr & PAGE_MASK;
+	if (page < (uint32_t)mem->pages && mem->map[page] != NULL && offset <= PAGE_SIZE - 4) {
+		int32_t data;
+		memcpy(&data, mem->map[page] + offset, 4);
+		return data;
+	} else {
+		return readSlow(mem, addr);
+	}
+
+}
+
+// Byte and halfword accesses of the ELF instructions. They take the same
+// fast path as rM/wM, devices see the access at its own address.
+void wMn (Memory *mem, int32_t addr, int32_t data, int bytes) {
+
+	uint32_t page = (uint32_t)addr >> PAGE_SHIFT;
+	uint32_t offset = (uint32_t)addr & PAGE_MASK;
+	if (page < (uint32_t)mem->pages && mem->map[page] != NULL && offset <= PAGE_SIZE - bytes) {
+		memcpy(mem->map[page] + offset, &data, bytes);
+		mem->touched[page] = 1;
+		return;
+	}
+	Device *dev = findDevice(mem, addr);
+	if (dev != NULL) {
+		dev->write(mem, addr, bytes == 4 ? data : data & ((1 << bytes*8) - 1));
+	} else if (addr >= 0 && addr <= mem->size - bytes) {
+		memcpy((int8_t *)mem->data + addr, &data, bytes);
+		mem->touched[addr >> PAGE_SHIFT] = 1;
+		mem->touched[(addr + bytes - 1) >> PAGE_SHIFT] = 1;
+	} else {
+		printf("ERROR: No valid memory address for write access 0 / %d / %d\n",addr,mem->size-1);
+	}
+
+}
+
+int32_t rMn (Memory *mem, int32_t addr, int bytes) {
+
+	uint32_t page = (uint32_t)addr >> PAGE_SHIFT;
+	uint32_t offset = (uint32_t)addr & PAGE_MASK;
+	uint32_t data = 0;
+	if (page < (uint32_t)mem->pages && mem->map[page] != NULL && offset <= PAGE_SIZE - bytes) {
+		memcpy(&data, mem->map[page] + offset, bytes);
+		return data;
+	}
+	Device *dev = findDevice(mem, addr);
+	if (dev != NULL) {
+		data = dev->read(mem, addr);
+		return bytes == 4 ? data : data & ((1 << bytes*8) - 1);
+	} else if (addr >= 0 && addr <= mem->size - bytes) {
+		memcpy(&data, (int8_t *)mem->data + addr, bytes);
+		return data;
+	} else {
+		printf("ERROR: No valid memory address for read access 0 / %d / %d\n",addr,mem->size-1);
+		return 0;
+	}
+
+}
+
+// Atomics work on the host word itself, so harts on different threads see
+// them in one order. Devices have no atomics.
+static uint32_t *atomicWord (Memory *mem, int32_t addr) {
+
+	uint32_t page = (uint32_t)addr >> PAGE_SHIFT;
+	if (addr % 4 != 0) {
+		printf("ERROR: atomic access to %d is not aligned\n",addr);
+		return NULL;
+	} else if (page < (uint32_t)mem->pages && mem->map[page] != NULL) {
+		return (uint32_t *)(mem->map[page] + (addr & PAGE_MASK));
+	} else if (inRam(mem, addr) && findDevice(mem, addr) == NULL) {
+		return (uint32_t *)((int8_t *)mem->data + addr);
+	}
+	printf("ERROR: No valid memory address for atomic access 0 / %d / %d\n",addr,mem->size-1);
+	return NULL;
+
+}
+
+int32_t amoM (Memory *mem, int32_t addr, CommandType type, int32_t data) {
+
+	uint32_t *word = atomicWord(mem, addr);
+	if (word == NULL) {
+		return 0;
+	}
+	if (type == LR) {
+		return __atomic_load_n(word, __ATOMIC_SEQ_CST);
+	}
+	mem->touched[addr >> PAGE_SHIFT] = 1;
+	uint32_t value = data;
+	switch (type) {
+		case AMOSWAP: return __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
+		case AMOADD: return __atomic_fetch_add(word, value, __ATOMIC_SEQ_CST);
+		case AMOXOR: return __atomic_fetch_xor(word, value, __ATOMIC_SEQ_CST);
+		case AMOAND: return __atomic_fetch_and(word, value, __ATOMIC_SEQ_CST);
+		case AMOOR: return __atomic_fetch_or(word, value, __ATOMIC_SEQ_CST);
+		default: break;
+	}
+	// min and max have no host instruction, they retry until no other
+	// hart changed the word in between
+	uint32_t old = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+	uint32_t next;
+	do {
+		switch (type) {
+			case AMOMIN: next = (int32_t)old < data ? old : value; break;
+			case AMOMAX: next = (int32_t)old > data ? old : value; break;
+			case AMOMINU: next = old < value ? old : value; break;
+			default: next = old > value ? old : value; break;
+		}
+	} while (!__atomic_compare_exchange_n(word, &old, next, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return old;
+
+}
+
+int casM (Memory *mem, int32_t addr, int32_t expected, int32_t data) {
+
+	uint32_t *word = atomicWord(mem, addr);
+	if (word == NULL) {
+		return 0;
+	}
+	mem->touched[addr >> PAGE_SHIFT] = 1;
+	uint32_t old = expected;
+	return __atomic_compare_exchange_n(word, &old, (uint32_t)data, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+}
+
+uint64_t digestMemory (Memory *mem) {
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (int32_t page = 0; page < mem->pages; page++) {
+		int32_t start = page << PAGE_SHIFT;
+		int32_t size = mem->size - start < PAGE_SIZE ? mem->size - start : PAGE_SIZE;
+		if (!mem->touched[page] || size <= 0) {
+			continue;
+		}
+		const uint8_t *data = (uint8_t *)mem->data + start;
+		int32_t used = 0;
+		while (used < size && data[used] == 0) {
+			used++;
+		}
+		if (used == size) {
+			continue;
+		}
+		for (int i = 0; i < 4; i++) {
+			hash = (hash ^ ((page >> (i*8)) & 0xFF))*1099511628211ULL;
+		}
+		for (int32_t i = 0; i < size; i++) {
+			hash = (hash ^ data[i])*1099511628211ULL;
+		}
+	}
+	return hash;
+
+}
+
+int writeBlock (Memory *mem, int32_t addr, const void *src, int32_t size) {
+
+	if (size == 0) {
+		return 1;
+	}
+	if (addr < 0 || size < 0 || addr > mem->size - size) {
+		return 0;
+	}
+	for (int32_t i = 0; i < mem->deviceCount; i++) {
+		if (addr <= mem->devices[i].max && addr + size - 1 >= mem->devices[i].min) {
+			return 0;
+		}
+	}
+	memcpy((int8_t *)mem->data + addr, src, size);
+	memset(mem->touched + (addr >> PAGE_SHIFT), 1, ((addr + size - 1) >> PAGE_SHIFT) - (addr >> PAGE_SHIFT) + 1);
+	return 1;
+
+}
@@ -0,0 +1,35 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+#include<stdint.h>
+#include "cpu.h"
+
+// MEMORY MAP INTERFACE
+
+Memory *createMemory (int32_t size);
+
+void freeMemory (Memory *mem);
+
+// maps a device to the addresses min..max, returns 0 if it does not fit
+int addDevice (Memory *mem, int32_t min, int32_t max, DeviceRead read, DeviceWrite write);
+
+// smallest range holding every device, max < min if there is none
+void deviceWindow (Memory *mem, int32_t *min, int32_t *max);
+
+// FNV-1a over the number and contents of every touched page that is not
+// all zeros, equal memory gives equal digests
+uint64_t digestMemory (Memory *mem);
+
+// copies size bytes into RAM at addr, returns 0 if they do not fit into RAM
+// or cover a device
+int writeBlock (Memory *mem, int32_t addr, const void *src, int32_t size);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+//------------ REQUIRED FUNCTIONS -------------
+
+#include<stdint.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include "display.h"
+#include "cpu.h"
+#include "snapshot.h"
+
+//---------------------------------------------
+
+// A snapshot holds the registers, the devices, the display and only the
+// pages the program wrote to, pages that are all zeros again are left out.
+// The pages start at a page aligned offset, so restoring maps runs of them
+// privately over the guest memory instead of copying: a restore costs one
+// mmap per run, and a page is only read from the file once the guest
+// touches it and only copied once it writes to it. Batch workers restore
+// the same snapshot for every job that way. resetMemory knows about the
+// mapped pages (fileMapped) and replaces them with anonymous memory again.
+// If the host does not use 4 KiB pages the pages are read instead.
+
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+static uint64_t hashProgram (Program *pgrm) {
+
+	uint64_t hash = 14695981039346656037ULL;
+	const uint8_t *data = (uint8_t *)pgrm->addr;
+	for (size_t i = 0; i < (size_t)pgrm->length*sizeof(PackedCommand); i++) {
+		hash = (hash ^ data[i])*1099511628211ULL;
+	}
+	return hash;
+
+}
+
+static int isZeroPage (const uint8_t *data) {
+
+	for (int32_t i = 0; i < PAGE_SIZE; i++) {
+		if (data[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+
+}
+
+static uint32_t alignPage (uint32_t offset) {
+
+	return (offset + PAGE_SIZE - 1) & ~(uint32_t)(PAGE_SIZE - 1);
+
+}
+
+int saveSnapshot (CPU *cpu, char *path) {
+
+	Memory *mem = cpu->shared->mem;
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(SnapshotHeader));
+	memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+	header.version = SNAPSHOT_VERSION;
+	header.pageSize = PAGE_SIZE;
+	header.memorySize = mem->size;
+	header.programLength = cpu->pgrm->length;
+	header.programHash = hashProgram(cpu->pgrm);
+	header.pc = cpu->pgrm->pc;
+	for (int i = 0; i < 32; i++) {
+		header.registers[i] = i < cpu->reg->size ? rR(cpu->reg, i) : 0;
+	}
+	header.gpioIn = __atomic_load_n(&mem->GPIO_IN, __ATOMIC_ACQUIRE);
+	header.gpioOut = __atomic_load_n(&mem->GPIO_OUT, __ATOMIC_ACQUIRE);
+	header.i2cRest = __atomic_load_n(&mem->I2C_REST, __ATOMIC_ACQUIRE);
+	header.display = __atomic_load_n(&mem->DISPLAY, __ATOMIC_ACQUIRE);
+	header.halted = __atomic_load_n(&mem->halted, __ATOMIC_ACQUIRE);
+	header.exitCode = mem->exitCode;
+
+	int32_t *table = malloc(sizeof(int32_t)*(mem->pages + 1));
+	void *display = malloc(displayStateSize());
+	if (table == NULL || display == NULL) {
+		printf("ERROR: Cannot allocate snapshot\n");
+		free(table);
+		free(display);
+		return 0;
+	}
+	for (int32_t page = 0; page < mem->pages; page++) {
+		if (mem->touched[page] && !isZeroPage((uint8_t *)mem->data + ((size_t)page << PAGE_SHIFT))) {
+			table[header.pageCount++] = page;
+		}
+	}
+	saveDisplayState(display);
+	header.tableOffset = sizeof(SnapshotHeader);
+	header.displaySize = displayStateSize();
+	header.displayOffset = header.tableOffset + sizeof(int32_t)*header.pageCount;
+	header.dataOffset = alignPage(header.displayOffset + header.displaySize);
+
+	// written next to its place and renamed, a cut off file is never read
+	char temp[4096];
+	snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("ERROR: cannot write snapshot %s\n", path);
+		free(table);
+		free(display);
+		return 0;
+	}
+	int ok = pwrite(fd, &header, sizeof(SnapshotHeader), 0) == sizeof(SnapshotHeader)
+		&& pwrite(fd, table, sizeof(int32_t)*header.pageCount, header.tableOffset) == (ssize_t)(sizeof(int32_t)*header.pageCount)
+		&& pwrite(fd, display, header.displaySize, header.displayOffset) == (ssize_t)header.displaySize;
+	for (uint32_t i = 0; ok && i < header.pageCount; i++) {
+		const void *data = (uint8_t *)mem->data + ((size_t)table[i] << PAGE_SHIFT);
+		ok = pwrite(fd, data, PAGE_SIZE, header.dataOffset + (off_t)i*PAGE_SIZE) == PAGE_SIZE;
+	}
+	ok = close(fd) == 0 && ok;
+	free(table);
+	free(display);
+	if (!ok || rename(temp, path) != 0) {
+		printf("ERROR: cannot write snapshot %s\n", path);
+		unlink(temp);
+		return 0;
+	}
+	printf("Snapshot: %u pages saved to %s\n", header.pageCount, path);
+	return 1;
+
+}
+
+Snapshot *openSnapshot (char *path) {
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("ERROR: cannot open snapshot %s\n", path);
+		return NULL;
+	}
+	Snapshot *snapshot = malloc(sizeof(Snapshot));
+	if (snapshot == NULL) {
+		printf("ERROR: Cannot allocate snapshot\n");
+		close(fd);
+		return NULL;
+	}
+	snapshot->fd = fd;
+	snapshot->table = NULL;
+	snapshot->display = NULL;
+
+	SnapshotHeader *header = &snapshot->header;
+	struct stat st;
+	if (pread(fd, header, sizeof(SnapshotHeader), 0) != sizeof(SnapshotHeader) || fstat(fd, &st) != 0
+		|| memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0) {
+		printf("ERROR: %s is not a snapshot\n", path);
+		closeSnapshot(snapshot);
+		return NULL;
+	}
+	if (header->version != SNAPSHOT_VERSION || header->pageSize != PAGE_SIZE) {
+		printf("ERROR: snapshot version %u with %u byte pages is not supported, expected %d with %d\n",
+			header->version, header->pageSize, SNAPSHOT_VERSION, PAGE_SIZE);
+		closeSnapshot(snapshot);
+		return NULL;
+	}
+	if (header->displaySize != displayStateSize() || header->dataOffset % PAGE_SIZE != 0
+		|| (uint64_t)header->tableOffset + sizeof(int32_t)*header->pageCount > (uint64_t)st.st_size
+		|| (uint64_t)header->displayOffset + header->displaySize > (uint64_t)st.st_size
+		|| (header->pageCount > 0 && (uint64_t)header->dataOffset + (uint64_t)header->pageCount*PAGE_SIZE > (uint64_t)st.st_size)) {
+		printf("ERROR: %s is not a valid snapshot\n", path);
+		closeSnapshot(snapshot);
+		return NULL;
+	}
+
+	snapshot->table = malloc(sizeof(int32_t)*(header->pageCount + 1));
+	snapshot->display = malloc(header->displaySize);
+	if (snapshot->table == NULL || snapshot->display == NULL) {
+		printf("ERROR: Cannot allocate snapshot\n");
+		closeSnapshot(snapshot);
+		return NULL;
+	}
+	size_t tableSize = sizeof(int32_t)*header->pageCount;
+	if (pread(fd, snapshot->table, tableSize, header->tableOffset) != (ssize_t)tableSize
+		|| pread(fd, snapshot->display, header->displaySize, header->displayOffset) != (ssize_t)header->displaySize) {
+		printf("ERROR: %s is not a valid snapshot\n", path);
+		closeSnapshot(snapshot);
+		return NULL;
+	}
+	for (uint32_t i = 0; i < header->pageCount; i++) {
+		if (snapshot->table[i] < 0 || (i > 0 && snapshot->table[i] <= snapshot->table[i-1])) {
+			printf("ERROR: %s is not a valid snapshot\n", path);
+			closeSnapshot(snapshot);
+			return NULL;
+		}
+	}
+	return snapshot;
+
+}
+
+// maps the pages first..last-1 of the table, which lie one after another
+// in the file, to their places in memory
+static int mapPages (Memory *mem, Snapshot *snapshot, uint32_t first, uint32_t last) {
+
+	SnapshotHeader *header = &snapshot->header;
+	void *addr = (uint8_t *)mem->data + ((size_t)snapshot->table[first] << PAGE_SHIFT);
+	size_t length = (size_t)(last - first) << PAGE_SHIFT;
+	off_t offset = header->dataOffset + (off_t)first*PAGE_SIZE;
+	if (sysconf(_SC_PAGESIZE) == PAGE_SIZE) {
+		if (mmap(addr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snapshot->fd, offset) != MAP_FAILED) {
+			mem->fileMapped = 1;
+			return 1;
+		}
+	}
+	return pread(snapshot->fd, addr, length, offset) == (ssize_t)length;
+
+}
+
+int restoreSnapshot (CPU *cpu, Snapshot *snapshot) {
+
+	Memory *mem = cpu->shared->mem;
+	SnapshotHeader *header = &snapshot->header;
+	if (header->memorySize != mem->size) {
+		printf("ERROR: snapshot of %d bytes memory cannot be restored to %d bytes\n", header->memorySize, mem->size);
+		return 0;
+	}
+	if (header->programLength != cpu->pgrm->length || header->programHash != hashProgram(cpu->pgrm)) {
+		printf("ERROR: snapshot was taken of another program\n");
+		return 0;
+	}
+	if (header->pageCount > 0 && snapshot->table[header->pageCount-1] >= mem->pages) {
+		printf("ERROR: snapshot pages do not fit into memory\n");
+		return 0;
+	}
+
+	resetMemory(mem);
+	uint32_t first = 0;
+	for (uint32_t i = 1; i <= header->pageCount; i++) {
+		if (i < header->pageCount && snapshot->table[i] == snapshot->table[i-1] + 1) {
+			continue;
+		}
+		if (!mapPages(mem, snapshot, first, i)) {
+			printf("ERROR: cannot read snapshot pages\n");
+			return 0;
+		}
+		first = i;
+	}
+	for (uint32_t i = 0; i < header->pageCount; i++) {
+		mem->touched[snapshot->table[i]] = 1;
+	}
+
+	__atomic_store_n(&mem->GPIO_IN, header->gpioIn, __ATOMIC_RELEASE);
+	__atomic_store_n(&mem->GPIO_OUT, header->gpioOut, __ATOMIC_RELEASE);
+	__atomic_store_n(&mem->I2C_REST, header->i2cRest, __ATOMIC_RELEASE);
+	__atomic_store_n(&mem->DISPLAY, header->display, __ATOMIC_RELEASE);
+	mem->exitCode = header->exitCode;
+	__atomic_store_n(&mem->halted, header->halted, __ATOMIC_RELEASE);
+	for (int i = 1; i < 32 && i < cpu->reg->size; i++) {
+		wR(cpu->reg, i, header->registers[i]);
+	}
+	cpu->reg->reserved = 0;
+	cpu->pgrm->pc = header->pc;
+
+	loadDisplayState(snapshot->display);
+	return 1;
+
+}
+
+void closeSnapshot (Snapshot *snapshot) {
+
+	close(snapshot->fd);
+	free(snapshot->table);
+	free(snapshot->display);
+	free(snapshot);
+
+}
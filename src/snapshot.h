@@ -0,0 +1,64 @@
+/*
+* TinyRiscV-Simulator 2024
+* ===========================
+*
+* Project: https://github.com/LordBlacky/TinyRiscV-Simulator
+*
+*/
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include<stdint.h>
+#include "cpu.h"
+
+// SNAPSHOT INTERFACE
+
+#define SNAPSHOT_MAGIC "TRVS"
+#define SNAPSHOT_VERSION 2
+
+// all fields in host byte order, snapshots are not meant to be moved
+// between machines
+typedef struct SnapshotHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t pageSize; // 1 << PAGE_SHIFT
+	int32_t memorySize; // bytes, has to match the memory it is restored to
+	int32_t programLength;
+	uint64_t programHash; // FNV-1a over the commands, see hashProgram
+	int32_t pc;
+	int32_t registers[32];
+	int32_t gpioIn;
+	int32_t gpioOut;
+	int32_t i2cRest;
+	int32_t display;
+	int32_t halted;
+	int32_t exitCode;
+	uint32_t displaySize;
+	uint32_t displayOffset; // the display state, see saveDisplayState
+	uint32_t pageCount;
+	uint32_t tableOffset; // pageCount int32_t page numbers, ascending
+	uint32_t dataOffset; // page aligned, pageCount pages in table order
+} SnapshotHeader;
+
+typedef struct Snapshot {
+	int fd;
+	SnapshotHeader header;
+	int32_t *table;
+	void *display;
+} Snapshot;
+
+// writes registers, pc, devices, the display and every touched page that
+// is not all zeros to path, returns 0 and prints why on errors
+int saveSnapshot (CPU *cpu, char *path);
+
+// reads the header and the page table, the pages are mapped on restore
+Snapshot *openSnapshot (char *path);
+
+// resets the memory and maps the saved pages into it, returns 0 and leaves
+// the CPU unchanged if the snapshot belongs to another program or memory
+int restoreSnapshot (CPU *cpu, Snapshot *snapshot);
+
+void closeSnapshot (Snapshot *snapshot);
+
+#endif
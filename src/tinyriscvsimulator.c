@@ -12,9 +12,22 @@
 #include<stdlib.h>
 #include<string.h>
 #include<pthread.h>
+#include<time.h>
 #include "display.h"
+#include "i2c.h"
 #include "cpu.h"
+#include "memory.h"
+#include "image.h"
+#include "elfloader.h"
+#include "assembler.h"
 #include "debugger.h"
+#include "engine.h"
+#include "jit.h"
+#include "blocks.h"
+#include "harts.h"
+#include "batch.h"
+#include "capture.h"
+#include "snapshot.h"
 
 // UDP SOCKET FOR I/O AND I2C DEVICES ---
 #include<sys/socket.h>
@@ -24,34 +37,88 @@
 
 #define PORT 50000
 #define BUFFER_SIZE 1024
-#define GPIO_ADDR_IN 0x100001
-#define GPIO_ADDR_OUT 0x100000
-#define I2C_ADDR_MIN 0x100004
-#define I2C_ADDR_MAX 0x100084
-#define DISPLAY_ADDR 0x100040
 // -----------------------
 
-Memory *createMemory (int32_t size) {
+#define EXIT_LIFETIME 124 // exit status of a headless run that did not halt
+#define TRAP_EXIT -1 // guest exit code after a pc outside of the program
+#define CSR_MHARTID 0xF14
+
+typedef struct Options {
+	int memsize;
+	int pgrmsize;
+	int lifetime;
+	char *file;
+	int baseAddr;
+	int debugger;
+	Engine engine;
+	int headless; // no display and no socket, see runSimulation
+	int harts;
+	int quantum; // instructions a hart runs before the next one, see harts.c
+	int freeRunning;
+	char *batch; // job file, see batch.c
+	char *batchOut;
+	int workers;
+	char *asmCache; // directory of assembled units, NULL for none
+	char *snapshotSave; // see snapshot.c
+	char *snapshotLoad;
+	int historyMB; // undo log and checkpoints of the debugger, see history.c
+	int checkpointInterval;
+	Breakpoint *breakpoints; // --break and --watch, see debugger.c
+	int breakpointCount;
+	Watchpoint *watchpoints;
+	int watchpointCount;
+	char *capture; // every display frame, see capture.c
+	char *capturePbm;
+} Options;
+
+// ALLOCATION COUNTER ---
+// malloc, calloc and realloc are replaced by counting versions that hand
+// over to the ones of glibc, so runCPU can report every allocation made
+// while the program was running, also those of libc, ncurses and the
+// display. Other C libraries have no __libc_malloc, there nothing is counted.
+uint64_t allocations = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *malloc (size_t size) {
+
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
 
-	Memory *mem = malloc(sizeof(Memory));
-	if (mem == NULL) {
-		printf("ERROR: Cannot allocate memory\n");
-		return NULL;
-	} else {
-		mem->data = malloc(sizeof(int32_t)*size);
-		if (mem->data == NULL) {
-			free(mem);
-			printf("ERROR: Cannot allocate memory\n");
-			return NULL;
-		} else {
-			mem->size = size*4;
-			mem->GPIO_IN = 0;
-			mem->GPIO_OUT = 0;
-			mem->DISPLAY = 0;
-			mem->I2C_REST = 0;
-		}
+}
+
+void *calloc (size_t count, size_t size) {
+
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(count, size);
+
+}
+
+void *realloc (void *ptr, size_t size) {
+
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+
+}
+#endif
+
+uint64_t getAllocations () {
+
+	return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+
+}
+// -----------------------
+
+void attachMemory (SharedMemory *shared, Memory *mem) {
+
+	shared->mem = mem;
+	if (mem != NULL) {
+		mem->deviceLock = &shared->mutex;
+		mem->lockStats = &shared->stats;
 	}
-	return mem;
 
 }
 
@@ -62,9 +129,9 @@ SharedMemory *createSharedMemory (int32_t size) {
 		printf("ERROR: Cannot allocate shared memory\n");
 		return NULL;
 	} else {
-		Memory *mem = createMemory(size);
-		shared->mem = mem;
 		pthread_mutex_init(&shared->mutex, NULL);
+		memset(&shared->stats, 0, sizeof(LockStats));
+		attachMemory(shared, createMemory(size));
 	}
 	return shared;
 
@@ -77,7 +144,8 @@ Register *createRegister (int32_t size) {
 		printf("ERROR: Cannot allocate register\n");
 		return NULL;
 	} else {
-		reg->data = malloc(sizeof(int32_t)*size);
+		// one slot more than size: the threaded engine sends writes to x0 there
+		reg->data = malloc(sizeof(int32_t)*(size+1));
 		if (reg->data == NULL) {
 			free(reg);
 			printf("ERROR: Cannot allocate register\n");
@@ -85,19 +153,16 @@ Register *createRegister (int32_t size) {
 		} else {
 			reg->size = size;
 			(reg->data)[0] = 0;
+			reg->hartId = 0;
+			reg->reserved = 0;
+			reg->reservation = 0;
+			reg->reservedValue = 0;
 		}
 	}
 	return reg;
 
 }
 
-void freeMemory (Memory *mem) {
-
-	free(mem->data);
-	free(mem);
-
-}
-
 void freeSharedMemory (SharedMemory *shared) {
 
 	freeMemory(shared->mem);
@@ -113,32 +178,6 @@ void freeRegister (Register *reg) {
 
 }
 
-void wM (Memory *mem, int32_t addr, int32_t data) {
-
-	int8_t *bytePtr = (int8_t *)(mem->data);
-	int32_t *byteAddr = (int32_t *)(bytePtr + addr);
-	
-	if (addr < mem->size && addr >= 0) {
-		if (addr == GPIO_ADDR_OUT) {
-			mem->GPIO_OUT = data & 0xFF;
-		} else if (addr == GPIO_ADDR_IN) {
-			printf("ERROR: Writing to GPIO_IN not possible\n");
-		} else if (addr >= I2C_ADDR_MIN && addr <= I2C_ADDR_MAX ) {
-			if (addr == DISPLAY_ADDR) {
-				mem->DISPLAY = data;
-				sendCommand(mem->DISPLAY);
-			} else {
-				mem->I2C_REST = data;
-			}
-		} else {
-			*byteAddr = data;
-		}
-	} else {
-		printf("ERROR: No valid memory address for write access 0 / %d / %d\n",addr,mem->size-1);
-	}
-
-}
-
 void wR (Register *reg, int32_t addr, int32_t data) {
 
 	if (addr < reg->size && addr >= 0) {
@@ -151,33 +190,6 @@ void wR (Register *reg, int32_t addr, int32_t data) {
 
 }
 
-int32_t rM (Memory *mem, int32_t addr) {
-
-	int8_t *bytePtr = (int8_t *)(mem->data);
-	int32_t *byteAddr = (int32_t *)(bytePtr + addr);
-
-	if (addr < mem->size && addr >= 0) {
-		if (addr == GPIO_ADDR_IN) {
-			return (int32_t)mem->GPIO_IN;
-		} else if (addr == GPIO_ADDR_OUT) {
-			printf("ERROR: Reading from GPIO_OUT not possible\n");
-			return 0;
-		} else if (addr >= I2C_ADDR_MIN && addr <= I2C_ADDR_MAX){
-			if (addr == DISPLAY_ADDR) {
-				return mem->DISPLAY;
-			} else {
-				return mem->I2C_REST;
-			}
-		} else {
-			return *byteAddr;
-		}
-	} else {
-		printf("ERROR: No valid memory address for read access 0 / %d / %d\n",addr,mem->size-1);
-		return 0;
-	}
-
-}
-
 int32_t rR (Register *reg, int32_t addr) {
 
 	if (addr < reg->size && addr >= 0) {
@@ -193,6 +205,8 @@ int32_t rR (Register *reg, int32_t addr) {
 
 }
 
+// the program starts empty and grows to the size of what is loaded,
+// size only limits how large it may get
 Program *createProgram (int32_t size) {
 	
 	Program *pgrm = malloc(sizeof(Program));
@@ -200,61 +214,245 @@ Program *createProgram (int32_t size) {
 		printf("ERROR: Cannot allocate program\n");
 		return NULL;
 	} else {
-		pgrm->size = size;
+		pgrm->size = 0;
+		pgrm->maxSize = size;
+		pgrm->length = 0;
+		pgrm->decoded = NULL;
+		pgrm->decodedValid = 0;
 		pgrm->pc = 0;
-		pgrm->addr = malloc(sizeof(Command)*size);
-		if (pgrm->addr == NULL) {
-			free(pgrm);
-			printf("ERROR: Cannot allocate program\n");
-			return NULL;
-		} else {
-			return pgrm;
-		}
+		pgrm->entry = 0;
+		pgrm->image = NULL;
+		pgrm->imageSize = 0;
+		pgrm->segments = NULL;
+		pgrm->stack = 0;
+		pgrm->listing = NULL;
+		pgrm->addr = NULL;
+		return pgrm;
 	}
 
 }
 
 void freeProgram (Program *pgrm) {
 
-	free(pgrm->addr);
+	free(pgrm->decoded);
+	if (pgrm->segments != NULL) {
+		freeElf(pgrm);
+	}
+	if (pgrm->listing != NULL) {
+		freeListing(pgrm);
+	}
+	if (pgrm->image != NULL) {
+		freeImage(pgrm);
+	} else {
+		free(pgrm->addr);
+	}
 	free(pgrm);
 
 }
 
+static int fitsSmall (int32_t v) {
+
+	return v >= INT8_MIN && v <= INT8_MAX;
+
+}
+
+// keeps the first operand that does not fit in a byte in imm, c if all fit.
+// A second one that does not fit is cut to a byte, that only happens for
+// broken register numbers, which stay invalid.
+static PackedCommand packCommand (Command cmd) {
+
+	PackedCommand p;
+	p.type = cmd.type;
+	if (!fitsSmall(cmd.a)) {
+		p.wide = 0;
+		p.imm = cmd.a;
+		p.small[0] = fitsSmall(cmd.b) ? cmd.b : INT8_MIN;
+		p.small[1] = fitsSmall(cmd.c) ? cmd.c : INT8_MIN;
+	} else if (!fitsSmall(cmd.b)) {
+		p.wide = 1;
+		p.imm = cmd.b;
+		p.small[0] = cmd.a;
+		p.small[1] = fitsSmall(cmd.c) ? cmd.c : INT8_MIN;
+	} else {
+		p.wide = 2;
+		p.imm = cmd.c;
+		p.small[0] = cmd.a;
+		p.small[1] = cmd.b;
+	}
+	return p;
+
+}
+
+static inline Command unpackCommand (PackedCommand p) {
+
+	switch (p.wide) {
+		case 0: return (Command){p.type, p.imm, p.small[0], p.small[1]};
+		case 1: return (Command){p.type, p.small[0], p.imm, p.small[1]};
+		default: return (Command){p.type, p.small[0], p.small[1], p.imm};
+	}
+
+}
+
 void addCommand (Program *pgrm, int32_t line, CommandType type, int32_t a, int32_t b, int32_t c) {
 
-	if (line < 0 || line >= pgrm->size ) {
-		printf("ERROR: addCommand - line is not in between 0 / %d / %d\n",line,pgrm->size-1);
+	if (line < 0 || line >= pgrm->maxSize || (pgrm->image != NULL && line >= pgrm->size)) {
+		printf("ERROR: addCommand - line is not in between 0 / %d / %d\n",line,pgrm->maxSize-1);
 		return;
-	} else {
-		(pgrm->addr)[line].type = type;
-		(pgrm->addr)[line].a = a;
-		(pgrm->addr)[line].b = b;
-		(pgrm->addr)[line].c = c;
+	}
+	if (line >= pgrm->size) {
+		int32_t size = pgrm->size == 0 ? 1024 : pgrm->size;
+		while (size <= line) {
+			size *= 2;
+		}
+		size = size < pgrm->maxSize ? size : pgrm->maxSize;
+		PackedCommand *addr = realloc(pgrm->addr, sizeof(PackedCommand)*size);
+		if (addr == NULL) {
+			printf("ERROR: Cannot allocate program\n");
+			return;
+		}
+		memset(addr + pgrm->size, 0, sizeof(PackedCommand)*(size - pgrm->size));
+		pgrm->addr = addr;
+		pgrm->size = size;
+	}
+	(pgrm->addr)[line] = packCommand((Command){type, a, b, c});
+	pgrm->decodedValid = 0;
+
+}
+
+Command commandAt (Program *pgrm, int32_t index) {
+
+	return unpackCommand((pgrm->addr)[index]);
+
+}
+
+int memoryAccess (Program *pgrm, Register *reg, int32_t *addr, int32_t *bytes) {
+
+	if (pgrm->pc < 0 || pgrm->pc/4 >= pgrm->length) {
+		return 0;
+	}
+	Command cmd = commandAt(pgrm, pgrm->pc/4);
+	*bytes = 4;
+	switch (cmd.type) {
+		case LW: *addr = rR(reg,cmd.b) + cmd.c; return ACCESS_LOAD;
+		case LH: case LHU: *addr = rR(reg,cmd.b) + cmd.c; *bytes = 2; return ACCESS_LOAD;
+		case LB: case LBU: *addr = rR(reg,cmd.b) + cmd.c; *bytes = 1; return ACCESS_LOAD;
+		case LEAVE: *addr = rR(reg,8); return ACCESS_LOAD;
+		case LR: *addr = rR(reg,cmd.b); return ACCESS_LOAD;
+		case SW: *addr = rR(reg,cmd.b) + cmd.c; return ACCESS_STORE;
+		case SH: *addr = rR(reg,cmd.b) + cmd.c; *bytes = 2; return ACCESS_STORE;
+		case SB: *addr = rR(reg,cmd.b) + cmd.c; *bytes = 1; return ACCESS_STORE;
+		case SC: case AMOSWAP ... AMOMAXU: *addr = rR(reg,cmd.c); return ACCESS_LOAD | ACCESS_STORE;
+		default: return 0;
 	}
 
 }
 
 Command getCommand (Program *pgrm) {
 
-	return (pgrm->addr)[pgrm->pc/4];
+	return unpackCommand((pgrm->addr)[pgrm->pc/4]);
 
 }
 
-void executeCommand (Command cmd, Register *reg, Memory *mem, Program *pgrm);
+// Rewrites a pseudo instruction into the base instruction it stands for.
+// LEAVE is kept as a fused instruction and LA is unsupported, both are
+// returned unchanged, as is every base instruction.
+Command lowerCommand (Command cmd) {
 
-void executeExpansion(CommandType type, int32_t arg1, int32_t arg2, int32_t arg3, Register *reg, Memory *mem, Program *pgrm) {
+	int32_t rd = cmd.a;
+	int32_t rs1 = cmd.b;
+	int32_t rs2 = cmd.c;
+	Command low = cmd;
+
+	switch (cmd.type) {
+		case NOP: low = (Command){ADDI, 0, 0, 0}; break;
+		case LI: low = (Command){ADDI, rd, 0, rs1}; break;
+		case MV: low = (Command){ADDI, rd, rs1, 0}; break;
+		case NOT: low = (Command){XORI, rd, rs1, 0}; break;
+		case NEG: low = (Command){SUB, rd, 0, 0}; break;
+		case SEQZ: low = (Command){SLTIU, rd, rs1, 1}; break;
+		case SNEZ: low = (Command){SLTU, rd, 0, rs1}; break;
+		case SLTZ: low = (Command){SLT, rd, rs1, 0}; break;
+		case SGTZ: low = (Command){SLT, rd, 0, rs1}; break;
+		case BEQZ: low = (Command){BEQ, rd, 0, rs1}; break;
+		case BNEZ: low = (Command){BNE, rd, 0, rs1}; break;
+		case BLEZ: low = (Command){BGE, 0, rd, rs1}; break;
+		case BGEZ: low = (Command){BGE, rd, 0, rs1}; break;
+		case BLTZ: low = (Command){BLT, rd, 0, rs1}; break;
+		case BGTZ: low = (Command){BLT, 0, rd, rs1}; break;
+		case BGT: low = (Command){BLT, rs1, rd, rs2}; break;
+		case BLE: low = (Command){BGE, rs1, rd, rs2}; break;
+		case BGTU: low = (Command){BLTU, rs1, rd, rs2}; break;
+		case BLEU: low = (Command){BLTU, rs1, rd, rs2}; break;
+		case J: low = (Command){JAL, 0, rd, 0}; break;
+		case JR: low = (Command){JALR, 0, rd, 0}; break;
+		case RET: low = (Command){JALR, 0, 1, 0}; break;
+		case CALL: low = (Command){JAL, 1, rd, 0}; break;
+		default: break;
+	}
+	return low;
 
-	Command *cmd = malloc(sizeof(Command));
-	cmd->type = type;
-	cmd->a = arg1;
-	cmd->b = arg2;
-	cmd->c = arg3;
-	executeCommand(*cmd, reg, mem, pgrm);
-	free(cmd);
+}
+
+// only writes the commands that change, a mapped image that was written
+// lowered keeps all of its pages shared with the file
+void lowerProgram (Program *pgrm) {
+
+	for (int32_t i = 0; i < pgrm->length; i++) {
+		Command cmd = commandAt(pgrm, i);
+		Command low = lowerCommand(cmd);
+		if (low.type != cmd.type) {
+			(pgrm->addr)[i] = packCommand(low);
+		}
+	}
+
+}
+
+// RISC-V does not trap on division, x/0 gives all ones and x%0 gives x.
+// INT32_MIN/-1 overflows to INT32_MIN with a remainder of 0.
+static int32_t divSigned (int32_t a, int32_t b) {
+
+	if (b == 0) {
+		return -1;
+	} else if (a == INT32_MIN && b == -1) {
+		return a;
+	}
+	return a / b;
 
 }
 
+static int32_t remSigned (int32_t a, int32_t b) {
+
+	if (b == 0) {
+		return a;
+	} else if (a == INT32_MIN && b == -1) {
+		return 0;
+	}
+	return a % b;
+
+}
+
+// the Linux system calls newlib needs to print and to exit
+static void environmentCall (Register *reg, Memory *mem) {
+
+	int32_t call = rR(reg,17);
+	if (call == 93 || call == 94) { // exit, exit_group
+		mem->halted = 1;
+		mem->exitCode = rR(reg,10);
+	} else if (call == 64 && (rR(reg,10) == 1 || rR(reg,10) == 2)) { // write to stdout or stderr
+		FILE *out = rR(reg,10) == 1 ? stdout : stderr;
+		int32_t buf = rR(reg,11);
+		int32_t len = rR(reg,12);
+		for (int32_t i = 0; i < len; i++) {
+			fputc(rMn(mem,buf + i,1), out);
+		}
+		fflush(out);
+		wR(reg,10,len);
+	} else {
+		printf("ERROR: ecall %d is not supported\n",call);
+		wR(reg,10,-38); // -ENOSYS
+	}
+
+}
 
 void executeCommand (Command cmd, Register *reg, Memory *mem, Program *pgrm) {
 
@@ -394,85 +592,132 @@ void executeCommand (Command cmd, Register *reg, Memory *mem, Program *pgrm) {
 			wR(reg,rd,(pgrm->pc + 4));
 			pgrm->pc = ((rR(reg,rs1) + rs2) & 0xfffffffe);
 			break;
+		case JALRX: {
+			int32_t target = (rR(reg,rs1) + rs2) & 0xfffffffe;
+			wR(reg,rd,(pgrm->pc + 4));
+			pgrm->pc = target;
+			break;
+		}
 
 		//also add supported pseudo instruction
 		case NOP:
 			pgrm->pc += 4;
 			break;
-		case LI:
-			executeExpansion(ADDI, rd, 0, rs1, reg, mem, pgrm);
-			break;
 		case LA:
 			printf("ERROR: LA instruction is currently not supported\n");
 			break;
-		case MV:
-			executeExpansion(ADDI, rd, rs1, 0, reg, mem, pgrm);
+		case LEAVE:
+			wR(reg,2,rR(reg,8));
+			wR(reg,8,rM(mem,rR(reg,2)));
+			wR(reg,2,rR(reg,2) + 4);
+			pgrm->pc += 4;
 			break;
-		case NOT:
-			executeExpansion(XORI, rd, rs1, 0, reg, mem, pgrm);
+
+		//instructions only decoded from ELF files
+		case LB:
+			wR(reg,rd,(int8_t)rMn(mem,rR(reg,rs1) + rs2,1));
+			pgrm->pc += 4;
 			break;
-		case NEG:
-			executeExpansion(SUB, rd, 0, 0, reg, mem, pgrm);
+		case LH:
+			wR(reg,rd,(int16_t)rMn(mem,rR(reg,rs1) + rs2,2));
+			pgrm->pc += 4;
 			break;
-		case SEQZ:
-			executeExpansion(SLTIU, rd, rs1, 1, reg, mem, pgrm);
+		case LBU:
+			wR(reg,rd,rMn(mem,rR(reg,rs1) + rs2,1));
+			pgrm->pc += 4;
 			break;
-		case SNEZ:
-			executeExpansion(SLTU, rd, 0, rs1, reg, mem, pgrm);
+		case LHU:
+			wR(reg,rd,rMn(mem,rR(reg,rs1) + rs2,2));
+			pgrm->pc += 4;
 			break;
-		case SLTZ:
-			executeExpansion(SLT, rd, rs1, 0, reg, mem, pgrm);
+		case SB:
+			wMn(mem,rR(reg,rs1) + rs2,rR(reg,rd),1);
+			pgrm->pc += 4;
 			break;
-		case SGTZ:
-			executeExpansion(SLT, rd, 0, rs1, reg, mem, pgrm);
+		case SH:
+			wMn(mem,rR(reg,rs1) + rs2,rR(reg,rd),2);
+			pgrm->pc += 4;
 			break;
-		case BEQZ:
-			executeExpansion(BEQ, rd, 0, rs1, reg, mem, pgrm);
+		case MULH:
+			wR(reg,rd,(int32_t)(((int64_t)rR(reg,rs1) * rR(reg,rs2)) >> 32));
+			pgrm->pc += 4;
 			break;
-		case BNEZ:
-			executeExpansion(BNE, rd, 0, rs1, reg, mem, pgrm);
+		case MULHSU:
+			wR(reg,rd,(int32_t)(((int64_t)rR(reg,rs1) * (int64_t)(uint32_t)rR(reg,rs2)) >> 32));
+			pgrm->pc += 4;
 			break;
-		case BLEZ:
-			executeExpansion(BGE, 0, rd, rs1, reg, mem, pgrm);
+		case MULHU:
+			wR(reg,rd,(int32_t)(((uint64_t)(uint32_t)rR(reg,rs1) * (uint32_t)rR(reg,rs2)) >> 32));
+			pgrm->pc += 4;
+			break;
+		case DIV:
+			wR(reg,rd,divSigned(rR(reg,rs1),rR(reg,rs2)));
+			pgrm->pc += 4;
 			break;
-		case BGEZ:
-			executeExpansion(BGE, rd, 0, rs1, reg, mem, pgrm);
+		case DIVU:
+			wR(reg,rd,(rR(reg,rs2) == 0 ? -1 : (int32_t)((uint32_t)rR(reg,rs1) / (uint32_t)rR(reg,rs2))));
+			pgrm->pc += 4;
 			break;
-		case BLTZ:
-			executeExpansion(BLT, rd, 0, rs1, reg, mem, pgrm);
+		case REM:
+			wR(reg,rd,remSigned(rR(reg,rs1),rR(reg,rs2)));
+			pgrm->pc += 4;
 			break;
-		case BGTZ:
-			executeExpansion(BLT, 0, rd, rs1, reg, mem, pgrm);
+		case REMU:
+			wR(reg,rd,(rR(reg,rs2) == 0 ? rR(reg,rs1) : (int32_t)((uint32_t)rR(reg,rs1) % (uint32_t)rR(reg,rs2))));
+			pgrm->pc += 4;
 			break;
-		case BGT:
-			executeExpansion(BLT, rs1, rd, rs2, reg, mem, pgrm);
+		case ECALL:
+			environmentCall(reg,mem);
+			pgrm->pc += 4;
 			break;
-		case BLE:
-			executeExpansion(BGE, rs1, rd, rs2, reg, mem, pgrm);
+		case EBREAK:
+			printf("ERROR: ebreak at pc %d\n",pgrm->pc);
+			mem->halted = 1;
+			mem->exitCode = TRAP_EXIT;
 			break;
-		case  BGTU:
-			executeExpansion(BLTU, rs1, rd, rs2, reg, mem, pgrm);
+		case ILLEGAL:
+			printf("ERROR: illegal instruction 0x%08x at pc %d\n",(uint32_t)rs2,pgrm->pc);
+			mem->halted = 1;
+			mem->exitCode = TRAP_EXIT;
 			break;
-		case BLEU:
-			executeExpansion(BLTU, rs1, rd, rs2, reg, mem, pgrm);
+
+		//atomics, rd, rs2, rs1 like amoadd.w rd, rs2, (rs1)
+		case LR:
+			reg->reservedValue = amoM(mem,rR(reg,rs1),LR,0);
+			reg->reservation = rR(reg,rs1);
+			reg->reserved = 1;
+			wR(reg,rd,reg->reservedValue);
+			pgrm->pc += 4;
 			break;
-		case J:
-			executeExpansion(JAL, 0, rd, 0, reg, mem, pgrm);
+		case SC: {
+			int32_t addr = rR(reg,rs2);
+			int stored = reg->reserved && reg->reservation == addr && casM(mem,addr,reg->reservedValue,rR(reg,rs1));
+			reg->reserved = 0;
+			wR(reg,rd,stored ? 0 : 1);
+			pgrm->pc += 4;
 			break;
-		case JR:
-			executeExpansion(JALR, 0, rd, 0, reg, mem, pgrm);
+		}
+		case AMOSWAP ... AMOMAXU:
+			wR(reg,rd,amoM(mem,rR(reg,rs2),type,rR(reg,rs1)));
+			pgrm->pc += 4;
 			break;
-		case RET:
-			executeExpansion(JALR, 0, 1, 0, reg, mem, pgrm);
+		case FENCE:
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			pgrm->pc += 4;
 			break;
-		case CALL:
-			executeExpansion(JAL, 1, rd, 0, reg, mem, pgrm);
+		case CSRR:
+			if (rs1 == CSR_MHARTID) {
+				wR(reg,rd,reg->hartId);
+			} else {
+				printf("ERROR: csr 0x%x is not supported\n",rs1);
+				wR(reg,rd,0);
+			}
+			pgrm->pc += 4;
 			break;
-		case LEAVE:
-			executeExpansion(ADDI, 2, 8, 0, reg, mem, pgrm);
-			executeExpansion(LW, 8, 2, 0, reg, mem, pgrm);
-			executeExpansion(ADDI, 2, 2, 4, reg, mem, pgrm);
-			pgrm->pc -= 8;
+		case LI:
+		case MV ... CALL:
+			// only reached by commands that did not go through lowerProgram
+			executeCommand(lowerCommand(cmd), reg, mem, pgrm);
 			break;
 		default:
 			break;
@@ -509,6 +754,10 @@ CPU *createCPU (int32_t memsize, int32_t pgrmsize) {
 		cpu->reg = createRegister(32);
 		cpu->shared = createSharedMemory(memsize);
 		cpu->pgrm = createProgram(pgrmsize);
+		cpu->engine = ENGINE_SWITCH;
+		cpu->blocks = NULL;
+		cpu->jit = NULL;
+		cpu->retired = 0;
 	}
 	return cpu;
 
@@ -516,6 +765,8 @@ CPU *createCPU (int32_t memsize, int32_t pgrmsize) {
 
 void freeCPU (CPU *cpu) {
 
+	invalidateBlocks(cpu);
+	invalidateJit(cpu);
 	freeRegister(cpu->reg);
 	freeSharedMemory(cpu->shared);
 	freeProgram(cpu->pgrm);
@@ -523,16 +774,49 @@ void freeCPU (CPU *cpu) {
 
 }
 
+// Every engine hands pcs outside of the loaded program to runCommand, so
+// this is the one place that traps them. The trap halts the guest with
+// exit code TRAP_EXIT, so the engines stop right after it.
 void runCommand (CPU *cpu) {
 
-	Command cmd = getCommand(cpu->pgrm);
-	if (cmd.type == LW || cmd.type == SW) {
-		pthread_mutex_lock(&cpu->shared->mutex);
-		executeCommand(cmd,cpu->reg,cpu->shared->mem,cpu->pgrm);
-		pthread_mutex_unlock(&cpu->shared->mutex);
+	Program *pgrm = cpu->pgrm;
+	if (pgrm->pc < 0 || pgrm->pc/4 >= pgrm->length) {
+		printf("ERROR: pc %d is outside of the loaded program 0 / %d\n",pgrm->pc,pgrm->length*4-4);
+		cpu->shared->mem->halted = 1;
+		cpu->shared->mem->exitCode = TRAP_EXIT;
+		return;
+	}
+	executeCommand(getCommand(pgrm),cpu->reg,cpu->shared->mem,pgrm);
+
+}
+
+__thread uint64_t storeClock = 0;
+
+uint64_t runEngine (CPU *cpu, int lifetime) {
+
+	// every engine stops early once the guest stores to the halt device
+	uint64_t retired = 0;
+	if (cpu->engine == ENGINE_JIT) {
+		retired = runJit(cpu, lifetime);
+	} else if (cpu->engine == ENGINE_BLOCK) {
+		retired = runBlocks(cpu, lifetime);
+	} else if (cpu->engine == ENGINE_THREADED) {
+		retired = runThreaded(cpu, lifetime);
+	} else if (lifetime != -1) {
+		while (retired < (uint64_t)lifetime && !cpu->shared->mem->halted) {
+			storeClock = cpu->retired + retired + 1;
+			runCommand(cpu);
+			retired++;
+		}
 	} else {
-		executeCommand(cmd,cpu->reg,cpu->shared->mem,cpu->pgrm);	
+		while (!cpu->shared->mem->halted) {
+			storeClock = cpu->retired + retired + 1;
+			runCommand(cpu);
+			retired++;
+		}
 	}
+	cpu->retired += retired;
+	return retired;
 
 }
 
@@ -542,28 +826,75 @@ void *runCPU (void *args) {
 
 	CPU *cpu = ((CPUargs *)args)->cpu;
 	int lifetime = ((CPUargs *)args)->lifetime;
+	int harts = ((CPUargs *)args)->harts;
 
-	int instnum = 0;
-	if (lifetime != -1) {
-		while (instnum++ < lifetime) {
-			runCommand(cpu);
-		}
+	uint64_t allocs = getAllocations();
+	struct timespec start, stop;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	uint64_t retired;
+	if (harts > 1) {
+		retired = runHarts(cpu, harts, ((CPUargs *)args)->quantum, ((CPUargs *)args)->freeRunning, lifetime);
 	} else {
-		while (1) {
-			runCommand(cpu);
-		}
+		retired = runEngine(cpu, lifetime);
 	}
 
-	printf("Stopped running CPU\n");
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	((CPUargs *)args)->retired = retired;
+	((CPUargs *)args)->seconds = seconds;
+	printf("Stopped running CPU (%llu instructions in %.3f s, %.1f MIPS, %llu allocations while running)\n",
+		(unsigned long long)retired, seconds, retired / seconds / 1e6, (unsigned long long)(getAllocations() - allocs));
+	if (cpu->shared->mem->halted) {
+		printf("Guest halted with exit code %d\n", cpu->shared->mem->exitCode);
+	}
+	LockStats *stats = &cpu->shared->stats;
+	printf("Device lock taken %llu times, %llu contended, %.3f ms waiting\n",
+		(unsigned long long)stats->acquired, (unsigned long long)stats->contended, stats->waitNs / 1e6);
+	printf("%d memory pages touched\n", countTouched(cpu->shared->mem));
+	if (((CPUargs *)args)->snapshotSave != NULL) {
+		saveSnapshot(cpu, ((CPUargs *)args)->snapshotSave);
+	}
 	return NULL;
 
 }
 
-void readProgram (CPU *cpu, char *name) {
+void readProgram (CPU *cpu, char *name, char *asmCache) {
+
+	if (isAssembly(name)) {
+		// sources are assembled in place, compiler.py and its files are not needed
+		if (assembleProgram(cpu->pgrm, name, asmCache)) {
+			cpu->pgrm->pc = cpu->pgrm->entry;
+			lowerProgram(cpu->pgrm);
+			prepareThreaded(cpu->pgrm);
+			invalidateBlocks(cpu);
+			invalidateJit(cpu);
+		}
+		return;
+	}
 
 	FILE *file = fopen(name,"r");
 	if (file == NULL) {
 		printf("ERROR: cannot open provided file\n");
+	} else if (isImage(file)) {
+		// binary images are mapped as they are, the text parser is the fallback
+		fclose(file);
+		if (loadImage(cpu->pgrm, name)) {
+			cpu->pgrm->pc = cpu->pgrm->entry;
+			lowerProgram(cpu->pgrm);
+			prepareThreaded(cpu->pgrm);
+			invalidateBlocks(cpu);
+			invalidateJit(cpu);
+		}
+	} else if (isElf(file)) {
+		fclose(file);
+		if (loadElf(cpu, name)) {
+			cpu->pgrm->pc = cpu->pgrm->entry;
+			lowerProgram(cpu->pgrm);
+			prepareThreaded(cpu->pgrm);
+			invalidateBlocks(cpu);
+			invalidateJit(cpu);
+		}
 	} else {
 		char *line = NULL;
 		size_t len = 0;
@@ -586,6 +917,11 @@ void readProgram (CPU *cpu, char *name) {
 			addCommand(cpu->pgrm,lnum,type,a,b,c);
 			lnum++;
 		}
+		cpu->pgrm->length = lnum < cpu->pgrm->maxSize ? lnum : cpu->pgrm->maxSize;
+		lowerProgram(cpu->pgrm);
+		prepareThreaded(cpu->pgrm);
+		invalidateBlocks(cpu);
+		invalidateJit(cpu);
 		free(line);
 		fclose(file);
 	}
@@ -641,14 +977,10 @@ void *runIOConnector (void *args) {
 
 		} else {
 
-			pthread_mutex_lock(&cpu->shared->mutex);
-
 			// wM(cpu->shared->mem,baseAddr,atoi(buffer));
-			cpu->shared->mem->GPIO_IN = atoi(buffer);
+			__atomic_store_n(&cpu->shared->mem->GPIO_IN, atoi(buffer), __ATOMIC_RELEASE);
 			// printf("%d\n",cpu->shared->mem->GPIO_IN);
 
-			pthread_mutex_unlock(&cpu->shared->mutex);
-
 		}
 
 	}
@@ -659,40 +991,163 @@ void *runIOConnector (void *args) {
 
 }
 
+// Redraws only the rows that changed since the last frame, moving the
+// cursor there with ANSI escapes, and nothing at all while the display
+// does not change. saveDisplayState runs the queued I2C transfers first, so
+// a frame never shows half of a display command.
 void *printDisplay (void *args) {
 
+	Display *screen = malloc(sizeof(Display));
+	char (*shown)[COLS+1] = malloc(sizeof(char[PAGES*8][COLS+1]));
+	char (*pixels)[COLS+1] = malloc(sizeof(char[PAGES*8][COLS+1]));
+	if (screen == NULL || shown == NULL || pixels == NULL) {
+		printf("ERROR: Cannot allocate display buffer\n");
+		return NULL;
+	}
+	uint64_t version = 0;
+	int cleared = 0;
+
 	while (1) {
 		usleep(500000);
-		system("clear");
+		if (cleared && displayVersion() == version) {
+			continue;
+		}
+		busSync();
+		version = displayVersion();
+		saveDisplayState(screen);
+		renderDisplay(screen, pixels);
+		if (!cleared) {
+			printf("\033[H\033[2J");
+		}
 		for (int i = 0; i < PAGES*8; i++) {
-			printf("%s\n",getPixels()[i]);
+			if (!cleared || memcmp(shown[i], pixels[i], COLS) != 0) {
+				printf("\033[%d;1H%s", i + 1, pixels[i]);
+			}
 		}
+		printf("\033[%d;1H", PAGES*8 + 1);
+		fflush(stdout);
+		memcpy(shown, pixels, sizeof(char[PAGES*8][COLS+1]));
+		cleared = 1;
 	}
 	return NULL;
 
 }
 
-void runSimulation (int memsize, int pgrmsize, int lifetime, char *file, int baseAddr, int debugger) {
+// one JSON line for scripts, printed last in headless mode
+void printSummary (CPU *cpu, CPUargs *runnerArgs) {
+
+	Memory *mem = cpu->shared->mem;
+	double mips = runnerArgs->seconds > 0 ? runnerArgs->retired / runnerArgs->seconds / 1e6 : 0;
+	printf("{\"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.1f, \"load_seconds\": %.6f, \"program_length\": %d, "
+		"\"halted\": %s, \"exit_code\": %d, \"pc\": %d, \"registers\": [",
+		(unsigned long long)runnerArgs->retired, runnerArgs->seconds, mips, runnerArgs->loadSeconds, cpu->pgrm->length,
+		mem->halted ? "true" : "false", mem->exitCode, cpu->pgrm->pc);
+	for (int i = 0; i < cpu->reg->size; i++) {
+		printf(i == 0 ? "%d" : ", %d", rR(cpu->reg, i));
+	}
+	printf("]}\n");
+
+}
+
+// Headless runs have no display thread and no socket, the CPU runs on the
+// calling thread until it halts or its lifetime is used up. The exit status
+// is the guest's exit code, or EXIT_LIFETIME if it never halted.
+int runSimulation (Options *opts) {
 
 	pthread_t runner, io, display;
 
-	CPU *cpu = createCPU(memsize, pgrmsize);
+	CPU *cpu = createCPU(opts->memsize, opts->pgrmsize);
+	cpu->engine = opts->engine;
 
 	createDisplay();
+	createBus();
 
-	readProgram(cpu,file);
+	struct timespec start, stop;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	readProgram(cpu,opts->file,opts->asmCache);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
 
 	CPUargs *runnerArgs = malloc(sizeof(CPUargs));
 	runnerArgs->cpu = cpu;
-	runnerArgs->lifetime = lifetime;
+	runnerArgs->lifetime = opts->lifetime;
+	runnerArgs->harts = opts->harts;
+	runnerArgs->quantum = opts->quantum;
+	runnerArgs->freeRunning = opts->freeRunning;
+	runnerArgs->snapshotSave = opts->snapshotSave;
+	runnerArgs->loadSeconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+	// the snapshot replaces the state the program starts in, batch jobs
+	// restore it again for every job
+	Snapshot *snapshot = NULL;
+	if (opts->snapshotLoad != NULL) {
+		snapshot = openSnapshot(opts->snapshotLoad);
+		if (snapshot == NULL || !restoreSnapshot(cpu, snapshot)) {
+			if (snapshot != NULL) {
+				closeSnapshot(snapshot);
+			}
+			freeCPU(cpu);
+			deleteBus();
+			deleteDisplay();
+			free(runnerArgs);
+			return 1;
+		}
+		if (opts->batch == NULL) {
+			closeSnapshot(snapshot);
+			snapshot = NULL;
+		}
+	}
+
+	if (opts->batch != NULL) {
+		int ok = runBatch(cpu, opts->batch, opts->batchOut, opts->workers, opts->lifetime, snapshot);
+		if (snapshot != NULL) {
+			closeSnapshot(snapshot);
+		}
+		freeCPU(cpu);
+		deleteBus();
+		deleteDisplay();
+		free(runnerArgs);
+		return ok ? 0 : 1;
+	}
+
+	if (opts->capture != NULL) {
+		if (!startCapture(opts->capture, opts->capturePbm)) {
+			freeCPU(cpu);
+			deleteBus();
+			deleteDisplay();
+			free(runnerArgs);
+			return 1;
+		}
+		captureFrames(1);
+	}
+
+	if (opts->headless) {
+		runCPU(runnerArgs);
+		printSummary(cpu, runnerArgs);
+		int status = cpu->shared->mem->halted ? cpu->shared->mem->exitCode & 0xFF : EXIT_LIFETIME;
+		captureFrames(0);
+		stopCapture();
+		freeCPU(cpu);
+		deleteBus();
+		deleteDisplay();
+		free(runnerArgs);
+		return status;
+	}
 
 	IOargs *ioArgs = malloc(sizeof(IOargs));
 	ioArgs->cpu = cpu;
-	ioArgs->baseAddr = baseAddr;
-        switch (debugger) {
+	ioArgs->baseAddr = opts->baseAddr;
+	DebuggerArgs *debuggerArgs = malloc(sizeof(DebuggerArgs));
+	debuggerArgs->cpu = cpu;
+	debuggerArgs->historyBudget = (size_t)opts->historyMB << 20;
+	debuggerArgs->checkpointInterval = opts->checkpointInterval;
+	debuggerArgs->breakpoints = opts->breakpoints;
+	debuggerArgs->breakpointCount = opts->breakpointCount;
+	debuggerArgs->watchpoints = opts->watchpoints;
+	debuggerArgs->watchpointCount = opts->watchpointCount;
+        switch (opts->debugger) {
                 case 1:
 
-		if (pthread_create(&runner,NULL,startDebugger,cpu)) {
+		if (pthread_create(&runner,NULL,startDebugger,debuggerArgs)) {
 
 			printf("ERROR: Failed to create Runner Thread\n");
 			exit(EXIT_FAILURE);
@@ -734,7 +1189,7 @@ void runSimulation (int memsize, int pgrmsize, int lifetime, char *file, int bas
 		exit(EXIT_FAILURE);
 
 	}
-	if (debugger == 0) {
+	if (opts->debugger == 0) {
 		if (pthread_join(display,NULL)) {
 
 			printf("ERROR: joining thread Display\n");
@@ -750,28 +1205,143 @@ void runSimulation (int memsize, int pgrmsize, int lifetime, char *file, int bas
 
 	}
 
+	captureFrames(0);
+	stopCapture();
 	freeCPU(cpu);
+	deleteBus();
 	deleteDisplay();
 	free(runnerArgs);
 	free(ioArgs);
+	free(debuggerArgs);
+	return 0;
 
 }
 
 void resetCPU (CPU *cpu) {
 
-	freeMemory(cpu->shared->mem);
+	// keeps the mapping and its size, only the touched pages are dropped
+	resetMemory(cpu->shared->mem);
 	freeRegister(cpu->reg);
-	cpu->shared->mem = createMemory(10000000);
 	cpu->reg = createRegister(32);
-	cpu->pgrm->pc = 0;
+	if (cpu->pgrm->segments != NULL) {
+		restoreElf(cpu);
+	}
+	cpu->pgrm->pc = cpu->pgrm->entry;
+	cpu->retired = 0;
+	invalidateBlocks(cpu);
+	invalidateJit(cpu);
 
 }
 
 int main (int argc, char **argv) {
 
-	runSimulation(10000000,10000000,-1,argv[1],1000, atoi(argv[2]));
+	if (argc < 3) {
+		printf("ERROR: usage: simulator <program> <debugger 0/1> [--engine=...] [--lifetime=N] [--headless] [--harts=N] [--quantum=N] [--free-running]\n\t[--batch=FILE] [--batch-out=FILE] [--workers=N] [--asm-cache=DIR] [--no-asm-cache]\n\t[--snapshot-save=FILE] [--snapshot-load=FILE] [--history=MB] [--checkpoint-interval=N]\n\t[--break=LINE[:REG OP VALUE][:hits=N]] [--watch=ADDR[:BYTES][:r|w|rw|c]]\n\t[--capture=FILE] [--capture-pbm=DIR]\n");
+		return 1;
+	}
 
-	return 0;
+	// the debugger always steps through runCommand, --engine only affects runCPU
+	Options opts = {10000000, 10000000, -1, argv[1], 1000, atoi(argv[2]), ENGINE_THREADED, 0, 1, 10000, 0,
+		NULL, "batch_results.jsonl", 0, ".asmcache", NULL, NULL, 64, 100000,
+		malloc(sizeof(Breakpoint)*argc), 0, malloc(sizeof(Watchpoint)*argc), 0, NULL, NULL};
+	for (int i = 3; i < argc; i++) {
+		if (strcmp(argv[i],"--engine=switch") == 0) {
+			opts.engine = ENGINE_SWITCH;
+		} else if (strcmp(argv[i],"--engine=threaded") == 0) {
+			opts.engine = ENGINE_THREADED;
+		} else if (strcmp(argv[i],"--engine=block") == 0) {
+			opts.engine = ENGINE_BLOCK;
+		} else if (strcmp(argv[i],"--engine=jit") == 0) {
+			opts.engine = ENGINE_JIT;
+		} else if (strncmp(argv[i],"--lifetime=",11) == 0) {
+			opts.lifetime = atoi(argv[i]+11);
+		} else if (strcmp(argv[i],"--headless") == 0) {
+			opts.headless = 1;
+		} else if (strncmp(argv[i],"--harts=",8) == 0) {
+			opts.harts = atoi(argv[i]+8);
+		} else if (strncmp(argv[i],"--quantum=",10) == 0) {
+			opts.quantum = atoi(argv[i]+10);
+		} else if (strcmp(argv[i],"--free-running") == 0) {
+			opts.freeRunning = 1;
+		} else if (strncmp(argv[i],"--batch=",8) == 0) {
+			opts.batch = argv[i]+8;
+		} else if (strncmp(argv[i],"--batch-out=",12) == 0) {
+			opts.batchOut = argv[i]+12;
+		} else if (strncmp(argv[i],"--workers=",10) == 0) {
+			opts.workers = atoi(argv[i]+10);
+		} else if (strncmp(argv[i],"--asm-cache=",12) == 0) {
+			opts.asmCache = argv[i]+12;
+		} else if (strcmp(argv[i],"--no-asm-cache") == 0) {
+			opts.asmCache = NULL;
+		} else if (strncmp(argv[i],"--snapshot-save=",16) == 0) {
+			opts.snapshotSave = argv[i]+16;
+		} else if (strncmp(argv[i],"--snapshot-load=",16) == 0) {
+			opts.snapshotLoad = argv[i]+16;
+		} else if (strncmp(argv[i],"--history=",10) == 0) {
+			opts.historyMB = atoi(argv[i]+10);
+		} else if (strncmp(argv[i],"--checkpoint-interval=",22) == 0) {
+			opts.checkpointInterval = atoi(argv[i]+22);
+		} else if (strncmp(argv[i],"--break=",8) == 0) {
+			if (!parseBreakpoint(argv[i]+8, &opts.breakpoints[opts.breakpointCount++])) {
+				printf("ERROR: %s is not LINE[:REG OP VALUE][:hits=N]\n",argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i],"--watch=",8) == 0) {
+			if (!parseWatchpoint(argv[i]+8, &opts.watchpoints[opts.watchpointCount++])) {
+				printf("ERROR: %s is not ADDR[:BYTES][:r|w|rw|c]\n",argv[i]);
+				return 1;
+			}
+		} else if (strncmp(argv[i],"--capture=",10) == 0) {
+			opts.capture = argv[i]+10;
+		} else if (strncmp(argv[i],"--capture-pbm=",14) == 0) {
+			opts.capturePbm = argv[i]+14;
+		} else {
+			printf("ERROR: unknown option %s\n",argv[i]);
+			return 1;
+		}
+	}
+	if (opts.headless && opts.debugger) {
+		printf("ERROR: --headless cannot be combined with the debugger\n");
+		return 1;
+	}
+	if ((opts.breakpointCount > 0 || opts.watchpointCount > 0) && !opts.debugger) {
+		printf("ERROR: --break and --watch need the debugger\n");
+		return 1;
+	}
+	if (opts.historyMB < 0 || opts.checkpointInterval < 1) {
+		printf("ERROR: --history has to be at least 0 MB and --checkpoint-interval at least 1\n");
+		return 1;
+	}
+	if (opts.harts < 1 || opts.harts > MAX_HARTS || opts.quantum < 1) {
+		printf("ERROR: --harts has to be 1 to %d and --quantum at least 1\n",MAX_HARTS);
+		return 1;
+	}
+	if (opts.harts > 1 && opts.debugger) {
+		printf("ERROR: the debugger only runs a single hart\n");
+		return 1;
+	}
+	if (opts.batch != NULL && (opts.debugger || opts.harts > 1)) {
+		printf("ERROR: --batch runs single harts without the debugger\n");
+		return 1;
+	}
+	if (opts.snapshotSave != NULL && (opts.debugger || opts.harts > 1 || opts.batch != NULL)) {
+		printf("ERROR: --snapshot-save saves a single hart run without the debugger\n");
+		return 1;
+	}
+
+	if (opts.capture != NULL && (opts.debugger || opts.batch != NULL)) {
+		printf("ERROR: --capture runs without the debugger and --batch\n");
+		return 1;
+	}
+	if (opts.capturePbm != NULL && opts.capture == NULL) {
+		printf("ERROR: --capture-pbm needs --capture\n");
+		return 1;
+	}
+
+	int status = runSimulation(&opts);
+	free(opts.breakpoints);
+	free(opts.watchpoints);
+	return status;
 
 }
 